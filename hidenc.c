@@ -0,0 +1,3799 @@
+// The embedding engine and the library interface of hidenc.h. Also linked into the command
+// line tool, which reaches the engine through stego.h.
+#include "hidenc.h"
+#include "stego.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+// stb allocates through the allocator of the library call running on the thread
+static void *callMalloc(size_t size);
+static void *callRealloc(void *ptr, size_t oldSize, size_t newSize);
+static void callFree(void *ptr);
+#define STBI_MALLOC(size) callMalloc(size)
+#define STBI_REALLOC_SIZED(ptr, oldSize, newSize) callRealloc(ptr, oldSize, newSize)
+#define STBI_FREE(ptr) callFree(ptr)
+
+#define STB_IMAGE_IMPLEMENTATION
+// Largest width or height accepted from any image; build with -DSTBI_MAX_DIMENSIONS=N to change it
+#ifndef STBI_MAX_DIMENSIONS
+#define STBI_MAX_DIMENSIONS (1 << 24)
+#endif
+#include "stb_image.h"
+
+#ifndef STBI_THREAD_LOCAL
+#error "hidenc needs a compiler with thread-local storage"
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef STBI_SSE2
+#include <immintrin.h>
+#ifndef _MSC_VER
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_BMI2 __attribute__((target("bmi2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define FORCE_INLINE static inline __attribute__((always_inline))
+#define byteSwap64 __builtin_bswap64
+#else
+#define TARGET_AVX2
+#define TARGET_BMI2
+#define TARGET_SSSE3
+#define FORCE_INLINE static __forceinline
+#define byteSwap64 _byteswap_uint64
+#endif
+
+// Embed and extract kernels specialized for one depth
+typedef struct {
+    void (*embed)(unsigned char *channels, size_t count, const unsigned char *bits);
+    void (*extract)(const unsigned char *channels, size_t count, unsigned char *bits);
+} StegoKernels;
+
+// Kernels selected for this CPU by initStegoEngine, indexed by depth. Written once, then only read.
+static StegoKernels stegoKernels[MAX_CHANNEL_BITS + 1];
+
+// RGB <-> BGR swizzle kernel selected by initStegoEngine
+static void (*swapKernel)(const unsigned char *src, unsigned char *dst, size_t pixels);
+
+// PNG row filter kernel selected by initStegoEngine. Returns the filter type picked for the row.
+static int (*filterKernel)(const unsigned char *row, const unsigned char *prior, size_t stride, unsigned char *out);
+
+#ifdef _WIN32
+static INIT_ONCE engineOnce = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t engineOnce = PTHREAD_ONCE_INIT;
+#endif
+
+// Allocator of the library call running on this thread, NULL outside of one
+static STBI_THREAD_LOCAL const hidenc_allocator *callAllocator;
+
+// Number of channels needed to carry length payload bytes at the given depth
+uint64_t payloadChannels(uint64_t length, int depth) {
+    return (length * 8 + depth - 1) / depth;
+}
+
+// Largest payload in bytes the image can carry at the given depth
+uint64_t payloadCapacity(PixelsData pixelsData, int depth) {
+    uint64_t channels = (uint64_t)pixelsData.width * pixelsData.height * 3;
+    if (channels < HEADER_CHANNELS) {
+        return 0;
+    }
+    return (channels - HEADER_CHANNELS) * depth / 8;
+}
+
+// Returns 1 if the image can carry the header and length payload bytes at the given depth. One
+// with fewer than HEADER_CHANNELS channels can't carry even an empty payload.
+int payloadFits(PixelsData pixelsData, uint64_t length, int depth) {
+    return (uint64_t)pixelsData.width * pixelsData.height * 3 >= HEADER_CHANNELS &&
+           length <= payloadCapacity(pixelsData, depth);
+}
+
+// Embeds exactly length payload bytes without reading past the end of payload. Every group of
+// 8 channels carries exactly `depth` bytes; the remainder goes through a zero-padded copy.
+void embedBytes(unsigned char *channels, const unsigned char *payload, uint64_t length, int depth) {
+    uint64_t groups = length / depth;
+    embedChannels(channels, groups * 8, payload, depth);
+
+    unsigned char tail[MAX_CHANNEL_BITS] = {0};
+    size_t rest = (size_t)(length - groups * depth);
+    memcpy(tail, payload + groups * depth, rest);
+    embedChannels(channels + groups * 8, payloadChannels(rest, depth), tail, depth);
+}
+
+// Extracts exactly length payload bytes without writing past the end of payload
+void extractBytes(const unsigned char *channels, unsigned char *payload, uint64_t length, int depth) {
+    uint64_t groups = length / depth;
+    extractChannels(channels, groups * 8, payload, depth);
+
+    unsigned char tail[MAX_CHANNEL_BITS + 1];
+    size_t rest = (size_t)(length - groups * depth);
+    extractChannels(channels + groups * 8, payloadChannels(rest, depth), tail, depth);
+    memcpy(payload + groups * depth, tail, rest);
+}
+
+void encodeHeader(StegoHeader header, unsigned char *bytes) {
+    bytes[0] = HEADER_MAGIC0;
+    bytes[1] = HEADER_MAGIC1;
+    bytes[2] = (unsigned char)(HEADER_VERSION << 4 | header.depth);
+    bytes[3] = 0; // Reserved
+    for (int i = 0; i < 8; i++) {
+        bytes[4 + i] = (unsigned char)(header.length >> (56 - 8 * i));
+    }
+}
+
+void writeHeader(PixelsData pixelsData, StegoHeader header) {
+    unsigned char bytes[HEADER_BYTES];
+    encodeHeader(header, bytes);
+    embedChannels(pixelsData.data, HEADER_CHANNELS, bytes, HEADER_CHANNEL_BITS);
+}
+
+// Returns 1 if the image carries a valid header that fits in it
+int readHeader(PixelsData pixelsData, StegoHeader *header) {
+    unsigned char bytes[HEADER_BYTES];
+    if ((uint64_t)pixelsData.width * pixelsData.height * 3 < HEADER_CHANNELS) {
+        return 0;
+    }
+    extractChannels(pixelsData.data, HEADER_CHANNELS, bytes, HEADER_CHANNEL_BITS);
+    return decodeHeader(bytes, pixelsData, header);
+}
+
+// Parses the header bytes. Returns 1 if they hold a valid header for an image of that shape.
+int decodeHeader(const unsigned char *bytes, PixelsData shape, StegoHeader *header) {
+    if (bytes[0] != HEADER_MAGIC0 || bytes[1] != HEADER_MAGIC1 || bytes[2] >> 4 != HEADER_VERSION) {
+        return 0;
+    }
+
+    header->depth = bytes[2] & 0xF;
+    header->length = 0;
+    for (int i = 0; i < 8; i++) {
+        header->length = header->length << 8 | bytes[4 + i];
+    }
+    if (header->depth < MIN_CHANNEL_BITS || header->depth > MAX_CHANNEL_BITS ||
+        header->length > payloadCapacity(shape, header->depth)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Images from older versions: a 9-bit count of 3-bit codes in the first pixel, followed by
+// one 9-bit code per character, all at 3 bits per channel. Those versions only hid typed text,
+// as codes below 256, so the count must be a multiple of 3 and every character printable;
+// anything else is an image without a message. Returns 1 with the payload length if it holds one.
+int findLegacyPayload(PixelsData pixelsData, uint64_t *length) {
+    unsigned char headerBits[2] = {0, 0};
+    extractChannels(pixelsData.data, 3, headerBits, 3);
+    BitStream header = {headerBits, sizeof(headerBits), 0};
+    uint32_t codes = bitStreamRead(&header, 9);
+    size_t textLength = codes / 3;
+    if (codes == 0 || codes % 3 != 0 || textLength + 1 > (size_t)pixelsData.width * pixelsData.height) {
+        return 0;
+    }
+    const unsigned char *channels = pixelsData.data + 3;
+    for (size_t i = 0; i < textLength; i++, channels += 3) {
+        int c = (channels[0] & 7) << 6 | (channels[1] & 7) << 3 | (channels[2] & 7);
+        if ((c < ' ' || c > '~') && c != '\t' && c != '\n' && c != '\r') {
+            return 0;
+        }
+    }
+    *length = textLength;
+    return 1;
+}
+
+// Extracts the characters of an older image. Each is the low byte of the 9-bit code spread
+// over the next 3 channels.
+void extractLegacyBytes(PixelsData pixelsData, unsigned char *payload, uint64_t length) {
+    const unsigned char *channels = pixelsData.data + 3;
+    for (uint64_t i = 0; i < length; i++, channels += 3) {
+        payload[i] = (unsigned char)((channels[0] & 7) << 6 | (channels[1] & 7) << 3 | (channels[2] & 7));
+    }
+}
+
+// Reads the next nbits of the stream, most significant bit first
+uint32_t bitStreamRead(BitStream *bs, int nbits) {
+    uint32_t value = 0;
+    while (nbits > 0) {
+        int room = 8 - (int)(bs->bitPos & 7);
+        int take = nbits < room ? nbits : room;
+        uint32_t chunk = (bs->data[bs->bitPos >> 3] >> (room - take)) & ((1u << take) - 1);
+        value = (value << take) | chunk;
+        bs->bitPos += take;
+        nbits -= take;
+    }
+    return value;
+}
+
+// Embeds the part of a channel span that falls inside a strip. The span starts at image channel
+// spanStart, carries spanCount channels at the given depth, and bits holds its bitstream
+// starting at byte bitsFirstByte.
+void embedSpanInStrip(unsigned char *strip, uint64_t stripStart, uint64_t stripCount,
+                      uint64_t spanStart, uint64_t spanCount,
+                      const unsigned char *bits, uint64_t bitsFirstByte, int depth) {
+    uint64_t lo = stripStart > spanStart ? stripStart : spanStart;
+    uint64_t hi = stripStart + stripCount < spanStart + spanCount ? stripStart + stripCount : spanStart + spanCount;
+    if (lo >= hi) {
+        return;
+    }
+
+    unsigned char *channels = strip + (lo - stripStart);
+    uint64_t count = hi - lo;
+    BitStream stream = {(unsigned char *)bits, 0, (lo - spanStart) * depth - bitsFirstByte * 8};
+
+    // Channels before the next byte boundary of the bitstream go one at a time
+    const unsigned char mask = (1 << depth) - 1;
+    while (count > 0 && (stream.bitPos & 7) != 0) {
+        *channels = (*channels & ~mask) | (unsigned char)bitStreamRead(&stream, depth);
+        channels++;
+        count--;
+    }
+    embedChannels(channels, count, bits + (stream.bitPos >> 3), depth);
+}
+
+// Fills layout from the headers if they describe an uncompressed 24-bit BMP
+int bmpLayoutFromHeaders(const BMPFileHeader *fileHeader, const BMPInfoHeader *infoHeader, BmpLayout *layout) {
+    if (fileHeader->bfType != 0x4D42 || infoHeader->biSize < sizeof(BMPInfoHeader) ||
+        infoHeader->biBitCount != 24 || infoHeader->biCompression != 0 ||
+        infoHeader->biWidth <= 0 || infoHeader->biHeight == 0 || infoHeader->biHeight == INT32_MIN ||
+        infoHeader->biWidth > STBI_MAX_DIMENSIONS || infoHeader->biHeight > STBI_MAX_DIMENSIONS ||
+        infoHeader->biHeight < -STBI_MAX_DIMENSIONS) {
+        return 0;
+    }
+    layout->width = infoHeader->biWidth;
+    layout->height = infoHeader->biHeight > 0 ? infoHeader->biHeight : -infoHeader->biHeight;
+    layout->bottomUp = infoHeader->biHeight > 0;
+    layout->dataOffset = fileHeader->bfOffBits;
+    layout->rowSize = ((size_t)layout->width * 3 + 3) & ~(size_t)3;
+    return 1;
+}
+
+// Like parseBmpHeaders for a whole BMP file held in memory; also checks the pixels are there
+int parseBmpBytes(const unsigned char *bytes, uint64_t size, BmpLayout *layout) {
+    BMPFileHeader fileHeader;
+    BMPInfoHeader infoHeader;
+    if (size < sizeof(fileHeader) + sizeof(infoHeader)) {
+        return 0;
+    }
+    memcpy(&fileHeader, bytes, sizeof(fileHeader));
+    memcpy(&infoHeader, bytes + sizeof(fileHeader), sizeof(infoHeader));
+    return bmpLayoutFromHeaders(&fileHeader, &infoHeader, layout) &&
+           layout->dataOffset + (uint64_t)layout->rowSize * layout->height <= size;
+}
+
+// File offset of the block of rows holding top-down rows [firstRow, firstRow + rows)
+uint64_t bmpRowsOffset(const BmpLayout *layout, int firstRow, int rows) {
+    int firstFileRow = layout->bottomUp ? layout->height - firstRow - rows : firstRow;
+    return layout->dataOffset + (uint64_t)firstFileRow * layout->rowSize;
+}
+
+// Converts a block of rows as stored in the BMP (BGR, padded, file order) to top-down RGB
+void bmpRowsToRgb(const BmpLayout *layout, const unsigned char *fileRows, unsigned char *rgb, int rows) {
+    size_t rowBytes = (size_t)layout->width * 3;
+    for (int i = 0; i < rows; i++) {
+        const unsigned char *src = fileRows + (size_t)(layout->bottomUp ? rows - 1 - i : i) * layout->rowSize;
+        swapRedBlue(src, rgb + i * rowBytes, layout->width);
+    }
+}
+
+// Converts top-down RGB rows to a block of rows as stored in the BMP. Padding is left untouched.
+void rgbToBmpRows(const BmpLayout *layout, const unsigned char *rgb, unsigned char *fileRows, int rows) {
+    size_t rowBytes = (size_t)layout->width * 3;
+    for (int i = 0; i < rows; i++) {
+        const unsigned char *src = rgb + (size_t)(layout->bottomUp ? rows - 1 - i : i) * rowBytes;
+        swapRedBlue(src, fileRows + (size_t)i * layout->rowSize, layout->width);
+    }
+}
+
+// Replaces the low `depth` bits of each channel byte with the next bits of the packed payload
+void embedChannels(unsigned char *channels, size_t count, const unsigned char *bits, int depth) {
+    stegoKernels[depth].embed(channels, count, bits);
+}
+
+// Packs the low `depth` bits of each channel byte into bits, most significant bit first
+void extractChannels(const unsigned char *channels, size_t count, unsigned char *bits, int depth) {
+    stegoKernels[depth].extract(channels, count, bits);
+}
+
+// The kernels below are written once with the depth as a parameter and force-inlined into one
+// wrapper per depth (see STEGO_KERNELS), so every inner loop is compiled for a constant depth.
+
+// Scalar embed kernel, also used for the tails of the SIMD kernels
+FORCE_INLINE void embedScalar(unsigned char *channels, size_t count, const unsigned char *bits, const int depth) {
+    const unsigned char mask = (1 << depth) - 1;
+    uint32_t acc = 0;
+    int accBits = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (accBits < depth) {
+            acc = (acc << 8) | *bits++;
+            accBits += 8;
+        }
+        accBits -= depth;
+        channels[i] = (channels[i] & ~mask) | ((acc >> accBits) & mask);
+    }
+}
+
+// Scalar extract kernel, also used for the tails of the SIMD kernels
+FORCE_INLINE void extractScalar(const unsigned char *channels, size_t count, unsigned char *bits, const int depth) {
+    const unsigned char mask = (1 << depth) - 1;
+    uint32_t acc = 0;
+    int accBits = 0;
+    for (size_t i = 0; i < count; i++) {
+        acc = (acc << depth) | (channels[i] & mask);
+        accBits += depth;
+        if (accBits >= 8) {
+            accBits -= 8;
+            *bits++ = (unsigned char)(acc >> accBits);
+        }
+    }
+    if (accBits > 0) {
+        *bits = (unsigned char)(acc << (8 - accBits));
+    }
+}
+
+#ifdef STBI_SSE2
+// Every 8 channel bytes carry exactly `depth` payload bytes. spreadTable[depth][j][b] holds the
+// contribution of payload byte j (with value b) to those 8 channels, one channel per byte.
+static uint64_t spreadTable[MAX_CHANNEL_BITS + 1][MAX_CHANNEL_BITS][256];
+
+// gatherTable[depth][p][m]: m holds bit p of 8 consecutive channels (channel 0 in bit 0), the entry
+// is their contribution to the 8 * depth packed payload bits (channel 0 at the top)
+static uint32_t gatherTable[MAX_CHANNEL_BITS + 1][MAX_CHANNEL_BITS][256];
+
+static void initKernelTables(void) {
+    for (int depth = 1; depth <= MAX_CHANNEL_BITS; depth++) {
+        for (int j = 0; j < depth; j++) {
+            for (int b = 0; b < 256; b++) {
+                uint64_t v = 0;
+                for (int t = 0; t < 8; t++) {
+                    if (b & (0x80 >> t)) {
+                        int bit = j * 8 + t; // Position in the stream, MSB first
+                        int channel = bit / depth;
+                        int shift = depth - 1 - bit % depth;
+                        v |= (uint64_t)1 << (channel * 8 + shift);
+                    }
+                }
+                spreadTable[depth][j][b] = v;
+            }
+        }
+        for (int p = 0; p < depth; p++) {
+            for (int m = 0; m < 256; m++) {
+                uint32_t v = 0;
+                for (int channel = 0; channel < 8; channel++) {
+                    if (m & (1 << channel)) {
+                        v |= (uint32_t)1 << ((7 - channel) * depth + p);
+                    }
+                }
+                gatherTable[depth][p][m] = v;
+            }
+        }
+    }
+}
+
+// Expands `depth` payload bytes into the payload values of 8 channels
+FORCE_INLINE uint64_t spreadGroup(const unsigned char *bits, const int depth) {
+    uint64_t v = 0;
+    for (int j = 0; j < depth; j++) {
+        v |= spreadTable[depth][j][bits[j]];
+    }
+    return v;
+}
+
+// Writes the 8 * depth packed bits in v as `depth` bytes, most significant first
+FORCE_INLINE void storeGroup(unsigned char *bits, uint64_t v, const int depth) {
+    for (int j = 0; j < depth; j++) {
+        bits[j] = (unsigned char)(v >> (8 * (depth - 1 - j)));
+    }
+}
+
+// 16 channel bytes per iteration
+FORCE_INLINE void embedSSE2(unsigned char *channels, size_t count, const unsigned char *bits, const int depth) {
+    const __m128i keep = _mm_set1_epi8((char)~((1 << depth) - 1));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, bits += 2 * depth) {
+        __m128i payload = _mm_set_epi64x((long long)spreadGroup(bits + depth, depth),
+                                         (long long)spreadGroup(bits, depth));
+        __m128i c = _mm_loadu_si128((const __m128i *)(channels + i));
+        _mm_storeu_si128((__m128i *)(channels + i), _mm_or_si128(_mm_and_si128(c, keep), payload));
+    }
+    embedScalar(channels + i, count - i, bits, depth);
+}
+
+// 32 channel bytes per iteration
+TARGET_AVX2 FORCE_INLINE void embedAVX2(unsigned char *channels, size_t count, const unsigned char *bits, const int depth) {
+    const __m256i keep = _mm256_set1_epi8((char)~((1 << depth) - 1));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32, bits += 4 * depth) {
+        __m256i payload = _mm256_set_epi64x((long long)spreadGroup(bits + 3 * depth, depth),
+                                            (long long)spreadGroup(bits + 2 * depth, depth),
+                                            (long long)spreadGroup(bits + depth, depth),
+                                            (long long)spreadGroup(bits, depth));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(channels + i));
+        _mm256_storeu_si256((__m256i *)(channels + i), _mm256_or_si256(_mm256_and_si256(c, keep), payload));
+    }
+    embedScalar(channels + i, count - i, bits, depth);
+}
+
+// 16 channel bytes per iteration: one shift+movemask per payload bit plane
+FORCE_INLINE void extractSSE2(const unsigned char *channels, size_t count, unsigned char *bits, const int depth) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, bits += 2 * depth) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(channels + i));
+        uint32_t lo = 0, hi = 0;
+        for (int p = 0; p < depth; p++) {
+            // Moves bit p of every byte into its sign bit
+            int plane = _mm_movemask_epi8(_mm_slli_epi16(c, 7 - p));
+            lo |= gatherTable[depth][p][plane & 0xFF];
+            hi |= gatherTable[depth][p][plane >> 8];
+        }
+        storeGroup(bits, lo, depth);
+        storeGroup(bits + depth, hi, depth);
+    }
+    extractScalar(channels + i, count - i, bits, depth);
+}
+
+// 8 channel bytes per pext. Byte swapping puts channel 0 in the top byte so the gathered
+// bits come out most significant first.
+TARGET_BMI2 FORCE_INLINE void extractBMI2(const unsigned char *channels, size_t count, unsigned char *bits, const int depth) {
+    const uint64_t mask = 0x0101010101010101ULL * ((1 << depth) - 1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8, bits += depth) {
+        uint64_t c;
+        memcpy(&c, channels + i, sizeof(c));
+        storeGroup(bits, _pext_u64(byteSwap64(c), mask), depth);
+    }
+    extractScalar(channels + i, count - i, bits, depth);
+}
+
+static int cpuHasAvx2(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) { // OSXSAVE and AVX
+        return 0;
+    }
+    if ((_xgetbv(0) & 6) != 6) { // OS saves XMM and YMM state
+        return 0;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// BMI2 with pext implemented in hardware (AMD runs it in microcode before Zen 3)
+static int cpuHasFastPext(void) {
+    int info[4];
+#ifdef _MSC_VER
+    __cpuidex(info, 7, 0);
+    if (!(info[1] & (1 << 8))) {
+        return 0;
+    }
+    __cpuid(info, 0);
+#else
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("bmi2")) {
+        return 0;
+    }
+    __cpuid(0, info[0], info[1], info[2], info[3]);
+#endif
+    if (info[1] != 0x68747541) { // "Auth" of "AuthenticAMD"
+        return 1;
+    }
+#ifdef _MSC_VER
+    __cpuid(info, 1);
+#else
+    __cpuid(1, info[0], info[1], info[2], info[3]);
+#endif
+    int family = (info[0] >> 8) & 0xF;
+    if (family == 0xF) {
+        family += (info[0] >> 20) & 0xFF;
+    }
+    return family >= 0x19;
+}
+
+// Instantiates every kernel for one depth
+#define STEGO_KERNELS(D) \
+    static void embedScalar##D(unsigned char *c, size_t n, const unsigned char *b) { embedScalar(c, n, b, D); } \
+    static void extractScalar##D(const unsigned char *c, size_t n, unsigned char *b) { extractScalar(c, n, b, D); } \
+    static void embedSSE2_##D(unsigned char *c, size_t n, const unsigned char *b) { embedSSE2(c, n, b, D); } \
+    TARGET_AVX2 static void embedAVX2_##D(unsigned char *c, size_t n, const unsigned char *b) { embedAVX2(c, n, b, D); } \
+    static void extractSSE2_##D(const unsigned char *c, size_t n, unsigned char *b) { extractSSE2(c, n, b, D); } \
+    TARGET_BMI2 static void extractBMI2_##D(const unsigned char *c, size_t n, unsigned char *b) { extractBMI2(c, n, b, D); }
+#else
+#define STEGO_KERNELS(D) \
+    static void embedScalar##D(unsigned char *c, size_t n, const unsigned char *b) { embedScalar(c, n, b, D); } \
+    static void extractScalar##D(const unsigned char *c, size_t n, unsigned char *b) { extractScalar(c, n, b, D); }
+#endif
+
+STEGO_KERNELS(1)
+STEGO_KERNELS(2)
+STEGO_KERNELS(3)
+STEGO_KERNELS(4)
+
+// Swaps the first and third channel of every pixel (RGB <-> BGR). src and dst may be the same.
+void swapRedBlue(const unsigned char *src, unsigned char *dst, size_t pixels) {
+    swapKernel(src, dst, pixels);
+}
+
+static void swapRedBlueScalar(const unsigned char *src, unsigned char *dst, size_t pixels) {
+    for (size_t i = 0; i < pixels; i++) {
+        unsigned char first = src[i * 3 + 0];
+        dst[i * 3 + 0] = src[i * 3 + 2];
+        dst[i * 3 + 1] = src[i * 3 + 1];
+        dst[i * 3 + 2] = first;
+    }
+}
+
+#ifdef STBI_SSE2
+// 5 pixels per pshufb. 16 bytes are loaded and stored; the 16th byte is written again by the
+// next step or the scalar tail.
+TARGET_SSSE3 static void swapRedBlueSSSE3(const unsigned char *src, unsigned char *dst, size_t pixels) {
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 11 <= pixels; i += 10) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 3));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i * 3 + 15));
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(a, order));
+        _mm_storeu_si128((__m128i *)(dst + i * 3 + 15), _mm_shuffle_epi8(b, order));
+    }
+    swapRedBlueScalar(src + i * 3, dst + i * 3, pixels - i);
+}
+
+static int cpuHasSsse3(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+// Paeth predictor of the PNG filters
+FORCE_INLINE int paethPredictor(int a, int b, int c) {
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filters bytes [from, to) of an RGB row with the five PNG filters into out (five rows of
+// stride bytes, one per filter type) and adds the magnitudes of the filtered bytes, read as
+// signed, to sums
+FORCE_INLINE void filterBytesScalar(const unsigned char *row, const unsigned char *prior, size_t from, size_t to,
+                                    size_t stride, unsigned char *out, uint64_t *sums) {
+    for (size_t i = from; i < to; i++) {
+        int x = row[i];
+        int a = i >= 3 ? row[i - 3] : 0;
+        int b = prior[i];
+        int c = i >= 3 ? prior[i - 3] : 0;
+        unsigned char filtered[5] = {(unsigned char)x, (unsigned char)(x - a), (unsigned char)(x - b),
+                                     (unsigned char)(x - ((a + b) >> 1)), (unsigned char)(x - paethPredictor(a, b, c))};
+        for (int f = 0; f < 5; f++) {
+            out[f * stride + i] = filtered[f];
+            sums[f] += filtered[f] < 128 ? filtered[f] : 256 - filtered[f];
+        }
+    }
+}
+
+// Returns the filter type whose output has the smallest sum of magnitudes, the usual heuristic
+static int pickFilter(const uint64_t *sums) {
+    int best = 0;
+    for (int f = 1; f < 5; f++) {
+        if (sums[f] < sums[best]) {
+            best = f;
+        }
+    }
+    return best;
+}
+
+static int filterRowScalar(const unsigned char *row, const unsigned char *prior, size_t stride, unsigned char *out) {
+    uint64_t sums[5] = {0, 0, 0, 0, 0};
+    filterBytesScalar(row, prior, 0, stride, stride, out, sums);
+    return pickFilter(sums);
+}
+
+#ifdef STBI_SSE2
+// Paeth predictor of 16 bytes, computed on 16-bit lanes
+FORCE_INLINE __m128i paethSSE2(__m128i a, __m128i b, __m128i c) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i halves[2];
+    for (int h = 0; h < 2; h++) {
+        __m128i a16 = h ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+        __m128i b16 = h ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+        __m128i c16 = h ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+        __m128i toA = _mm_sub_epi16(b16, c16); // p - a
+        __m128i toB = _mm_sub_epi16(a16, c16); // p - b
+        __m128i toC = _mm_add_epi16(toA, toB); // p - c
+        __m128i pa = _mm_max_epi16(toA, _mm_sub_epi16(zero, toA));
+        __m128i pb = _mm_max_epi16(toB, _mm_sub_epi16(zero, toB));
+        __m128i pc = _mm_max_epi16(toC, _mm_sub_epi16(zero, toC));
+        __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+        __m128i notB = _mm_cmpgt_epi16(pb, pc);
+        __m128i bOrC = _mm_or_si128(_mm_and_si128(notB, c16), _mm_andnot_si128(notB, b16));
+        halves[h] = _mm_or_si128(_mm_and_si128(notA, bOrC), _mm_andnot_si128(notA, a16));
+    }
+    return _mm_packus_epi16(halves[0], halves[1]);
+}
+
+// 16 bytes per iteration for every filter at once. The first pixel has no left neighbours and
+// goes through the scalar code, as does the tail.
+static int filterRowSSE2(const unsigned char *row, const unsigned char *prior, size_t stride, unsigned char *out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    uint64_t sums[5] = {0, 0, 0, 0, 0};
+    __m128i totals[5] = {zero, zero, zero, zero, zero};
+    size_t head = stride < 3 ? stride : 3;
+    filterBytesScalar(row, prior, 0, head, stride, out, sums);
+    size_t i = head;
+    for (; i + 16 <= stride; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(row + i - 3));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prior + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(prior + i - 3));
+        __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        __m128i filtered[5] = {x, _mm_sub_epi8(x, a), _mm_sub_epi8(x, b), _mm_sub_epi8(x, average),
+                               _mm_sub_epi8(x, paethSSE2(a, b, c))};
+        for (int f = 0; f < 5; f++) {
+            _mm_storeu_si128((__m128i *)(out + f * stride + i), filtered[f]);
+            __m128i magnitude = _mm_min_epu8(filtered[f], _mm_sub_epi8(zero, filtered[f]));
+            totals[f] = _mm_add_epi64(totals[f], _mm_sad_epu8(magnitude, zero));
+        }
+    }
+    filterBytesScalar(row, prior, i, stride, stride, out, sums);
+    for (int f = 0; f < 5; f++) {
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, totals[f]);
+        sums[f] += lanes[0] + lanes[1];
+    }
+    return pickFilter(sums);
+}
+#endif
+
+static uint32_t crcTable[8][256];
+static unsigned char lengthSymbols[259]; // Length code index (symbol - 257) of lengths 3-258
+static unsigned char distSymbols[512];   // Distance codes, see distanceSymbol
+
+static void initPngTables(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[0][n] = c;
+    }
+    for (int n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++) {
+            crcTable[t][n] = crcTable[0][crcTable[t - 1][n] & 0xFF] ^ (crcTable[t - 1][n] >> 8);
+        }
+    }
+    for (int code = 0; code < 28; code++) {
+        for (int length = stbi__zlength_base[code]; length < stbi__zlength_base[code + 1]; length++) {
+            lengthSymbols[length] = (unsigned char)code;
+        }
+    }
+    lengthSymbols[258] = 28;
+    for (int code = 0; code < 30; code++) {
+        for (int dist = stbi__zdist_base[code]; dist < stbi__zdist_base[code] + (1 << stbi__zdist_extra[code]); dist++) {
+            if (dist <= 256) {
+                distSymbols[dist - 1] = (unsigned char)code;
+            } else {
+                distSymbols[256 + ((dist - 1) >> 7)] = (unsigned char)code;
+            }
+        }
+    }
+}
+
+// Picks the fastest embed, extract, swizzle and filter kernels this CPU supports
+static void selectKernels(void) {
+    StegoKernels scalar[] = {
+        {NULL, NULL},
+        {embedScalar1, extractScalar1},
+        {embedScalar2, extractScalar2},
+        {embedScalar3, extractScalar3},
+        {embedScalar4, extractScalar4},
+    };
+    memcpy(stegoKernels, scalar, sizeof(scalar));
+    swapKernel = swapRedBlueScalar;
+    filterKernel = filterRowScalar;
+    initPngTables();
+#ifdef STBI_SSE2
+    if (cpuHasSsse3()) {
+        swapKernel = swapRedBlueSSSE3;
+    }
+    if (stbi__sse2_available()) {
+        filterKernel = filterRowSSE2;
+    }
+    initKernelTables();
+    if (cpuHasAvx2()) {
+        stegoKernels[1].embed = embedAVX2_1;
+        stegoKernels[2].embed = embedAVX2_2;
+        stegoKernels[3].embed = embedAVX2_3;
+        stegoKernels[4].embed = embedAVX2_4;
+    } else if (stbi__sse2_available()) {
+        stegoKernels[1].embed = embedSSE2_1;
+        stegoKernels[2].embed = embedSSE2_2;
+        stegoKernels[3].embed = embedSSE2_3;
+        stegoKernels[4].embed = embedSSE2_4;
+    }
+    if (cpuHasFastPext()) {
+        stegoKernels[1].extract = extractBMI2_1;
+        stegoKernels[2].extract = extractBMI2_2;
+        stegoKernels[3].extract = extractBMI2_3;
+        stegoKernels[4].extract = extractBMI2_4;
+    } else if (stbi__sse2_available()) {
+        stegoKernels[1].extract = extractSSE2_1;
+        stegoKernels[2].extract = extractSSE2_2;
+        stegoKernels[3].extract = extractSSE2_3;
+        stegoKernels[4].extract = extractSSE2_4;
+    }
+#endif
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK selectKernelsOnce(PINIT_ONCE once, PVOID parameter, PVOID *context) {
+    (void)once;
+    (void)parameter;
+    (void)context;
+    selectKernels();
+    return TRUE;
+}
+#endif
+
+// Selects the kernels the first time it runs in the process. Must run before any embedding;
+// the library functions call it themselves.
+void initStegoEngine(void) {
+#ifdef _WIN32
+    InitOnceExecuteOnce(&engineOnce, selectKernelsOnce, NULL, NULL);
+#else
+    pthread_once(&engineOnce, selectKernels);
+#endif
+}
+
+// Size of a 24-bit BMP file of the given dimensions
+uint64_t bmpFileSize(int width, int height) {
+    size_t rowSize = ((size_t)width * 3 + 3) & ~(size_t)3;
+    return sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + (uint64_t)rowSize * height;
+}
+
+// Encodes pixelData as a 24-bit BMP into out, which holds bmpFileSize(width, height) bytes
+void encodeBmp(int width, int height, const unsigned char *pixelData, int topDown, unsigned char *out) {
+    size_t rowBytes = (size_t)width * 3;
+    size_t rowSize = (rowBytes + 3) & ~(size_t)3;
+    BMPFileHeader fileHeader = {0x4D42, (uint32_t)bmpFileSize(width, height), 0, 0, sizeof(BMPFileHeader) + sizeof(BMPInfoHeader)};
+    BMPInfoHeader infoHeader = {sizeof(BMPInfoHeader), width, topDown ? -height : height, 1, 24, 0,
+                                (uint32_t)(rowSize * height), 2835, 2835, 0, 0};
+    memcpy(out, &fileHeader, sizeof(BMPFileHeader));
+    memcpy(out + sizeof(BMPFileHeader), &infoHeader, sizeof(BMPInfoHeader));
+
+    BmpLayout layout = {width, height, !topDown, fileHeader.bfOffBits, rowSize};
+    unsigned char *rows = out + fileHeader.bfOffBits;
+    rgbToBmpRows(&layout, pixelData, rows, height);
+    for (int i = 0; rowSize != rowBytes && i < height; i++) {
+        memset(rows + i * rowSize + rowBytes, 0, rowSize - rowBytes);
+    }
+}
+
+// Chunks of a PNG held in memory that the partial decode needs, and the state of inflating
+// its image data a block at a time
+typedef struct {
+    const unsigned char *ihdr;  // IHDR, PLTE and tRNS chunks, each from its length to its CRC
+    const unsigned char *plte;
+    const unsigned char *trns;
+    unsigned char *idata;       // All IDAT data, concatenated
+    int width;
+    int height;
+    size_t stride;              // Filtered bytes per row, without the filter type byte
+    stbi__zbuf zlib;
+    int final;                  // The last deflate block was inflated
+} PngPrefix;
+
+static const unsigned char pngSignature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+
+static uint32_t getBigEndian32(const unsigned char *bytes) {
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static void putBigEndian32(unsigned char *bytes, uint32_t value) {
+    bytes[0] = (unsigned char)(value >> 24);
+    bytes[1] = (unsigned char)(value >> 16);
+    bytes[2] = (unsigned char)(value >> 8);
+    bytes[3] = (unsigned char)value;
+}
+
+// Finds the chunks of a PNG and gathers its image data. Returns 0 for anything the partial
+// decode leaves to stb: not a PNG, interlaced, Apple's CgBI variant or a malformed file.
+static int openPngPrefix(const unsigned char *png, size_t len, PngPrefix *prefix) {
+    memset(prefix, 0, sizeof(*prefix));
+    if (len < 8 || memcmp(png, pngSignature, 8) != 0) {
+        return 0;
+    }
+
+    size_t idataLength = 0;
+    for (size_t pos = 8; pos + 12 <= len;) {
+        const unsigned char *chunk = png + pos;
+        uint32_t length = getBigEndian32(chunk);
+        if (length > len - pos - 12) {
+            break;
+        }
+        if (memcmp(chunk + 4, "IHDR", 4) == 0 && length == 13) {
+            prefix->ihdr = chunk;
+        } else if (memcmp(chunk + 4, "PLTE", 4) == 0) {
+            prefix->plte = chunk;
+        } else if (memcmp(chunk + 4, "tRNS", 4) == 0) {
+            prefix->trns = chunk;
+        } else if (memcmp(chunk + 4, "CgBI", 4) == 0) {
+            return 0;
+        } else if (memcmp(chunk + 4, "IDAT", 4) == 0) {
+            idataLength += length;
+        } else if (memcmp(chunk + 4, "IEND", 4) == 0) {
+            break;
+        }
+        pos += (size_t)length + 12;
+    }
+    if (prefix->ihdr == NULL || idataLength == 0 || idataLength > INT_MAX || prefix->ihdr[8 + 12] != 0) {
+        return 0;
+    }
+
+    static const int colorChannels[7] = {1, 0, 3, 1, 2, 0, 4};
+    int bitDepth = prefix->ihdr[8 + 8];
+    int color = prefix->ihdr[8 + 9];
+    prefix->width = (int)getBigEndian32(prefix->ihdr + 8);
+    prefix->height = (int)getBigEndian32(prefix->ihdr + 12);
+    if (color > 6 || colorChannels[color] == 0 || bitDepth > 16 || prefix->width <= 0 || prefix->height <= 0 ||
+        prefix->width > STBI_MAX_DIMENSIONS || prefix->height > STBI_MAX_DIMENSIONS) {
+        return 0;
+    }
+    prefix->stride = ((size_t)prefix->width * colorChannels[color] * bitDepth + 7) / 8;
+
+    prefix->idata = STBI_MALLOC(idataLength);
+    if (prefix->idata == NULL) {
+        return 0;
+    }
+    idataLength = 0;
+    for (size_t pos = 8; pos + 12 <= len;) {
+        const unsigned char *chunk = png + pos;
+        uint32_t length = getBigEndian32(chunk);
+        if (length > len - pos - 12 || memcmp(chunk + 4, "IEND", 4) == 0) {
+            break;
+        }
+        if (memcmp(chunk + 4, "IDAT", 4) == 0) {
+            memcpy(prefix->idata + idataLength, chunk + 8, length);
+            idataLength += length;
+        }
+        pos += (size_t)length + 12;
+    }
+
+    stbi__zbuf *z = &prefix->zlib;
+    z->zbuffer = prefix->idata;
+    z->zbuffer_end = prefix->idata + idataLength;
+    z->zout_start = z->zout = STBI_MALLOC(prefix->stride + 1);
+    z->zout_end = z->zout_start + prefix->stride + 1;
+    z->z_expandable = 1;
+    if (z->zout_start == NULL || !stbi__parse_zlib_header(z)) {
+        return 0;
+    }
+    return 1;
+}
+
+static void closePngPrefix(PngPrefix *prefix) {
+    STBI_FREE(prefix->idata);
+    STBI_FREE(prefix->zlib.zout_start);
+}
+
+// Inflates whole deflate blocks, as stbi__parse_zlib does, until the filtered bytes of the top
+// rows are out. Returns 0 if the stream is corrupt or ends first.
+static int inflatePngRows(PngPrefix *prefix, int rows) {
+    stbi__zbuf *z = &prefix->zlib;
+    size_t wanted = (size_t)rows * (prefix->stride + 1);
+    while ((size_t)(z->zout - z->zout_start) < wanted) {
+        if (prefix->final) {
+            return 0;
+        }
+        prefix->final = stbi__zreceive(z, 1);
+        int type = stbi__zreceive(z, 2);
+        if (type == 0) {
+            if (!stbi__parse_uncompressed_block(z)) {
+                return 0;
+            }
+        } else if (type == 3) {
+            return 0;
+        } else {
+            if (type == 1) {
+                if (!stbi__zbuild_huffman(&z->z_length, stbi__zdefault_length, STBI__ZNSYMS) ||
+                    !stbi__zbuild_huffman(&z->z_distance, stbi__zdefault_distance, 32)) {
+                    return 0;
+                }
+            } else if (!stbi__compute_huffman_codes(z)) {
+                return 0;
+            }
+            if (!stbi__parse_huffman_block(z)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Decodes the top rows of the image to RGB. They are wrapped in a PNG of that height holding
+// the filtered bytes in stored deflate blocks, so stb unfilters and converts them exactly as
+// it would the whole image.
+static unsigned char *decodePngRows(PngPrefix *prefix, int rows) {
+    size_t raw = (size_t)rows * (prefix->stride + 1);
+    size_t blocks = raw / 65535 + 1;
+    size_t plteBytes = prefix->plte ? getBigEndian32(prefix->plte) + 12 : 0;
+    size_t trnsBytes = prefix->trns ? getBigEndian32(prefix->trns) + 12 : 0;
+    size_t idatBytes = 12 + 2 + blocks * 5 + raw + 4;
+    size_t size = 8 + 25 + plteBytes + trnsBytes + idatBytes + 12;
+    if (size > INT_MAX) {
+        return NULL;
+    }
+    unsigned char *png = STBI_MALLOC(size);
+    if (png == NULL) {
+        return NULL;
+    }
+
+    // Checksums are left zero: stb doesn't verify them
+    unsigned char *p = png;
+    memcpy(p, pngSignature, 8);
+    memcpy(p + 8, prefix->ihdr, 25);
+    putBigEndian32(p + 8 + 12, (uint32_t)rows);
+    p += 8 + 25;
+    if (prefix->plte != NULL) {
+        memcpy(p, prefix->plte, plteBytes);
+        p += plteBytes;
+    }
+    if (prefix->trns != NULL) {
+        memcpy(p, prefix->trns, trnsBytes);
+        p += trnsBytes;
+    }
+    putBigEndian32(p, (uint32_t)(idatBytes - 12));
+    memcpy(p + 4, "IDAT", 4);
+    p += 8;
+    *p++ = 0x78; // zlib header: deflate, no dictionary
+    *p++ = 0x01;
+    const unsigned char *filtered = (const unsigned char *)prefix->zlib.zout_start;
+    for (size_t done = 0, i = 0; i < blocks; i++) {
+        size_t count = raw - done < 65535 ? raw - done : 65535;
+        p[0] = i + 1 == blocks; // BFINAL, stored
+        p[1] = (unsigned char)count;
+        p[2] = (unsigned char)(count >> 8);
+        p[3] = (unsigned char)~count;
+        p[4] = (unsigned char)(~count >> 8);
+        memcpy(p + 5, filtered + done, count);
+        p += 5 + count;
+        done += count;
+    }
+    memset(p, 0, 4 + 4); // Adler-32 and CRC
+    p += 8;
+    memcpy(p, "\0\0\0\0IEND\0\0\0\0", 12);
+
+    int x, y, n;
+    unsigned char *rgb = stbi_load_from_memory(png, (int)size, &x, &y, &n, 3);
+    STBI_FREE(png);
+    if (rgb != NULL && (x != prefix->width || y != rows)) {
+        stbi_image_free(rgb);
+        rgb = NULL;
+    }
+    return rgb;
+}
+
+// Rows of an image width pixels wide that hold channels [0, count), at most height
+static int rowsForChannels(uint64_t count, int width, int height) {
+    uint64_t rowChannels = (uint64_t)width * 3;
+    uint64_t rows = (count + rowChannels - 1) / rowChannels;
+    return rows < (uint64_t)height ? (int)rows : height;
+}
+
+// Decodes only the top rows of a PNG held in memory that carry the header and the payload it
+// announces, inflating the image data a block at a time and stopping there. pixelsData gets
+// the full dimensions but holds only those rows; free it with stbi_image_free. Returns 0 when
+// the whole image has to be decoded instead: no header in the first rows (older format) or a
+// PNG this path doesn't handle.
+int decodePngPayload(const unsigned char *png, size_t len, PixelsData *pixelsData) {
+    PngPrefix prefix;
+    pixelsData->data = NULL;
+    if (!openPngPrefix(png, len, &prefix)) {
+        closePngPrefix(&prefix);
+        return 0;
+    }
+
+    StegoHeader header;
+    PixelsData shape = {NULL, prefix.width, prefix.height};
+    int rows = rowsForChannels(HEADER_CHANNELS, prefix.width, prefix.height);
+    if (inflatePngRows(&prefix, rows)) {
+        shape.data = decodePngRows(&prefix, rows);
+    }
+    if (shape.data != NULL && readHeader(shape, &header)) {
+        int payloadRows = rowsForChannels(HEADER_CHANNELS + payloadChannels(header.length, header.depth),
+                                          prefix.width, prefix.height);
+        if (payloadRows > rows) {
+            stbi_image_free(shape.data);
+            shape.data = inflatePngRows(&prefix, payloadRows) ? decodePngRows(&prefix, payloadRows) : NULL;
+        }
+        *pixelsData = shape;
+    } else {
+        stbi_image_free(shape.data);
+    }
+    closePngPrefix(&prefix);
+    return pixelsData->data != NULL;
+}
+
+// Reads the headers of a baseline JPEG up to its first scan. Returns 0 for anything the partial
+// decode leaves to stb: progressive files, scans that don't carry every component (which
+// baseline files may split the image into) and malformed files.
+static int openJpegScan(stbi__jpeg *z) {
+    for (int i = 0; i < 4; i++) {
+        z->img_comp[i].raw_data = NULL;
+        z->img_comp[i].raw_coeff = NULL;
+    }
+    z->restart_interval = 0;
+    if (!stbi__decode_jpeg_header(z, STBI__SCAN_load) || z->progressive) {
+        return 0;
+    }
+    int m = stbi__get_marker(z);
+    while (!stbi__SOS(m)) {
+        if (stbi__EOI(m) || stbi__DNL(m) || !stbi__process_marker(z, m)) {
+            return 0;
+        }
+        m = stbi__get_marker(z);
+    }
+    return stbi__process_scan_header(z) && z->scan_n == z->s->img_n;
+}
+
+// Decodes the MCU rows of the scan that cover the top rows of the image, plus the next one the
+// upsampling of chroma reads from, and stops there. The rest of the entropy-coded data is
+// never looked at.
+static int parseJpegRows(stbi__jpeg *z, int rows) {
+    int mcuRows = (rows + z->img_mcu_h - 1) / z->img_mcu_h + 1;
+    int ok;
+    if (z->scan_n == 1) {
+        // A single component in block order: its height bounds the rows of blocks
+        int n = z->order[0];
+        int height = z->img_comp[n].y;
+        if (mcuRows * 8 < height) {
+            z->img_comp[n].y = mcuRows * 8;
+        }
+        ok = stbi__parse_entropy_coded_data(z);
+        z->img_comp[n].y = height;
+    } else {
+        int mcuY = z->img_mcu_y;
+        if (mcuRows < mcuY) {
+            z->img_mcu_y = mcuRows;
+        }
+        ok = stbi__parse_entropy_coded_data(z);
+        z->img_mcu_y = mcuY;
+    }
+    return ok;
+}
+
+// Upsamples and converts the decoded top rows to RGB, as stb's load_jpeg_image does
+static unsigned char *jpegRowsToRgb(stbi__jpeg *z, int rows) {
+    stbi__context *s = z->s;
+    int isRgb = s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+    stbi__resample resample[4];
+    stbi_uc *lines[4] = {NULL, NULL, NULL, NULL};
+    for (int k = 0; k < s->img_n; k++) {
+        stbi__resample *r = &resample[k];
+        z->img_comp[k].linebuf = STBI_MALLOC(s->img_x + 3);
+        if (z->img_comp[k].linebuf == NULL) {
+            return NULL;
+        }
+        r->hs = z->img_h_max / z->img_comp[k].h;
+        r->vs = z->img_v_max / z->img_comp[k].v;
+        r->ystep = r->vs >> 1;
+        r->w_lores = (s->img_x + r->hs - 1) / r->hs;
+        r->ypos = 0;
+        r->line0 = r->line1 = z->img_comp[k].data;
+        if (r->hs == 1 && r->vs == 1) {
+            r->resample = resample_row_1;
+        } else if (r->hs == 1 && r->vs == 2) {
+            r->resample = stbi__resample_row_v_2;
+        } else if (r->hs == 2 && r->vs == 1) {
+            r->resample = stbi__resample_row_h_2;
+        } else if (r->hs == 2 && r->vs == 2) {
+            r->resample = z->resample_row_hv_2_kernel;
+        } else {
+            r->resample = stbi__resample_row_generic;
+        }
+    }
+
+    // The color conversion kernels write a fourth byte past each pixel, hence the spare byte
+    unsigned char *rgb = stbi__malloc_mad3(3, s->img_x, rows, 1);
+    if (rgb == NULL) {
+        return NULL;
+    }
+    for (int j = 0; j < rows; j++) {
+        unsigned char *out = rgb + (size_t)s->img_x * 3 * j;
+        for (int k = 0; k < s->img_n; k++) {
+            stbi__resample *r = &resample[k];
+            int yBottom = r->ystep >= (r->vs >> 1);
+            lines[k] = r->resample(z->img_comp[k].linebuf, yBottom ? r->line1 : r->line0,
+                                   yBottom ? r->line0 : r->line1, r->w_lores, r->hs);
+            if (++r->ystep >= r->vs) {
+                r->ystep = 0;
+                r->line0 = r->line1;
+                if (++r->ypos < z->img_comp[k].y) {
+                    r->line1 += z->img_comp[k].w2;
+                }
+            }
+        }
+        if (isRgb) {
+            for (stbi__uint32 i = 0; i < s->img_x; i++, out += 3) {
+                out[0] = lines[0][i];
+                out[1] = lines[1][i];
+                out[2] = lines[2][i];
+            }
+        } else if (s->img_n == 4 && z->app14_color_transform == 0) {
+            // CMYK
+            for (stbi__uint32 i = 0; i < s->img_x; i++, out += 3) {
+                out[0] = stbi__blinn_8x8(lines[0][i], lines[3][i]);
+                out[1] = stbi__blinn_8x8(lines[1][i], lines[3][i]);
+                out[2] = stbi__blinn_8x8(lines[2][i], lines[3][i]);
+            }
+        } else if (s->img_n >= 3) {
+            z->YCbCr_to_RGB_kernel(out, lines[0], lines[1], lines[2], s->img_x, 3);
+            if (s->img_n == 4 && z->app14_color_transform == 2) {
+                // YCCK
+                for (stbi__uint32 i = 0; i < s->img_x; i++, out += 3) {
+                    out[0] = stbi__blinn_8x8(255 - out[0], lines[3][i]);
+                    out[1] = stbi__blinn_8x8(255 - out[1], lines[3][i]);
+                    out[2] = stbi__blinn_8x8(255 - out[2], lines[3][i]);
+                }
+            }
+        } else {
+            for (stbi__uint32 i = 0; i < s->img_x; i++, out += 3) {
+                out[0] = out[1] = out[2] = lines[0][i];
+            }
+        }
+    }
+    return rgb;
+}
+
+// Decodes the top rows of a baseline JPEG that hold channels [0, count) to RGB. shape gets the
+// full dimensions and, on success, those rows.
+static int decodeJpegChannels(const unsigned char *jpg, size_t len, uint64_t count, PixelsData *shape) {
+    stbi__context s;
+    stbi__start_mem(&s, jpg, (int)len);
+    s.img_n = 0;
+    stbi__jpeg *z = STBI_MALLOC(sizeof(stbi__jpeg));
+    if (z == NULL) {
+        return 0;
+    }
+    memset(z, 0, sizeof(stbi__jpeg));
+    z->s = &s;
+    stbi__setup_jpeg(z);
+
+    shape->data = NULL;
+    if (openJpegScan(z)) {
+        shape->width = (int)s.img_x;
+        shape->height = (int)s.img_y;
+        int rows = rowsForChannels(count, shape->width, shape->height);
+        if (parseJpegRows(z, rows)) {
+            shape->data = jpegRowsToRgb(z, rows);
+        }
+    }
+    stbi__cleanup_jpeg(z);
+    STBI_FREE(z);
+    return shape->data != NULL;
+}
+
+// Decodes only the top rows of a baseline JPEG held in memory that carry the header and the
+// payload it announces, stopping the entropy decoding after the MCU rows that cover them. Like
+// decodePngPayload, returns 0 when the whole image has to be decoded instead.
+int decodeJpegPayload(const unsigned char *jpg, size_t len, PixelsData *pixelsData) {
+    StegoHeader header;
+    PixelsData shape;
+    pixelsData->data = NULL;
+    if (len < 2 || len > INT_MAX || jpg[0] != 0xFF || jpg[1] != 0xD8) {
+        return 0;
+    }
+    if (!decodeJpegChannels(jpg, len, HEADER_CHANNELS, &shape)) {
+        return 0;
+    }
+    if (readHeader(shape, &header)) {
+        uint64_t count = HEADER_CHANNELS + payloadChannels(header.length, header.depth);
+        if (rowsForChannels(count, shape.width, shape.height) > rowsForChannels(HEADER_CHANNELS, shape.width, shape.height)) {
+            stbi_image_free(shape.data);
+            decodeJpegChannels(jpg, len, count, &shape);
+        }
+        *pixelsData = shape;
+    } else {
+        stbi_image_free(shape.data);
+    }
+    return pixelsData->data != NULL;
+}
+
+// Decodes only the rows of a PNG, baseline JPEG or QOI held in memory that carry the header and
+// the payload. Returns 0 when the whole image has to be decoded instead.
+int decodePayloadPixels(const unsigned char *bytes, size_t len, PixelsData *pixelsData) {
+    return decodePngPayload(bytes, len, pixelsData) || decodeJpegPayload(bytes, len, pixelsData) ||
+           decodeQoiPayload(bytes, len, pixelsData);
+}
+
+// Size of the deflate window, and of the compressed data read from the file at a time
+#define PNG_WINDOW 32768
+#define PNG_INPUT 65536
+// Compressed bytes kept ahead of the inflater: enough for a block's dynamic Huffman tables
+#define PNG_LOOKAHEAD 1024
+
+// A PNG read from a file and inflated only as far as the rows asked for. Memory holds the
+// deflate window, a buffer of compressed data and two rows: the one being inflated and the
+// previous one it is unfiltered against.
+struct PngStream {
+    FILE *file;
+    int width;
+    int height;
+    int color;
+    int bitDepth;
+    int channels;
+    int pixelBytes;             // Bytes a filter looks back, at least 1
+    size_t stride;              // Filtered bytes per row, without the filter type byte
+    unsigned char palette[256 * 3];
+    uint32_t chunkLeft;         // Bytes of the current IDAT not read yet
+    int inputDone;              // No IDAT data left in the file
+    unsigned char *input;
+    stbi__zbuf zlib;
+    int blockState;             // Next deflate block to start, stored or Huffman coded
+    int final;                  // The current block is the last one
+    int storedLeft;
+    int matchLength;            // Bytes left to copy of a back reference
+    int matchDistance;
+    unsigned char *window;
+    uint32_t windowPos;
+    unsigned char *rows[2];     // Current and previous rows, each with its filter type byte
+    size_t rowFill;
+    int row;                    // Rows handed out so far
+    unsigned char *rgb;
+};
+
+enum { PNG_BLOCK_START, PNG_BLOCK_STORED, PNG_BLOCK_HUFFMAN };
+
+// Reads exactly size bytes. Returns 0 at the end of the file.
+static int readPngBytes(PngStream *stream, unsigned char *bytes, size_t size) {
+    return fread(bytes, 1, size, stream->file) == size;
+}
+
+// Moves the unread compressed bytes to the front of the buffer and fills the rest from the
+// IDAT chunks, stepping over chunk boundaries. Any other chunk ends the image data.
+static void refillPngInput(PngStream *stream) {
+    stbi__zbuf *z = &stream->zlib;
+    size_t kept = (size_t)(z->zbuffer_end - z->zbuffer);
+    memmove(stream->input, z->zbuffer, kept);
+    z->zbuffer = stream->input;
+    z->zbuffer_end = stream->input + kept;
+    while (!stream->inputDone && z->zbuffer_end < stream->input + PNG_INPUT) {
+        if (stream->chunkLeft == 0) {
+            unsigned char chunk[12]; // CRC of the previous chunk, length and type of the next
+            if (!readPngBytes(stream, chunk, 12) || memcmp(chunk + 8, "IDAT", 4) != 0) {
+                stream->inputDone = 1;
+                break;
+            }
+            stream->chunkLeft = getBigEndian32(chunk + 4);
+            continue;
+        }
+        size_t room = (size_t)(stream->input + PNG_INPUT - z->zbuffer_end);
+        size_t count = stream->chunkLeft < room ? stream->chunkLeft : room;
+        if (!readPngBytes(stream, z->zbuffer_end, count)) {
+            stream->inputDone = 1;
+            break;
+        }
+        z->zbuffer_end += count;
+        stream->chunkLeft -= (uint32_t)count;
+    }
+}
+
+// Reads the chunks before the image data. Returns 0 for anything streaming leaves to stb: not
+// a PNG, interlaced, Apple's CgBI variant or a malformed file.
+static int readPngStreamHeaders(PngStream *stream) {
+    unsigned char bytes[8 + 13];
+    if (!readPngBytes(stream, bytes, 8) || memcmp(bytes, pngSignature, 8) != 0) {
+        return 0;
+    }
+    int haveHeader = 0;
+    int havePalette = 0;
+    for (;;) {
+        if (!readPngBytes(stream, bytes, 8)) {
+            return 0;
+        }
+        uint32_t length = getBigEndian32(bytes);
+        if (memcmp(bytes + 4, "IDAT", 4) == 0) {
+            stream->chunkLeft = length;
+            return haveHeader && (stream->color != 3 || havePalette);
+        }
+        if (memcmp(bytes + 4, "IHDR", 4) == 0) {
+            if (length != 13 || !readPngBytes(stream, bytes + 8, 13)) {
+                return 0;
+            }
+            stream->width = (int)getBigEndian32(bytes + 8);
+            stream->height = (int)getBigEndian32(bytes + 12);
+            stream->bitDepth = bytes[16];
+            stream->color = bytes[17];
+            if (bytes[18] != 0 || bytes[19] != 0 || bytes[20] != 0) {
+                return 0; // Interlaced, or an unknown compression or filter method
+            }
+            length = 0;
+            haveHeader = 1;
+        } else if (memcmp(bytes + 4, "PLTE", 4) == 0 && length <= sizeof(stream->palette) && length % 3 == 0) {
+            if (!readPngBytes(stream, stream->palette, length)) {
+                return 0;
+            }
+            length = 0;
+            havePalette = 1;
+        } else if (memcmp(bytes + 4, "CgBI", 4) == 0 || memcmp(bytes + 4, "IEND", 4) == 0) {
+            return 0;
+        }
+
+        // Skips the rest of the chunk and its CRC. Reads rather than seeks, so pipes work.
+        for (uint64_t left = (uint64_t)length + 4; left > 0;) {
+            unsigned char skip[4096];
+            size_t count = left < sizeof(skip) ? (size_t)left : sizeof(skip);
+            if (!readPngBytes(stream, skip, count)) {
+                return 0;
+            }
+            left -= count;
+        }
+    }
+}
+
+void closePngStream(PngStream *stream) {
+    if (stream != NULL) {
+        STBI_FREE(stream->input);
+        STBI_FREE(stream->window);
+        STBI_FREE(stream->rows[0]);
+        STBI_FREE(stream->rows[1]);
+        STBI_FREE(stream->rgb);
+        STBI_FREE(stream);
+    }
+}
+
+// Starts streaming a PNG from the current position of file, reading up to its image data.
+// Returns NULL, having read part of the file, if it isn't a PNG that can be streamed.
+PngStream *openPngStream(FILE *file, int *width, int *height) {
+    static const int colorChannels[7] = {1, 0, 3, 1, 2, 0, 4};
+    PngStream *stream = STBI_MALLOC(sizeof(PngStream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->file = file;
+    if (!readPngStreamHeaders(stream) || stream->color > 6 || colorChannels[stream->color] == 0 ||
+        stream->width <= 0 || stream->height <= 0 ||
+        stream->width > STBI_MAX_DIMENSIONS || stream->height > STBI_MAX_DIMENSIONS) {
+        closePngStream(stream);
+        return NULL;
+    }
+    int depth = stream->bitDepth;
+    int lowDepth = depth == 1 || depth == 2 || depth == 4;
+    if (!(depth == 8 || (depth == 16 && stream->color != 3) || (lowDepth && (stream->color == 0 || stream->color == 3)))) {
+        closePngStream(stream);
+        return NULL;
+    }
+    stream->channels = colorChannels[stream->color];
+    stream->pixelBytes = depth < 8 ? 1 : stream->channels * depth / 8;
+    stream->stride = ((size_t)stream->width * stream->channels * depth + 7) / 8;
+
+    stream->input = STBI_MALLOC(PNG_INPUT);
+    stream->window = STBI_MALLOC(PNG_WINDOW);
+    stream->rows[0] = STBI_MALLOC(stream->stride + 1);
+    stream->rows[1] = STBI_MALLOC(stream->stride + 1);
+    stream->rgb = STBI_MALLOC((size_t)stream->width * 3);
+    if (!stream->input || !stream->window || !stream->rows[0] || !stream->rows[1] || !stream->rgb) {
+        closePngStream(stream);
+        return NULL;
+    }
+    memset(stream->rows[1], 0, stream->stride + 1); // The row above the first one is zero
+
+    stbi__zbuf *z = &stream->zlib;
+    z->zbuffer = z->zbuffer_end = stream->input;
+    refillPngInput(stream);
+    if (!stbi__parse_zlib_header(z)) {
+        closePngStream(stream);
+        return NULL;
+    }
+    *width = stream->width;
+    *height = stream->height;
+    return stream;
+}
+
+// Sample i of an unfiltered row. Samples of 16 bits keep their high byte, as stb's 8-bit
+// output does.
+static int pngSample(const PngStream *stream, const unsigned char *row, size_t i) {
+    int depth = stream->bitDepth;
+    if (depth == 8) {
+        return row[i];
+    }
+    if (depth == 16) {
+        return row[i * 2];
+    }
+    size_t bit = i * depth;
+    return row[bit / 8] >> (8 - depth - bit % 8) & ((1 << depth) - 1);
+}
+
+// Converts an unfiltered row to RGB as stb does: palette indices are looked up, gray samples
+// below 8 bits are scaled to 0-255 and replicated, alpha is dropped.
+static void pngRowToRgb(const PngStream *stream, const unsigned char *row, unsigned char *rgb) {
+    static const int grayScale[9] = {0, 0xff, 0x55, 0, 0x11, 0, 0, 0, 1};
+    int channels = stream->channels;
+    if (stream->bitDepth == 8 && channels == 3) {
+        memcpy(rgb, row, (size_t)stream->width * 3);
+        return;
+    }
+    for (size_t x = 0; x < (size_t)stream->width; x++, rgb += 3) {
+        if (stream->color == 3) {
+            memcpy(rgb, stream->palette + pngSample(stream, row, x) * 3, 3);
+        } else if (channels < 3) {
+            int gray = pngSample(stream, row, x * channels);
+            rgb[0] = rgb[1] = rgb[2] = (unsigned char)(stream->bitDepth < 8 ? gray * grayScale[stream->bitDepth] : gray);
+        } else {
+            rgb[0] = (unsigned char)pngSample(stream, row, x * channels);
+            rgb[1] = (unsigned char)pngSample(stream, row, x * channels + 1);
+            rgb[2] = (unsigned char)pngSample(stream, row, x * channels + 2);
+        }
+    }
+}
+
+// Unfilters the row just inflated against the previous one and hands it out as RGB
+static int finishPngRow(PngStream *stream, PngRowCallback callback, void *user) {
+    unsigned char *cur = stream->rows[0] + 1;
+    const unsigned char *prior = stream->rows[1] + 1;
+    size_t bpp = (size_t)stream->pixelBytes;
+    size_t stride = stream->stride;
+    switch (stream->rows[0][0]) {
+    case 0:
+        break;
+    case 1:
+        for (size_t k = bpp; k < stride; k++) {
+            cur[k] = (unsigned char)(cur[k] + cur[k - bpp]);
+        }
+        break;
+    case 2:
+        for (size_t k = 0; k < stride; k++) {
+            cur[k] = (unsigned char)(cur[k] + prior[k]);
+        }
+        break;
+    case 3:
+        for (size_t k = 0; k < stride; k++) {
+            cur[k] = (unsigned char)(cur[k] + ((k >= bpp ? cur[k - bpp] : 0) + prior[k]) / 2);
+        }
+        break;
+    case 4:
+        for (size_t k = 0; k < stride; k++) {
+            cur[k] = (unsigned char)(cur[k] + (k >= bpp ? stbi__paeth(cur[k - bpp], prior[k], prior[k - bpp]) : prior[k]));
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    pngRowToRgb(stream, cur, stream->rgb);
+    if (!callback(user, stream->rgb, stream->row)) {
+        return 0;
+    }
+    stream->rows[0] = stream->rows[1];
+    stream->rows[1] = cur - 1;
+    stream->rowFill = 0;
+    stream->row++;
+    return 1;
+}
+
+// Appends an inflated byte to the window and to the current row
+static int putPngByte(PngStream *stream, unsigned char byte, PngRowCallback callback, void *user) {
+    stream->window[stream->windowPos++ & (PNG_WINDOW - 1)] = byte;
+    stream->rows[0][stream->rowFill++] = byte;
+    return stream->rowFill <= stream->stride || finishPngRow(stream, callback, user);
+}
+
+// Starts the next deflate block, reading its header and, if it has them, its Huffman tables
+static int startPngBlock(PngStream *stream) {
+    stbi__zbuf *z = &stream->zlib;
+    if (stream->final) {
+        return 0; // The image data ended before the last row
+    }
+    stream->final = stbi__zreceive(z, 1);
+    int type = stbi__zreceive(z, 2);
+    if (type == 0) {
+        // Stored: the length and its complement start at the next byte boundary
+        unsigned char header[4];
+        int k = 0;
+        stbi__zreceive(z, z->num_bits & 7);
+        while (z->num_bits > 0 && k < 4) {
+            header[k++] = (unsigned char)(z->code_buffer & 255);
+            z->code_buffer >>= 8;
+            z->num_bits -= 8;
+        }
+        while (k < 4) {
+            header[k++] = stbi__zget8(z);
+        }
+        int len = header[1] * 256 + header[0];
+        if (z->num_bits != 0 || (header[3] * 256 + header[2]) != (len ^ 0xffff)) {
+            return 0;
+        }
+        stream->storedLeft = len;
+        stream->blockState = PNG_BLOCK_STORED;
+        return 1;
+    }
+    if (type == 3) {
+        return 0;
+    }
+    if (type == 1) {
+        if (!stbi__zbuild_huffman(&z->z_length, stbi__zdefault_length, STBI__ZNSYMS) ||
+            !stbi__zbuild_huffman(&z->z_distance, stbi__zdefault_distance, 32)) {
+            return 0;
+        }
+    } else if (!stbi__compute_huffman_codes(z)) {
+        return 0;
+    }
+    stream->blockState = PNG_BLOCK_HUFFMAN;
+    return 1;
+}
+
+// Inflates and unfilters the next rows of the image, handing each to callback as RGB with its
+// row number. Stops right after the last one asked for, even inside a deflate block, so the
+// next call carries on from there. Returns 0 if the data is corrupt, ends early or callback
+// returns 0.
+int decodePngStream(PngStream *stream, int rows, PngRowCallback callback, void *user) {
+    stbi__zbuf *z = &stream->zlib;
+    int target = rows < stream->height - stream->row ? stream->row + rows : stream->height;
+    while (stream->row < target) {
+        if (stream->matchLength > 0) {
+            stream->matchLength--;
+            unsigned char byte = stream->window[(stream->windowPos - stream->matchDistance) & (PNG_WINDOW - 1)];
+            if (!putPngByte(stream, byte, callback, user)) {
+                return 0;
+            }
+            continue;
+        }
+        if (z->zbuffer_end - z->zbuffer < PNG_LOOKAHEAD && !stream->inputDone) {
+            refillPngInput(stream);
+        }
+
+        if (stream->blockState == PNG_BLOCK_START) {
+            if (!startPngBlock(stream)) {
+                return 0;
+            }
+        } else if (stream->blockState == PNG_BLOCK_STORED) {
+            if (stream->storedLeft == 0) {
+                stream->blockState = PNG_BLOCK_START;
+            } else if (stbi__zeof(z) || !putPngByte(stream, stbi__zget8(z), callback, user)) {
+                return 0;
+            } else {
+                stream->storedLeft--;
+            }
+        } else {
+            // One Huffman symbol, as in stbi__parse_huffman_block
+            int symbol = stbi__zhuffman_decode(z, &z->z_length);
+            if (symbol < 0 || symbol >= 286) {
+                return 0;
+            }
+            if (symbol < 256) {
+                if (!putPngByte(stream, (unsigned char)symbol, callback, user)) {
+                    return 0;
+                }
+            } else if (symbol == 256) {
+                if (z->hit_zeof_once && z->num_bits < 16) {
+                    return 0;
+                }
+                stream->blockState = PNG_BLOCK_START;
+            } else {
+                symbol -= 257;
+                int length = stbi__zlength_base[symbol];
+                if (stbi__zlength_extra[symbol]) {
+                    length += stbi__zreceive(z, stbi__zlength_extra[symbol]);
+                }
+                symbol = stbi__zhuffman_decode(z, &z->z_distance);
+                if (symbol < 0 || symbol >= 30) {
+                    return 0;
+                }
+                int distance = stbi__zdist_base[symbol];
+                if (stbi__zdist_extra[symbol]) {
+                    distance += stbi__zreceive(z, stbi__zdist_extra[symbol]);
+                }
+                if ((uint32_t)distance > stream->windowPos) {
+                    return 0;
+                }
+                stream->matchLength = length;
+                stream->matchDistance = distance;
+            }
+        }
+    }
+    return 1;
+}
+
+// Filtered bytes each thread of the PNG encoder compresses at a time, after the window kept
+// from before. Chunks are split further only down to PNG_MIN_JOB, as each restarts the matching.
+#define PNG_CHUNK (1 << 20)
+#define PNG_MIN_JOB (128 << 10)
+#define PNG_MAX_THREADS 64
+// Tokens per deflate block, each block getting its own Huffman codes
+#define DEFLATE_BLOCK_TOKENS (1 << 15)
+// Longest hash chain the best level follows, and the match length it settles for at once
+#define DEFLATE_MAX_CHAIN 128
+#define DEFLATE_LAZY_LENGTH 32
+// Matches of 3 bytes further back than this cost more than the literals, as zlib finds
+#define DEFLATE_TOO_FAR 4096
+
+// A literal (distance 0) or a back reference of the deflate stream
+typedef struct {
+    uint16_t length; // Literal byte, or match length 3-258
+    uint16_t distance;
+} DeflateToken;
+
+// Deflate output: bytes and the bits not yet making up a whole byte, least significant first
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    uint64_t bits;
+    int bitCount;
+    int failed; // Out of memory
+} DeflateOutput;
+
+// Huffman codes of a dynamic block, and the code length codes describing them
+typedef struct {
+    unsigned char litLengths[286];
+    unsigned char distLengths[30];
+    uint16_t litCodes[286];
+    uint16_t distCodes[30];
+    int hlit;
+    int hdist;
+    unsigned char clLengths[19];
+    uint16_t clCodes[19];
+    int hclen;
+    unsigned char clSymbols[286 + 30]; // Run-length coded code lengths
+    unsigned char clExtra[286 + 30];
+    int clCount;
+} HuffmanCodes;
+
+// Finds earlier occurrences of 3 bytes through hash chains over the last 32 KB. Positions
+// are stored plus one, so 0 ends a chain.
+typedef struct {
+    uint32_t head[1 << 15];
+    uint32_t prev[1 << 15];
+} MatchFinder;
+
+static int distanceSymbol(int dist) {
+    return dist <= 256 ? distSymbols[dist - 1] : distSymbols[256 + ((dist - 1) >> 7)];
+}
+
+// CRC-32 of PNG chunks, eight bytes per step
+static uint32_t updateCrc(uint32_t crc, const unsigned char *bytes, size_t size) {
+    crc = ~crc;
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint32_t lo = crc ^ ((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+        crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^ crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][bytes[4]] ^ crcTable[2][bytes[5]] ^ crcTable[1][bytes[6]] ^ crcTable[0][bytes[7]];
+    }
+    for (; size > 0; size--) {
+        crc = crcTable[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Adler-32 of the zlib stream, reduced every 5552 bytes as zlib does
+static uint32_t updateAdler(uint32_t adler, const unsigned char *bytes, size_t size) {
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (size > 0) {
+        size_t run = size < 5552 ? size : 5552;
+        size -= run;
+        for (; run > 0; run--) {
+            a += *bytes++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+// Makes room for count more bytes
+static int reserveDeflate(DeflateOutput *out, size_t count) {
+    if (out->size + count <= out->capacity) {
+        return 1;
+    }
+    size_t capacity = out->capacity ? out->capacity : 65536;
+    while (capacity < out->size + count) {
+        capacity *= 2;
+    }
+    unsigned char *data = STBI_REALLOC_SIZED(out->data, out->capacity, capacity);
+    if (data == NULL) {
+        out->failed = 1;
+        return 0;
+    }
+    out->data = data;
+    out->capacity = capacity;
+    return 1;
+}
+
+static void putBits(DeflateOutput *out, uint32_t value, int count) {
+    out->bits |= (uint64_t)value << out->bitCount;
+    out->bitCount += count;
+    if (out->bitCount >= 32 && reserveDeflate(out, 4)) {
+        for (int i = 0; i < 4; i++) {
+            out->data[out->size++] = (unsigned char)(out->bits >> (8 * i));
+        }
+        out->bits >>= 32;
+        out->bitCount -= 32;
+    }
+}
+
+// Pads the bits to a byte boundary and moves them to the bytes
+static void alignDeflate(DeflateOutput *out) {
+    if (!reserveDeflate(out, 8)) {
+        return;
+    }
+    for (; out->bitCount > 0; out->bitCount -= 8) {
+        out->data[out->size++] = (unsigned char)out->bits;
+        out->bits >>= 8;
+    }
+    out->bits = 0;
+    out->bitCount = 0;
+}
+
+// Stored blocks of at most 65535 bytes. Always writes at least one block.
+static void writeStoredBlocks(DeflateOutput *out, const unsigned char *bytes, size_t size, int final) {
+    do {
+        size_t count = size < 65535 ? size : 65535;
+        putBits(out, final && count == size, 1);
+        putBits(out, 0, 2);
+        alignDeflate(out);
+        if (!reserveDeflate(out, 4 + count)) {
+            return;
+        }
+        unsigned char *p = out->data + out->size;
+        p[0] = (unsigned char)count;
+        p[1] = (unsigned char)(count >> 8);
+        p[2] = (unsigned char)~count;
+        p[3] = (unsigned char)(~count >> 8);
+        memcpy(p + 4, bytes, count);
+        out->size += 4 + count;
+        bytes += count;
+        size -= count;
+    } while (size > 0);
+}
+
+// Moffat and Katajainen's in-place computation of Huffman code lengths. weights come sorted
+// ascending and are replaced by the code lengths.
+static void minimumRedundancy(uint32_t *weights, int n) {
+    int root = 0, leaf = 2, next;
+    weights[0] += weights[1];
+    for (next = 1; next < n - 1; next++) {
+        if (leaf >= n || weights[root] < weights[leaf]) {
+            weights[next] = weights[root];
+            weights[root++] = (uint32_t)next;
+        } else {
+            weights[next] = weights[leaf++];
+        }
+        if (leaf >= n || (root < next && weights[root] < weights[leaf])) {
+            weights[next] += weights[root];
+            weights[root++] = (uint32_t)next;
+        } else {
+            weights[next] += weights[leaf++];
+        }
+    }
+    weights[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--) {
+        weights[next] = weights[weights[next]] + 1;
+    }
+    int available = 1, used = 0, depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (available > 0) {
+        while (root >= 0 && weights[root] == (uint32_t)depth) {
+            used++;
+            root--;
+        }
+        while (available > used) {
+            weights[next--] = (uint32_t)depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+// Code lengths of at most maxBits for the symbols with a non-zero frequency. Lengths too long
+// are shortened the way miniz does, lengthening shorter codes until the code is complete again.
+static void buildCodeLengths(const uint32_t *freq, int count, int maxBits, unsigned char *lengths) {
+    int symbols[286];
+    uint32_t weights[286];
+    int n = 0;
+    memset(lengths, 0, count);
+    for (int s = 0; s < count; s++) {
+        if (freq[s] == 0) {
+            continue;
+        }
+        int i = n++;
+        for (; i > 0 && freq[symbols[i - 1]] > freq[s]; i--) {
+            symbols[i] = symbols[i - 1];
+        }
+        symbols[i] = s;
+    }
+    if (n == 1) {
+        lengths[symbols[0]] = 1;
+    }
+    if (n <= 1) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        weights[i] = freq[symbols[i]];
+    }
+    minimumRedundancy(weights, n);
+
+    int perLength[32] = {0};
+    for (int i = 0; i < n; i++) {
+        perLength[weights[i] < (uint32_t)maxBits ? weights[i] : (uint32_t)maxBits]++;
+    }
+    uint32_t total = 0;
+    for (int bits = maxBits; bits > 0; bits--) {
+        total += (uint32_t)perLength[bits] << (maxBits - bits);
+    }
+    while (total != 1u << maxBits) {
+        perLength[maxBits]--;
+        for (int bits = maxBits - 1; bits > 0; bits--) {
+            if (perLength[bits]) {
+                perLength[bits]--;
+                perLength[bits + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+    for (int bits = maxBits, i = 0; bits > 0; bits--) {
+        for (int k = perLength[bits]; k > 0; k--) {
+            lengths[symbols[i++]] = (unsigned char)bits;
+        }
+    }
+}
+
+// Canonical codes for the lengths, bit-reversed since deflate sends codes from the top bit
+static void buildCodes(const unsigned char *lengths, int count, uint16_t *codes) {
+    int perLength[16] = {0};
+    int next[16];
+    for (int s = 0; s < count; s++) {
+        perLength[lengths[s]]++;
+    }
+    perLength[0] = 0;
+    for (int bits = 1, code = 0; bits < 16; bits++) {
+        code = (code + perLength[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (int s = 0; s < count; s++) {
+        int bits = lengths[s];
+        int code = bits ? next[bits]++ : 0;
+        int reversed = 0;
+        for (int k = 0; k < bits; k++, code >>= 1) {
+            reversed = reversed << 1 | (code & 1);
+        }
+        codes[s] = (uint16_t)reversed;
+    }
+}
+
+// Builds the codes of a dynamic block from the symbol frequencies. Returns the size of the
+// block in bits.
+static uint64_t buildHuffmanCodes(const uint32_t *litFreq, const uint32_t *distFreq, HuffmanCodes *codes) {
+    static const unsigned char clOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    buildCodeLengths(litFreq, 286, 15, codes->litLengths);
+    buildCodeLengths(distFreq, 30, 15, codes->distLengths);
+    buildCodes(codes->litLengths, 286, codes->litCodes);
+    buildCodes(codes->distLengths, 30, codes->distCodes);
+    for (codes->hlit = 286; codes->hlit > 257 && codes->litLengths[codes->hlit - 1] == 0; codes->hlit--) {
+    }
+    for (codes->hdist = 30; codes->hdist > 1 && codes->distLengths[codes->hdist - 1] == 0; codes->hdist--) {
+    }
+
+    // Code lengths of both alphabets, with runs coded as symbols 16 (repeat), 17 and 18 (zeros)
+    unsigned char all[286 + 30];
+    int total = codes->hlit + codes->hdist;
+    memcpy(all, codes->litLengths, codes->hlit);
+    memcpy(all + codes->hlit, codes->distLengths, codes->hdist);
+    uint32_t clFreq[19] = {0};
+    codes->clCount = 0;
+    for (int i = 0; i < total;) {
+        int run = 1;
+        while (i + run < total && all[i + run] == all[i]) {
+            run++;
+        }
+        int symbol = all[i], extra = 0, used = 1;
+        if (all[i] == 0 && run >= 11) {
+            used = run < 138 ? run : 138;
+            symbol = 18;
+            extra = used - 11;
+        } else if (all[i] == 0 && run >= 3) {
+            used = run;
+            symbol = 17;
+            extra = used - 3;
+        } else if (i > 0 && all[i - 1] == all[i] && run >= 3) {
+            used = run < 6 ? run : 6;
+            symbol = 16;
+            extra = used - 3;
+        }
+        codes->clSymbols[codes->clCount] = (unsigned char)symbol;
+        codes->clExtra[codes->clCount++] = (unsigned char)extra;
+        clFreq[symbol]++;
+        i += used;
+    }
+    buildCodeLengths(clFreq, 19, 7, codes->clLengths);
+    buildCodes(codes->clLengths, 19, codes->clCodes);
+    for (codes->hclen = 19; codes->hclen > 4 && codes->clLengths[clOrder[codes->hclen - 1]] == 0; codes->hclen--) {
+    }
+
+    uint64_t bits = 3 + 5 + 5 + 4 + 3 * (uint64_t)codes->hclen;
+    for (int i = 0; i < codes->clCount; i++) {
+        int symbol = codes->clSymbols[i];
+        bits += codes->clLengths[symbol] + (symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0);
+    }
+    for (int s = 0; s < 286; s++) {
+        bits += (uint64_t)litFreq[s] * (codes->litLengths[s] + (s > 256 ? stbi__zlength_extra[s - 257] : 0));
+    }
+    for (int s = 0; s < 30; s++) {
+        bits += (uint64_t)distFreq[s] * (codes->distLengths[s] + stbi__zdist_extra[s]);
+    }
+    return bits;
+}
+
+// Writes a block of tokens covering raw, with dynamic Huffman codes or stored if that's smaller
+static void writeTokenBlock(DeflateOutput *out, const DeflateToken *tokens, size_t count,
+                            const unsigned char *raw, size_t rawSize, int final) {
+    static const unsigned char clOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    uint32_t litFreq[286] = {0};
+    uint32_t distFreq[30] = {0};
+    size_t matches = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (tokens[i].distance == 0) {
+            litFreq[tokens[i].length]++;
+        } else {
+            litFreq[257 + lengthSymbols[tokens[i].length]]++;
+            distFreq[distanceSymbol(tokens[i].distance)]++;
+            matches++;
+        }
+    }
+    litFreq[256] = 1;
+    if (matches == 0) {
+        distFreq[0] = 1; // Some inflaters reject a block without any distance code, as zlib notes
+    }
+
+    HuffmanCodes codes;
+    uint64_t bits = buildHuffmanCodes(litFreq, distFreq, &codes);
+    if (bits / 8 + 5 > rawSize + 5 * (rawSize / 65535 + 1)) {
+        writeStoredBlocks(out, raw, rawSize, final);
+        return;
+    }
+
+    putBits(out, final, 1);
+    putBits(out, 2, 2);
+    putBits(out, codes.hlit - 257, 5);
+    putBits(out, codes.hdist - 1, 5);
+    putBits(out, codes.hclen - 4, 4);
+    for (int i = 0; i < codes.hclen; i++) {
+        putBits(out, codes.clLengths[clOrder[i]], 3);
+    }
+    for (int i = 0; i < codes.clCount; i++) {
+        int symbol = codes.clSymbols[i];
+        putBits(out, codes.clCodes[symbol], codes.clLengths[symbol]);
+        if (symbol >= 16) {
+            putBits(out, codes.clExtra[i], symbol == 16 ? 2 : symbol == 17 ? 3 : 7);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        int length = tokens[i].length;
+        int distance = tokens[i].distance;
+        if (distance == 0) {
+            putBits(out, codes.litCodes[length], codes.litLengths[length]);
+            continue;
+        }
+        int symbol = lengthSymbols[length];
+        putBits(out, codes.litCodes[257 + symbol], codes.litLengths[257 + symbol]);
+        putBits(out, (uint32_t)(length - stbi__zlength_base[symbol]), stbi__zlength_extra[symbol]);
+        symbol = distanceSymbol(distance);
+        putBits(out, codes.distCodes[symbol], codes.distLengths[symbol]);
+        putBits(out, (uint32_t)(distance - stbi__zdist_base[symbol]), stbi__zdist_extra[symbol]);
+    }
+    putBits(out, codes.litCodes[256], codes.litLengths[256]);
+}
+
+// Fast level: runs of one byte become distance 1 matches, everything else literals
+static size_t tokenizeRuns(const unsigned char *data, size_t *pos, size_t end, DeflateToken *tokens) {
+    size_t count = 0;
+    size_t i = *pos;
+    while (i < end && count < DEFLATE_BLOCK_TOKENS) {
+        size_t run = 0;
+        if (i > 0) {
+            size_t limit = end - i < 258 ? end - i : 258;
+            while (run < limit && data[i + run] == data[i - 1]) {
+                run++;
+            }
+        }
+        if (run >= 3) {
+            tokens[count++] = (DeflateToken){(uint16_t)run, 1};
+            i += run;
+        } else {
+            tokens[count++] = (DeflateToken){data[i], 0};
+            i++;
+        }
+    }
+    *pos = i;
+    return count;
+}
+
+FORCE_INLINE uint32_t hashBytes(const unsigned char *p) {
+    uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+    return (v * 2654435761u) >> 17;
+}
+
+// Adds position pos to the chains if 3 bytes start there
+FORCE_INLINE void insertMatch(MatchFinder *finder, const unsigned char *data, size_t pos, size_t end) {
+    if (pos + 3 <= end) {
+        uint32_t h = hashBytes(data + pos);
+        finder->prev[pos & 0x7FFF] = finder->head[h];
+        finder->head[h] = (uint32_t)pos + 1;
+    }
+}
+
+// Longest earlier match of the bytes at pos within 32 KB. Returns its length, 0 if under 3.
+static int longestMatch(const MatchFinder *finder, const unsigned char *data, size_t pos, size_t end, int *distance) {
+    size_t limit = end - pos < 258 ? end - pos : 258;
+    if (limit < 3) {
+        return 0;
+    }
+    int best = 2;
+    int chain = DEFLATE_MAX_CHAIN;
+    size_t last = pos;
+    for (uint32_t entry = finder->head[hashBytes(data + pos)]; entry != 0 && chain-- > 0;
+         entry = finder->prev[(entry - 1) & 0x7FFF]) {
+        size_t candidate = entry - 1;
+        if (candidate >= last || pos - candidate > 32768) {
+            break; // Overwritten or out of the window
+        }
+        last = candidate;
+        if (data[candidate + best] != data[pos + best]) {
+            continue;
+        }
+        size_t length = 0;
+        while (length < limit && data[candidate + length] == data[pos + length]) {
+            length++;
+        }
+        if ((int)length > best && (length > 3 || pos - candidate <= DEFLATE_TOO_FAR)) {
+            best = (int)length;
+            *distance = (int)(pos - candidate);
+            if (length == limit) {
+                break;
+            }
+        }
+    }
+    return best >= 3 ? best : 0;
+}
+
+// Best level: hash chain matches with one step of lazy evaluation, as zlib does
+static size_t tokenizeMatches(MatchFinder *finder, const unsigned char *data, size_t *pos, size_t end, DeflateToken *tokens) {
+    size_t count = 0;
+    size_t i = *pos;
+    while (i < end && count + 2 <= DEFLATE_BLOCK_TOKENS) {
+        int distance = 0;
+        int length = longestMatch(finder, data, i, end, &distance);
+        insertMatch(finder, data, i, end);
+        if (length == 0) {
+            tokens[count++] = (DeflateToken){data[i], 0};
+            i++;
+            continue;
+        }
+        if (length < DEFLATE_LAZY_LENGTH && i + 1 < end) {
+            int nextDistance = 0;
+            int nextLength = longestMatch(finder, data, i + 1, end, &nextDistance);
+            if (nextLength > length) {
+                tokens[count++] = (DeflateToken){data[i], 0};
+                i++;
+                insertMatch(finder, data, i, end);
+                length = nextLength;
+                distance = nextDistance;
+            }
+        }
+        tokens[count++] = (DeflateToken){(uint16_t)length, (uint16_t)distance};
+        for (size_t k = i + 1; k < i + length; k++) {
+            insertMatch(finder, data, k, end);
+        }
+        i += length;
+    }
+    *pos = i;
+    return count;
+}
+
+// Compresses data[start, end) as deflate blocks appended to out, matching back into the window
+// data[0, start) as well. Unless final, the chunk ends with an empty stored block (a sync flush)
+// so it stops on a byte boundary and the next chunk can follow it. Returns 0 if out of memory.
+static int deflateChunk(const unsigned char *data, size_t start, size_t end, int level, int final, DeflateOutput *out) {
+    if (level == PNG_LEVEL_STORED) {
+        writeStoredBlocks(out, data + start, end - start, final);
+    } else {
+        DeflateToken *tokens = STBI_MALLOC(DEFLATE_BLOCK_TOKENS * sizeof(DeflateToken));
+        MatchFinder *finder = level == PNG_LEVEL_BEST ? STBI_MALLOC(sizeof(MatchFinder)) : NULL;
+        if (tokens == NULL || (level == PNG_LEVEL_BEST && finder == NULL)) {
+            STBI_FREE(tokens);
+            STBI_FREE(finder);
+            return 0;
+        }
+        if (finder != NULL) {
+            memset(finder->head, 0, sizeof(finder->head));
+            for (size_t pos = start > 32768 ? start - 32768 : 0; pos < start; pos++) {
+                insertMatch(finder, data, pos, end);
+            }
+        }
+        size_t pos = start;
+        do {
+            size_t blockStart = pos;
+            size_t count = finder ? tokenizeMatches(finder, data, &pos, end, tokens) : tokenizeRuns(data, &pos, end, tokens);
+            writeTokenBlock(out, tokens, count, data + blockStart, pos - blockStart, final && pos == end);
+        } while (pos < end);
+        STBI_FREE(tokens);
+        STBI_FREE(finder);
+    }
+    if (!final) {
+        putBits(out, 0, 3);
+        alignDeflate(out);
+        if (reserveDeflate(out, 4)) {
+            memcpy(out->data + out->size, "\0\0\xFF\xFF", 4);
+            out->size += 4;
+        }
+    }
+    alignDeflate(out);
+    return !out->failed;
+}
+
+// Encodes RGB rows as an 8-bit truecolor PNG handed to a write callback as it goes. Rows are
+// filtered as they come in (the filter picked per row) and collected until there is a chunk
+// for every thread. The chunks are then deflated at once, pigz style: each on its own thread,
+// matching back into the 32 KB before it and ending on a sync flush, so their outputs simply
+// follow each other in the zlib stream. Memory holds one chunk per thread and the window
+// before them, whatever the image size.
+struct PngWriter {
+    ImageWriteCallback write;
+    void *user;
+    int width;
+    int height;
+    int level;
+    int threads;
+    int row;                  // Rows written so far
+    size_t stride;            // Bytes per row without the filter type byte
+    unsigned char *prior;     // Previous row, zero before the first
+    unsigned char *filtered;  // The row with each of the five filters
+    unsigned char *chunk;     // Window from the previous chunks, then the filtered rows of these
+    size_t window;
+    size_t fill;
+    size_t capacity;
+    uint32_t adler;
+    DeflateOutput *outs;      // Output of each thread's chunk, the first starting with the zlib header
+    int failed;
+};
+
+// One chunk of a PNG deflated by a thread
+typedef struct {
+    const unsigned char *data;
+    size_t start;
+    size_t end;
+    int level;
+    int final;
+    DeflateOutput *out;
+    uint32_t adler;                    // Adler-32 of the chunk alone
+    const hidenc_allocator *allocator; // Allocator of the thread that started the job
+    int ok;
+} DeflateJob;
+
+static void runDeflateJob(DeflateJob *job) {
+    const hidenc_allocator *outer = callAllocator;
+    callAllocator = job->allocator;
+    job->adler = updateAdler(1, job->data + job->start, job->end - job->start);
+    job->ok = deflateChunk(job->data, job->start, job->end, job->level, job->final, job->out);
+    callAllocator = outer;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI deflateThread(LPVOID job) {
+    runDeflateJob(job);
+    return 0;
+}
+#else
+static void *deflateThread(void *job) {
+    runDeflateJob(job);
+    return NULL;
+}
+#endif
+
+// Adler-32 of two blocks one after the other from the checksums of each, as zlib's adler32_combine
+static uint32_t combineAdler(uint32_t first, uint32_t second, size_t secondSize) {
+    uint32_t rem = (uint32_t)(secondSize % 65521);
+    uint32_t sum1 = first & 0xFFFF;
+    uint32_t sum2 = (uint32_t)((uint64_t)rem * sum1 % 65521);
+    sum1 += (second & 0xFFFF) + 65521 - 1;
+    sum2 += (first >> 16) + (second >> 16) + 65521 - rem;
+    if (sum1 >= 65521) {
+        sum1 -= 65521;
+    }
+    if (sum1 >= 65521) {
+        sum1 -= 65521;
+    }
+    if (sum2 >= 2 * 65521) {
+        sum2 -= 2 * 65521;
+    }
+    if (sum2 >= 65521) {
+        sum2 -= 65521;
+    }
+    return sum2 << 16 | sum1;
+}
+
+// Writes a PNG chunk of the given type
+static int writePngChunk(PngWriter *writer, const char *type, const unsigned char *data, size_t size) {
+    unsigned char head[8], crc[4];
+    putBigEndian32(head, (uint32_t)size);
+    memcpy(head + 4, type, 4);
+    putBigEndian32(crc, updateCrc(updateCrc(0, head + 4, 4), data, size));
+    return writer->write(writer->user, head, 8) && (size == 0 || writer->write(writer->user, data, size)) &&
+           writer->write(writer->user, crc, 4);
+}
+
+// Splits the rows collected into one chunk per thread, deflates them in parallel and writes
+// each as an IDAT chunk. Keeps the last 32 KB as the window of the next flush.
+static int flushPngChunks(PngWriter *writer, int final) {
+    DeflateJob jobs[PNG_MAX_THREADS];
+    size_t size = writer->fill - writer->window;
+    int count = writer->threads;
+    if ((size_t)count > size / PNG_MIN_JOB) {
+        count = size / PNG_MIN_JOB > 0 ? (int)(size / PNG_MIN_JOB) : 1;
+    }
+    for (int i = 0; i < count; i++) {
+        jobs[i] = (DeflateJob){writer->chunk, writer->window + size * i / count, writer->window + size * (i + 1) / count,
+                               writer->level, final && i == count - 1, &writer->outs[i], 0, callAllocator, 0};
+    }
+
+    // The first chunk runs on this thread; the others on threads of their own, or here too
+    // if one can't be started
+#ifdef _WIN32
+    HANDLE pool[PNG_MAX_THREADS];
+    for (int i = 1; i < count; i++) {
+        pool[i] = CreateThread(NULL, 0, deflateThread, &jobs[i], 0, NULL);
+        if (pool[i] == NULL) {
+            runDeflateJob(&jobs[i]);
+        }
+    }
+    runDeflateJob(&jobs[0]);
+    for (int i = 1; i < count; i++) {
+        if (pool[i] != NULL) {
+            WaitForSingleObject(pool[i], INFINITE);
+            CloseHandle(pool[i]);
+        }
+    }
+#else
+    pthread_t pool[PNG_MAX_THREADS];
+    int started[PNG_MAX_THREADS];
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&pool[i], NULL, deflateThread, &jobs[i]) == 0;
+        if (!started[i]) {
+            runDeflateJob(&jobs[i]);
+        }
+    }
+    runDeflateJob(&jobs[0]);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(pool[i], NULL);
+        }
+    }
+#endif
+
+    int ok = 1;
+    for (int i = 0; i < count; i++) {
+        DeflateOutput *out = jobs[i].out;
+        writer->adler = combineAdler(writer->adler, jobs[i].adler, jobs[i].end - jobs[i].start);
+        if (jobs[i].final && jobs[i].ok) {
+            if (reserveDeflate(out, 4)) {
+                putBigEndian32(out->data + out->size, writer->adler);
+                out->size += 4;
+            }
+            jobs[i].ok = !out->failed;
+        }
+        ok = ok && jobs[i].ok && writePngChunk(writer, "IDAT", out->data, out->size);
+        out->size = 0;
+    }
+    size_t keep = writer->level == PNG_LEVEL_STORED ? 0 : writer->fill < 32768 ? writer->fill : 32768;
+    memmove(writer->chunk, writer->chunk + writer->fill - keep, keep);
+    writer->window = writer->fill = keep;
+    return ok;
+}
+
+static void closePngWriterBuffers(PngWriter *writer) {
+    STBI_FREE(writer->prior);
+    STBI_FREE(writer->filtered);
+    STBI_FREE(writer->chunk);
+    for (int i = 0; writer->outs != NULL && i < writer->threads; i++) {
+        STBI_FREE(writer->outs[i].data);
+    }
+    STBI_FREE(writer->outs);
+    STBI_FREE(writer);
+}
+
+// Starts a PNG of the given size and compression level (PNG_LEVEL_*), writing its signature
+// and header. Up to threads threads (at most PNG_MAX_THREADS) deflate it. Returns NULL if out
+// of memory or the first write fails.
+PngWriter *openPngWriter(int width, int height, int level, int threads, ImageWriteCallback write, void *user) {
+    PngWriter *writer = STBI_MALLOC(sizeof(PngWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    memset(writer, 0, sizeof(*writer));
+    writer->write = write;
+    writer->user = user;
+    writer->width = width;
+    writer->height = height;
+    writer->level = level;
+    writer->threads = threads < 1 ? 1 : threads > PNG_MAX_THREADS ? PNG_MAX_THREADS : threads;
+    writer->stride = (size_t)width * 3;
+    writer->capacity = (size_t)writer->threads * PNG_CHUNK;
+    if (writer->capacity < writer->stride + 1) {
+        writer->capacity = writer->stride + 1;
+    }
+    writer->adler = 1;
+    writer->prior = STBI_MALLOC(writer->stride);
+    writer->filtered = STBI_MALLOC(writer->stride * 5);
+    writer->chunk = STBI_MALLOC(32768 + writer->capacity);
+    writer->outs = STBI_MALLOC(writer->threads * sizeof(DeflateOutput));
+    if (writer->outs != NULL) {
+        memset(writer->outs, 0, writer->threads * sizeof(DeflateOutput));
+    }
+    if (writer->prior == NULL || writer->filtered == NULL || writer->chunk == NULL || writer->outs == NULL ||
+        !reserveDeflate(&writer->outs[0], 2)) {
+        closePngWriterBuffers(writer);
+        return NULL;
+    }
+    memset(writer->prior, 0, writer->stride);
+
+    // zlib header: deflate with a 32 KB window, the level hint, no dictionary
+    writer->outs[0].data[0] = 0x78;
+    writer->outs[0].data[1] = level == PNG_LEVEL_BEST ? 0xDA : 0x01;
+    writer->outs[0].size = 2;
+
+    unsigned char header[13];
+    putBigEndian32(header, (uint32_t)width);
+    putBigEndian32(header + 4, (uint32_t)height);
+    memcpy(header + 8, "\x08\x02\0\0\0", 5); // 8 bits per channel, RGB, deflate, adaptive filters, not interlaced
+    if (!write(user, pngSignature, 8) || !writePngChunk(writer, "IHDR", header, 13)) {
+        closePngWriterBuffers(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Filters and compresses the next rows, top to bottom. Returns 0 if a write fails or out of memory.
+int writePngRows(PngWriter *writer, const unsigned char *rgb, int rows) {
+    size_t stride = writer->stride;
+    for (int i = 0; i < rows && !writer->failed; i++, rgb += stride) {
+        if (writer->fill - writer->window + stride + 1 > writer->capacity && !flushPngChunks(writer, 0)) {
+            writer->failed = 1;
+            break;
+        }
+        unsigned char *dst = writer->chunk + writer->fill;
+        if (writer->level == PNG_LEVEL_STORED) {
+            dst[0] = 0; // Stored data doesn't get smaller when filtered
+            memcpy(dst + 1, rgb, stride);
+        } else {
+            int filter = filterKernel(rgb, writer->prior, stride, writer->filtered);
+            dst[0] = (unsigned char)filter;
+            memcpy(dst + 1, writer->filtered + filter * stride, stride);
+            memcpy(writer->prior, rgb, stride);
+        }
+        writer->fill += stride + 1;
+        writer->row++;
+    }
+    return !writer->failed;
+}
+
+// Compresses what is left and writes the end of the PNG. Returns 0 if anything failed,
+// including fewer rows than the height written.
+int closePngWriter(PngWriter *writer) {
+    int ok = !writer->failed && writer->row == writer->height && flushPngChunks(writer, 1) &&
+             writePngChunk(writer, "IEND", NULL, 0);
+    closePngWriterBuffers(writer);
+    return ok;
+}
+
+// QOI ("Quite OK Image") images: a 14-byte header, then one op per pixel or run of pixels,
+// each predicting from the previous pixel or a 64-entry table of recently seen colors, then
+// 7 zero bytes and a 1. Both directions stream rows, so the embed and extract strips are filled
+// and drained straight from the codec.
+#define QOI_HEADER_BYTES 14
+#define QOI_END_BYTES 8
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+// Bytes read from a file, and written to the callback, at a time
+#define QOI_BUFFER 65536
+// Longest op, so one can be decoded without checking the input in between
+#define QOI_MAX_OP 5
+
+static const unsigned char qoiEnd[QOI_END_BYTES] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+// Slot of a color in the table of recently seen colors
+FORCE_INLINE int qoiHash(int r, int g, int b, int a) {
+    return (r * 3 + g * 5 + b * 7 + a * 11) & 63;
+}
+
+// A QOI decoded a row at a time, from a file or from bytes held in memory
+struct QoiStream {
+    FILE *file;                // NULL when decoding from memory
+    unsigned char *input;      // Buffer of bytes read from the file
+    const unsigned char *next; // Next op
+    const unsigned char *end;  // End of the bytes available
+    int width;
+    int height;
+    int row;                   // Rows decoded so far
+    unsigned char index[64][4];
+    unsigned char pixel[4];    // Previous pixel, RGBA
+    int run;                   // Pixels of the current run not output yet
+};
+
+// Reads the QOI header. Returns 0 if the bytes don't start one with a size stb would accept.
+int qoiInfo(const unsigned char *bytes, size_t len, int *width, int *height, int *channels) {
+    if (len < QOI_HEADER_BYTES || memcmp(bytes, "qoif", 4) != 0) {
+        return 0;
+    }
+    uint32_t w = getBigEndian32(bytes + 4);
+    uint32_t h = getBigEndian32(bytes + 8);
+    if (w == 0 || h == 0 || w > STBI_MAX_DIMENSIONS || h > STBI_MAX_DIMENSIONS || (bytes[12] != 3 && bytes[12] != 4) ||
+        !stbi__mad3sizes_valid((int)w, (int)h, 3, 0)) {
+        return 0;
+    }
+    *width = (int)w;
+    *height = (int)h;
+    *channels = bytes[12];
+    return 1;
+}
+
+// Moves the unread bytes to the front of the buffer and fills the rest from the file. Returns
+// 0 if nothing more could be read.
+static int refillQoiInput(QoiStream *stream) {
+    if (stream->file == NULL) {
+        return 0;
+    }
+    size_t left = (size_t)(stream->end - stream->next);
+    memmove(stream->input, stream->next, left);
+    size_t count = fread(stream->input + left, 1, QOI_BUFFER - left, stream->file);
+    stream->next = stream->input;
+    stream->end = stream->input + left + count;
+    return count > 0;
+}
+
+static QoiStream *openQoi(FILE *file, const unsigned char *bytes, size_t len, int *width, int *height, int *channels) {
+    QoiStream *stream = STBI_MALLOC(sizeof(QoiStream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->file = file;
+    if (file != NULL) {
+        stream->input = STBI_MALLOC(QOI_BUFFER);
+        if (stream->input == NULL) {
+            closeQoiStream(stream);
+            return NULL;
+        }
+        stream->next = stream->end = stream->input;
+        while (stream->end - stream->next < QOI_HEADER_BYTES && refillQoiInput(stream)) {
+        }
+    } else {
+        stream->next = bytes;
+        stream->end = bytes + len;
+    }
+    if (!qoiInfo(stream->next, (size_t)(stream->end - stream->next), &stream->width, &stream->height, channels)) {
+        closeQoiStream(stream);
+        return NULL;
+    }
+    stream->next += QOI_HEADER_BYTES;
+    stream->pixel[3] = 255;
+    *width = stream->width;
+    *height = stream->height;
+    return stream;
+}
+
+// Starts decoding a QOI from the current position of file. Returns NULL, having read part of
+// the file, if it isn't a QOI.
+QoiStream *openQoiStream(FILE *file, int *width, int *height, int *channels) {
+    return openQoi(file, NULL, 0, width, height, channels);
+}
+
+// Starts decoding a QOI held in memory, which must outlive the stream
+QoiStream *openQoiMemory(const unsigned char *bytes, size_t len, int *width, int *height, int *channels) {
+    return openQoi(NULL, bytes, len, width, height, channels);
+}
+
+// Decodes the next rows, top to bottom, as RGB into rgb. Returns 0 if the data ends early.
+int readQoiRows(QoiStream *stream, unsigned char *rgb, int rows) {
+    if (rows > stream->height - stream->row) {
+        return 0;
+    }
+    size_t pixels = (size_t)rows * stream->width;
+    int r = stream->pixel[0], g = stream->pixel[1], b = stream->pixel[2], a = stream->pixel[3];
+    const unsigned char *p = stream->next;
+    int ok = 1;
+    while (pixels > 0) {
+        if (stream->run > 0) {
+            size_t count = (size_t)stream->run < pixels ? (size_t)stream->run : pixels;
+            for (size_t i = 0; i < count; i++, rgb += 3) {
+                rgb[0] = (unsigned char)r;
+                rgb[1] = (unsigned char)g;
+                rgb[2] = (unsigned char)b;
+            }
+            stream->run -= (int)count;
+            pixels -= count;
+            continue;
+        }
+        if (stream->end - p < QOI_MAX_OP) {
+            stream->next = p;
+            if (!refillQoiInput(stream) && stream->end - stream->next < QOI_MAX_OP) {
+                ok = 0; // A valid file always has the end marker after the last op
+                break;
+            }
+            p = stream->next;
+        }
+
+        // Ops until a run, the end of the rows or the end of the input that is safe to read
+        const unsigned char *safe = stream->end - (QOI_MAX_OP - 1);
+        while (pixels > 0 && p < safe) {
+            int op = *p++;
+            if (op == QOI_OP_RGB) {
+                r = p[0];
+                g = p[1];
+                b = p[2];
+                p += 3;
+            } else if (op == QOI_OP_RGBA) {
+                r = p[0];
+                g = p[1];
+                b = p[2];
+                a = p[3];
+                p += 4;
+            } else if (op < QOI_OP_DIFF) {
+                r = stream->index[op][0];
+                g = stream->index[op][1];
+                b = stream->index[op][2];
+                a = stream->index[op][3];
+            } else if (op < QOI_OP_LUMA) {
+                r = (r + ((op >> 4) & 3) - 2) & 0xFF;
+                g = (g + ((op >> 2) & 3) - 2) & 0xFF;
+                b = (b + (op & 3) - 2) & 0xFF;
+            } else if (op < QOI_OP_RUN) {
+                int dg = (op & 0x3F) - 32;
+                int rb = *p++;
+                r = (r + dg - 8 + (rb >> 4)) & 0xFF;
+                g = (g + dg) & 0xFF;
+                b = (b + dg - 8 + (rb & 15)) & 0xFF;
+            } else {
+                stream->run = (op & 0x3F) + 1;
+                unsigned char *slot = stream->index[qoiHash(r, g, b, a)];
+                slot[0] = (unsigned char)r;
+                slot[1] = (unsigned char)g;
+                slot[2] = (unsigned char)b;
+                slot[3] = (unsigned char)a;
+                break;
+            }
+            unsigned char *slot = stream->index[qoiHash(r, g, b, a)];
+            slot[0] = (unsigned char)r;
+            slot[1] = (unsigned char)g;
+            slot[2] = (unsigned char)b;
+            slot[3] = (unsigned char)a;
+            rgb[0] = (unsigned char)r;
+            rgb[1] = (unsigned char)g;
+            rgb[2] = (unsigned char)b;
+            rgb += 3;
+            pixels--;
+        }
+    }
+    stream->next = p;
+    stream->pixel[0] = (unsigned char)r;
+    stream->pixel[1] = (unsigned char)g;
+    stream->pixel[2] = (unsigned char)b;
+    stream->pixel[3] = (unsigned char)a;
+    if (ok) {
+        stream->row += rows;
+    }
+    return ok;
+}
+
+void closeQoiStream(QoiStream *stream) {
+    if (stream != NULL) {
+        STBI_FREE(stream->input);
+        STBI_FREE(stream);
+    }
+}
+
+// Decodes the rows of a QOI stream not read yet into a new buffer. Returns NULL on failure.
+unsigned char *readQoiImage(QoiStream *stream) {
+    int rows = stream->height - stream->row;
+    unsigned char *rgb = stbi__malloc_mad3(rows, stream->width, 3, 0);
+    if (rgb != NULL && !readQoiRows(stream, rgb, rows)) {
+        STBI_FREE(rgb);
+        rgb = NULL;
+    }
+    return rgb;
+}
+
+// Like decodePngPayload for a QOI held in memory: decodes the rows with the header, then
+// carries on to the last row of the payload and stops there
+int decodeQoiPayload(const unsigned char *qoi, size_t len, PixelsData *pixelsData) {
+    PixelsData shape;
+    StegoHeader header;
+    int channels;
+    pixelsData->data = NULL;
+    QoiStream *stream = openQoiMemory(qoi, len, &shape.width, &shape.height, &channels);
+    if (stream == NULL) {
+        return 0;
+    }
+    size_t rowBytes = (size_t)shape.width * 3;
+    int rows = rowsForChannels(HEADER_CHANNELS, shape.width, shape.height);
+    shape.data = STBI_MALLOC(rows * rowBytes);
+    if (shape.data != NULL && readQoiRows(stream, shape.data, rows) && readHeader(shape, &header)) {
+        int payloadRows = rowsForChannels(HEADER_CHANNELS + payloadChannels(header.length, header.depth),
+                                          shape.width, shape.height);
+        unsigned char *data = STBI_REALLOC_SIZED(shape.data, rows * rowBytes, payloadRows * rowBytes);
+        if (data != NULL && readQoiRows(stream, data + rows * rowBytes, payloadRows - rows)) {
+            shape.data = data;
+            *pixelsData = shape;
+        } else {
+            STBI_FREE(data != NULL ? data : shape.data);
+        }
+    } else {
+        STBI_FREE(shape.data);
+    }
+    closeQoiStream(stream);
+    return pixelsData->data != NULL;
+}
+
+// Decodes a whole image held in memory to RGB: a QOI here, anything else with stb_image.
+// Free the result with stbi_image_free.
+unsigned char *decodeRgb(const unsigned char *bytes, size_t len, int *width, int *height) {
+    int channels;
+    QoiStream *stream = openQoiMemory(bytes, len, width, height, &channels);
+    if (stream != NULL) {
+        unsigned char *rgb = readQoiImage(stream);
+        closeQoiStream(stream);
+        return rgb;
+    }
+    return len <= INT_MAX ? stbi_load_from_memory(bytes, (int)len, width, height, &channels, 3) : NULL;
+}
+
+// Encodes RGB rows as a QOI handed to a write callback through a small buffer
+struct QoiWriter {
+    ImageWriteCallback write;
+    void *user;
+    int width;
+    int height;
+    int row;
+    unsigned char index[64][4];
+    unsigned char pixel[3]; // Previous pixel; alpha is always 255
+    int run;
+    unsigned char *output;
+    size_t fill;
+    int failed;
+};
+
+static int flushQoiOutput(QoiWriter *writer) {
+    if (writer->fill > 0 && !writer->write(writer->user, writer->output, writer->fill)) {
+        writer->failed = 1;
+    }
+    writer->fill = 0;
+    return !writer->failed;
+}
+
+// Starts a QOI of the given size, RGB in the sRGB color space. Returns NULL if out of memory.
+QoiWriter *openQoiWriter(int width, int height, ImageWriteCallback write, void *user) {
+    QoiWriter *writer = STBI_MALLOC(sizeof(QoiWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    memset(writer, 0, sizeof(*writer));
+    writer->write = write;
+    writer->user = user;
+    writer->width = width;
+    writer->height = height;
+    writer->output = STBI_MALLOC(QOI_BUFFER);
+    if (writer->output == NULL) {
+        STBI_FREE(writer);
+        return NULL;
+    }
+    memcpy(writer->output, "qoif", 4);
+    putBigEndian32(writer->output + 4, (uint32_t)width);
+    putBigEndian32(writer->output + 8, (uint32_t)height);
+    writer->output[12] = 3;
+    writer->output[13] = 0;
+    writer->fill = QOI_HEADER_BYTES;
+    return writer;
+}
+
+// Encodes the next rows, top to bottom. Returns 0 if a write fails.
+int writeQoiRows(QoiWriter *writer, const unsigned char *rgb, int rows) {
+    size_t pixels = (size_t)rows * writer->width;
+    int pr = writer->pixel[0], pg = writer->pixel[1], pb = writer->pixel[2];
+    int run = writer->run;
+    unsigned char *out = writer->output + writer->fill;
+    unsigned char *limit = writer->output + QOI_BUFFER - QOI_MAX_OP;
+    for (size_t i = 0; i < pixels && !writer->failed; i++, rgb += 3) {
+        int r = rgb[0], g = rgb[1], b = rgb[2];
+        if (out >= limit) {
+            writer->fill = (size_t)(out - writer->output);
+            flushQoiOutput(writer);
+            out = writer->output;
+        }
+        if (r == pr && g == pg && b == pb) {
+            if (++run == 62) {
+                *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+        int hash = qoiHash(r, g, b, 255);
+        unsigned char *slot = writer->index[hash];
+        if (slot[0] == r && slot[1] == g && slot[2] == b && slot[3] == 255) {
+            *out++ = (unsigned char)(QOI_OP_INDEX | hash);
+        } else {
+            slot[0] = (unsigned char)r;
+            slot[1] = (unsigned char)g;
+            slot[2] = (unsigned char)b;
+            slot[3] = 255;
+            int dr = (signed char)(r - pr);
+            int dg = (signed char)(g - pg);
+            int db = (signed char)(b - pb);
+            int drg = dr - dg;
+            int dbg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *out++ = (unsigned char)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                *out++ = (unsigned char)(QOI_OP_LUMA | (dg + 32));
+                *out++ = (unsigned char)((drg + 8) << 4 | (dbg + 8));
+            } else {
+                out[0] = QOI_OP_RGB;
+                out[1] = (unsigned char)r;
+                out[2] = (unsigned char)g;
+                out[3] = (unsigned char)b;
+                out += 4;
+            }
+        }
+        pr = r;
+        pg = g;
+        pb = b;
+    }
+    writer->fill = (size_t)(out - writer->output);
+    writer->pixel[0] = (unsigned char)pr;
+    writer->pixel[1] = (unsigned char)pg;
+    writer->pixel[2] = (unsigned char)pb;
+    writer->run = run;
+    writer->row += rows;
+    return !writer->failed;
+}
+
+// Ends the QOI and writes what is buffered. Returns 0 if anything failed, including fewer
+// rows than the height written.
+int closeQoiWriter(QoiWriter *writer) {
+    if (writer->fill + 1 + QOI_END_BYTES > QOI_BUFFER) {
+        flushQoiOutput(writer);
+    }
+    if (writer->run > 0) {
+        writer->output[writer->fill++] = (unsigned char)(QOI_OP_RUN | (writer->run - 1));
+    }
+    memcpy(writer->output + writer->fill, qoiEnd, QOI_END_BYTES);
+    writer->fill += QOI_END_BYTES;
+    int ok = flushQoiOutput(writer) && writer->row == writer->height;
+    STBI_FREE(writer->output);
+    STBI_FREE(writer);
+    return ok;
+}
+
+// Binary PPM (P6): a text header of the magic, the width, the height and the largest sample
+// value, separated by whitespace and # comments, then a single whitespace byte and the RGB rows,
+// top to bottom and unpadded. Video tools pipe frames as PPMs following each other, so the header
+// is read a byte at a time and nothing past it is consumed.
+#define PPM_MAX_VALUE 255
+
+static int isPpmSpace(int c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// Reads a decimal field of the header after the whitespace and comments before it, along with
+// the whitespace byte ending it. Returns 0 if there is no such field.
+static int readPpmNumber(FILE *file, uint32_t *value) {
+    int c = getc(file);
+    while (isPpmSpace(c) || c == '#') {
+        if (c == '#') {
+            while (c != '\n' && c != '\r' && c != EOF) {
+                c = getc(file);
+            }
+        }
+        c = getc(file);
+    }
+    if (c < '0' || c > '9') {
+        return 0;
+    }
+    uint32_t v = 0;
+    while (c >= '0' && c <= '9') {
+        if (v > (UINT32_MAX - 9) / 10) {
+            return 0;
+        }
+        v = v * 10 + (uint32_t)(c - '0');
+        c = getc(file);
+    }
+    *value = v;
+    return isPpmSpace(c);
+}
+
+// Reads the header of the next P6 frame of file, leaving it at the first pixel. Only 8-bit
+// frames (largest value 255) are taken, as other depths can't carry the bits through unchanged.
+// Returns 1 for a frame, -1 at the end of the stream and 0 for anything else.
+int readPpmHeader(FILE *file, int *width, int *height) {
+    int c = getc(file);
+    while (isPpmSpace(c)) {
+        c = getc(file);
+    }
+    if (c == EOF) {
+        return -1;
+    }
+    uint32_t w, h, maxValue;
+    if (c != 'P' || getc(file) != '6' || !readPpmNumber(file, &w) || !readPpmNumber(file, &h) ||
+        !readPpmNumber(file, &maxValue)) {
+        return 0;
+    }
+    if (w == 0 || h == 0 || w > STBI_MAX_DIMENSIONS || h > STBI_MAX_DIMENSIONS || maxValue != PPM_MAX_VALUE ||
+        !stbi__mad3sizes_valid((int)w, (int)h, 3, 0)) {
+        return 0;
+    }
+    *width = (int)w;
+    *height = (int)h;
+    return 1;
+}
+
+// JPEGs embedded in the DCT domain, the way JSteg does: the entropy-coded data is decoded to the
+// quantized coefficients of each 8x8 block and no further (no dequantization, IDCT, upsampling
+// or color conversion), the payload goes into their low bits, and the coefficients are Huffman
+// coded again into a baseline JPEG with the same quantization, so the image stays a JPEG of
+// about the same size. Coefficients 0 and 1 are skipped, since flipping their low bit would
+// turn zeros into ones and back, as is the pair -1024/-1023, whose -1024 baseline can't code:
+// the set of carriers is then the same before and after embedding. DC coefficients are left
+// alone. The header and payload go at one bit per carrier, in component, block and zigzag order.
+#define JPEG_BUFFER 65536
+// Symbols of a Huffman table, plus the one reserving the all-ones code
+#define JPEG_SYMBOLS 257
+
+struct JpegCoefficients {
+    int width;
+    int height;
+    int components;
+    int mcuX;                 // MCUs across and down the interleaved scan
+    int mcuY;
+    struct {
+        int id;
+        int h;                // Sampling factors
+        int v;
+        int tq;               // Quantization table
+        int blocksX;          // Blocks coded when the component is scanned alone
+        int blocksY;
+        int stride;           // Blocks per row of coeff, padded to whole MCUs
+        short *coeff;         // 64 coefficients per block, in natural order
+        void *raw;            // Allocation holding coeff
+    } comp[4];
+    uint16_t quant[4][64];    // Quantization tables in natural order
+    unsigned char *markers;   // APPn and COM segments of the original, copied to the output
+    size_t markersSize;
+};
+
+// Whether a quantized AC coefficient carries a bit (see above)
+FORCE_INLINE int isJpegCarrier(int c) {
+    return (c < 0 || c > 1) && c > -1023;
+}
+
+// Copies the APPn and COM segments before the frame header, which hold the JFIF and Adobe color
+// information, EXIF and ICC profiles. Returns 0 if the segments are malformed.
+static int copyJpegMarkers(const unsigned char *jpg, size_t len, JpegCoefficients *jpeg) {
+    size_t pos = 2, size = 0;
+    while (pos + 4 <= len && jpg[pos] == 0xFF) {
+        int marker = jpg[pos + 1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if ((marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) ||
+            marker == 0xDA || marker == 0xD9) {
+            break;
+        }
+        size_t segment = 2 + ((size_t)jpg[pos + 2] << 8 | jpg[pos + 3]);
+        if (segment < 4 || pos + segment > len) {
+            return 0;
+        }
+        if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+            unsigned char *markers = STBI_REALLOC_SIZED(jpeg->markers, size, size + segment);
+            if (markers == NULL) {
+                return 0;
+            }
+            memcpy(markers + size, jpg + pos, segment);
+            jpeg->markers = markers;
+            jpeg->markersSize = size += segment;
+        }
+        pos += segment;
+    }
+    return 1;
+}
+
+// Entropy decodes a sequential scan into the coefficient blocks, as stb's
+// parse_entropy_coded_data does, but with unit quantization and no IDCT
+static int parseJpegBlocks(stbi__jpeg *z) {
+    static stbi__uint16 unit[64] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+                                    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+                                    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+    stbi__jpeg_reset(z);
+    int single = z->scan_n == 1;
+    int n0 = z->order[0];
+    int rows = single ? (z->img_comp[n0].y + 7) >> 3 : z->img_mcu_y;
+    int cols = single ? (z->img_comp[n0].x + 7) >> 3 : z->img_mcu_x;
+    for (int j = 0; j < rows; j++) {
+        for (int i = 0; i < cols; i++) {
+            for (int k = 0; k < z->scan_n; k++) {
+                int n = z->order[k];
+                int h = single ? 1 : z->img_comp[n].h;
+                int v = single ? 1 : z->img_comp[n].v;
+                for (int y = 0; y < v; y++) {
+                    for (int x = 0; x < h; x++) {
+                        short *data = z->img_comp[n].coeff + 64 * ((i * h + x) + (j * v + y) * z->img_comp[n].coeff_w);
+                        int ha = z->img_comp[n].ha;
+                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha,
+                                                     z->fast_ac[ha], n, unit)) {
+                            return 0;
+                        }
+                    }
+                }
+            }
+            if (--z->todo <= 0) {
+                if (z->code_bits < 24) {
+                    stbi__grow_buffer_unsafe(z);
+                }
+                if (!STBI__RESTART(z->marker)) {
+                    return 1;
+                }
+                stbi__jpeg_reset(z);
+            }
+        }
+    }
+    return 1;
+}
+
+// Runs every scan of the file into the coefficient blocks, as stb's decode_jpeg_image does but
+// stopping short of its final dequantization and IDCT. Progressive scans go through stb, which
+// keeps coefficients for them anyway.
+static int parseJpegScans(stbi__jpeg *z) {
+    int m = stbi__get_marker(z);
+    while (!stbi__EOI(m)) {
+        if (stbi__SOS(m)) {
+            if (!stbi__process_scan_header(z) ||
+                !(z->progressive ? stbi__parse_entropy_coded_data(z) : parseJpegBlocks(z))) {
+                return 0;
+            }
+            if (z->marker == STBI__MARKER_none) {
+                z->marker = stbi__skip_jpeg_junk_at_end(z);
+            }
+            m = stbi__get_marker(z);
+            if (STBI__RESTART(m)) {
+                m = stbi__get_marker(z);
+            }
+        } else if (stbi__DNL(m)) {
+            int ld = stbi__get16be(z->s);
+            stbi__uint32 nl = stbi__get16be(z->s);
+            if (ld != 4 || nl != z->s->img_y) {
+                return 0;
+            }
+            m = stbi__get_marker(z);
+        } else {
+            if (!stbi__process_marker(z, m)) {
+                return 1; // Truncated: keep what was decoded, as stb does
+            }
+            m = stbi__get_marker(z);
+        }
+    }
+    return 1;
+}
+
+void freeJpegCoefficients(JpegCoefficients *jpeg) {
+    if (jpeg == NULL) {
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        STBI_FREE(jpeg->comp[i].raw);
+    }
+    STBI_FREE(jpeg->markers);
+    STBI_FREE(jpeg);
+}
+
+// Entropy decodes a JPEG held in memory (baseline or progressive, as stb reads them) to its
+// quantized DCT coefficients. Returns NULL if it isn't a JPEG that can be decoded.
+JpegCoefficients *readJpegCoefficients(const unsigned char *jpg, size_t len) {
+    if (len < 2 || len > INT_MAX || jpg[0] != 0xFF || jpg[1] != 0xD8) {
+        return NULL;
+    }
+    JpegCoefficients *jpeg = STBI_MALLOC(sizeof(JpegCoefficients));
+    stbi__jpeg *z = STBI_MALLOC(sizeof(stbi__jpeg));
+    if (jpeg == NULL || z == NULL) {
+        STBI_FREE(jpeg);
+        STBI_FREE(z);
+        return NULL;
+    }
+    memset(jpeg, 0, sizeof(*jpeg));
+    memset(z, 0, sizeof(stbi__jpeg));
+    stbi__context s;
+    stbi__start_mem(&s, jpg, (int)len);
+    s.img_n = 0;
+    z->s = &s;
+    stbi__setup_jpeg(z);
+    for (int i = 0; i < 4; i++) {
+        z->img_comp[i].raw_data = NULL;
+        z->img_comp[i].raw_coeff = NULL;
+    }
+    z->restart_interval = 0;
+
+    int ok = copyJpegMarkers(jpg, len, jpeg) && stbi__decode_jpeg_header(z, STBI__SCAN_load);
+    for (int i = 0; ok && i < s.img_n; i++) {
+        // Only coefficients are needed, not the planes of pixels stb set up
+        STBI_FREE(z->img_comp[i].raw_data);
+        z->img_comp[i].raw_data = NULL;
+        z->img_comp[i].data = NULL;
+        if (!z->progressive) {
+            z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
+            z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
+            z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+            z->img_comp[i].coeff = (short *)(((size_t)z->img_comp[i].raw_coeff + 15) & ~(size_t)15);
+        }
+        ok = z->img_comp[i].raw_coeff != NULL;
+        if (ok) {
+            // Blocks no scan reaches stay zero
+            memset(z->img_comp[i].coeff, 0, (size_t)z->img_comp[i].w2 * z->img_comp[i].h2 * sizeof(short));
+        }
+    }
+    if (ok && parseJpegScans(z)) {
+        jpeg->width = (int)s.img_x;
+        jpeg->height = (int)s.img_y;
+        jpeg->components = s.img_n;
+        jpeg->mcuX = z->img_mcu_x;
+        jpeg->mcuY = z->img_mcu_y;
+        memcpy(jpeg->quant, z->dequant, sizeof(jpeg->quant));
+        for (int i = 0; i < s.img_n; i++) {
+            jpeg->comp[i].id = z->img_comp[i].id;
+            jpeg->comp[i].h = z->img_comp[i].h;
+            jpeg->comp[i].v = z->img_comp[i].v;
+            jpeg->comp[i].tq = z->img_comp[i].tq;
+            jpeg->comp[i].blocksX = (z->img_comp[i].x + 7) >> 3;
+            jpeg->comp[i].blocksY = (z->img_comp[i].y + 7) >> 3;
+            jpeg->comp[i].stride = z->img_comp[i].coeff_w;
+            jpeg->comp[i].coeff = z->img_comp[i].coeff;
+            jpeg->comp[i].raw = z->img_comp[i].raw_coeff;
+            z->img_comp[i].raw_coeff = NULL;
+            z->img_comp[i].coeff = NULL;
+        }
+    } else {
+        freeJpegCoefficients(jpeg);
+        jpeg = NULL;
+    }
+    stbi__cleanup_jpeg(z);
+    STBI_FREE(z);
+    return jpeg;
+}
+
+// Position among the carrier coefficients, in embedding order
+typedef struct {
+    const JpegCoefficients *jpeg;
+    int comp;
+    int block;                // Block of the component, row by row
+    int k;                    // Zigzag position in the block of the last carrier visited
+} JpegCursor;
+
+// Moves the cursor over the next count carriers: their low bits are set from bits when given,
+// read into out when given (which must start zeroed), or only counted. Bits are numbered from
+// the most significant bit of the first byte. Returns how many carriers there were, fewer than
+// count at the end of the coefficients.
+static uint64_t stepJpegCarriers(JpegCursor *cursor, const unsigned char *bits, unsigned char *out, uint64_t count) {
+    const JpegCoefficients *jpeg = cursor->jpeg;
+    uint64_t done = 0;
+    while (done < count && cursor->comp < jpeg->components) {
+        int blocksX = jpeg->comp[cursor->comp].blocksX;
+        if (cursor->block == blocksX * jpeg->comp[cursor->comp].blocksY) {
+            cursor->comp++;
+            cursor->block = 0;
+            continue;
+        }
+        short *block = jpeg->comp[cursor->comp].coeff +
+                       64 * ((size_t)(cursor->block / blocksX) * jpeg->comp[cursor->comp].stride + cursor->block % blocksX);
+        int k = cursor->k + 1;
+        for (; k < 64 && done < count; k++) {
+            short *c = block + stbi__jpeg_dezigzag[k];
+            if (!isJpegCarrier(*c)) {
+                continue;
+            }
+            int shift = 7 - (int)(done & 7);
+            if (bits != NULL) {
+                *c = (short)((*c & ~1) | (bits[done >> 3] >> shift & 1));
+            } else if (out != NULL) {
+                out[done >> 3] |= (unsigned char)((*c & 1) << shift);
+            }
+            done++;
+        }
+        if (k == 64) {
+            cursor->block++;
+            cursor->k = 0;
+        } else {
+            cursor->k = k - 1;
+        }
+    }
+    return done;
+}
+
+// Largest payload in bytes the coefficients can carry after the header: one bit per carrier
+uint64_t jpegPayloadCapacity(const JpegCoefficients *jpeg) {
+    JpegCursor cursor = {jpeg, 0, 0, 0};
+    uint64_t bytes = stepJpegCarriers(&cursor, NULL, NULL, UINT64_MAX) / 8;
+    return bytes > HEADER_BYTES ? bytes - HEADER_BYTES : 0;
+}
+
+// Hides the header and payload in the coefficients. Returns 0, leaving them untouched, if they
+// don't fit.
+int embedJpegPayload(JpegCoefficients *jpeg, const unsigned char *payload, uint64_t length) {
+    JpegCursor cursor = {jpeg, 0, 0, 0};
+    if (length > UINT64_MAX / 8 - HEADER_BYTES ||
+        stepJpegCarriers(&cursor, NULL, NULL, (HEADER_BYTES + length) * 8) < (HEADER_BYTES + length) * 8) {
+        return 0;
+    }
+    StegoHeader header = {1, length};
+    unsigned char headerBytes[HEADER_BYTES];
+    encodeHeader(header, headerBytes);
+    cursor = (JpegCursor){jpeg, 0, 0, 0};
+    stepJpegCarriers(&cursor, headerBytes, NULL, HEADER_BYTES * 8);
+    stepJpegCarriers(&cursor, payload, NULL, length * 8);
+    return 1;
+}
+
+// Returns the payload hidden in the coefficients, followed by a NUL byte not counted in
+// *length, or NULL if they don't hold one. Free it with stbi_image_free.
+unsigned char *extractJpegPayload(const JpegCoefficients *jpeg, uint64_t *length) {
+    JpegCursor cursor = {jpeg, 0, 0, 0};
+    unsigned char headerBytes[HEADER_BYTES] = {0};
+    if (stepJpegCarriers(&cursor, NULL, headerBytes, HEADER_BYTES * 8) < HEADER_BYTES * 8 ||
+        headerBytes[0] != HEADER_MAGIC0 || headerBytes[1] != HEADER_MAGIC1 || headerBytes[2] != (HEADER_VERSION << 4 | 1)) {
+        return NULL;
+    }
+    uint64_t size = 0;
+    for (int i = 0; i < 8; i++) {
+        size = size << 8 | headerBytes[4 + i];
+    }
+    if (size > jpegPayloadCapacity(jpeg) || size >= SIZE_MAX) {
+        return NULL;
+    }
+    unsigned char *payload = STBI_MALLOC((size_t)size + 1);
+    if (payload == NULL) {
+        return NULL;
+    }
+    memset(payload, 0, (size_t)size + 1);
+    stepJpegCarriers(&cursor, NULL, payload, size * 8);
+    *length = size;
+    return payload;
+}
+
+// A Huffman table of the output: the code of each symbol and the DHT contents
+typedef struct {
+    uint16_t codes[256];
+    unsigned char lengths[256];
+    unsigned char counts[17];  // Codes of each length
+    unsigned char values[256]; // Symbols by code
+    int used;
+} JpegHuffman;
+
+// Optimal codes of at most 16 bits for the symbol frequencies. A reserved symbol is given the
+// last and longest code, as libjpeg does, so no real symbol gets the all-ones code JPEG forbids.
+static void buildJpegHuffman(uint32_t *freq, JpegHuffman *table) {
+    unsigned char lengths[JPEG_SYMBOLS];
+    freq[256] = 1;
+    buildCodeLengths(freq, JPEG_SYMBOLS, 16, lengths);
+    int longest = 256;
+    for (int s = 0; s < 256; s++) {
+        if (lengths[s] > lengths[longest]) {
+            longest = s;
+        }
+    }
+    lengths[longest] = lengths[256];
+    memset(table->counts, 0, sizeof(table->counts));
+    table->used = 0;
+    for (int bits = 1, code = 0; bits <= 16; bits++, code <<= 1) {
+        for (int s = 0; s < 256; s++) {
+            if (lengths[s] == bits) {
+                table->codes[s] = (uint16_t)code++;
+                table->lengths[s] = (unsigned char)bits;
+                table->values[table->used++] = (unsigned char)s;
+                table->counts[bits]++;
+            }
+        }
+    }
+}
+
+// Entropy-coded output: bytes with 0xFF stuffed, and bits not yet making up a whole byte
+typedef struct {
+    ImageWriteCallback write;
+    void *user;
+    unsigned char *buffer;
+    size_t fill;
+    uint64_t bits;
+    int count;
+    int failed;
+} JpegOutput;
+
+static void flushJpegOutput(JpegOutput *out) {
+    if (!out->failed && out->fill > 0 && !out->write(out->user, out->buffer, out->fill)) {
+        out->failed = 1;
+    }
+    out->fill = 0;
+}
+
+static void putJpegBytes(JpegOutput *out, const unsigned char *bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (out->fill == JPEG_BUFFER) {
+            flushJpegOutput(out);
+        }
+        out->buffer[out->fill++] = bytes[i];
+    }
+}
+
+FORCE_INLINE void putJpegCode(JpegOutput *out, uint32_t code, int length) {
+    out->bits = out->bits << length | code;
+    out->count += length;
+    while (out->count >= 8) {
+        if (out->fill + 2 > JPEG_BUFFER) {
+            flushJpegOutput(out);
+        }
+        unsigned char byte = (unsigned char)(out->bits >> (out->count -= 8));
+        out->buffer[out->fill++] = byte;
+        if (byte == 0xFF) {
+            out->buffer[out->fill++] = 0;
+        }
+    }
+}
+
+// Number of bits of a value's magnitude, the category JPEG codes it in
+FORCE_INLINE int jpegCategory(int value) {
+    unsigned magnitude = (unsigned)(value < 0 ? -value : value);
+    int bits = 0;
+    for (; magnitude; magnitude >>= 1) {
+        bits++;
+    }
+    return bits;
+}
+
+// Index of the lowest set bit of a non-zero mask
+FORCE_INLINE int lowestBit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#elif defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    int index = 0;
+    for (; !(mask & 1); mask >>= 1) {
+        index++;
+    }
+    return index;
+#endif
+}
+
+// Puts the AC coefficients of a block in zigzag order and returns the mask of the non-zero
+// ones, so runs of zeros are skipped in one step, as libjpeg-turbo does
+FORCE_INLINE uint64_t zigzagJpegBlock(const short *block, int *zigzag) {
+    uint64_t nonZero = 0;
+    for (int k = 1; k < 64; k++) {
+        zigzag[k] = block[stbi__jpeg_dezigzag[k]];
+        nonZero |= (uint64_t)(zigzag[k] != 0) << k;
+    }
+    return nonZero;
+}
+
+// Counts the symbols a block is coded with
+static void countJpegBlock(const short *block, int *pred, uint32_t *dcFreq, uint32_t *acFreq) {
+    int zigzag[64];
+    dcFreq[jpegCategory(block[0] - *pred)]++;
+    *pred = block[0];
+    uint64_t nonZero = zigzagJpegBlock(block, zigzag);
+    int last = 0;
+    for (; nonZero; nonZero &= nonZero - 1) {
+        int k = lowestBit(nonZero);
+        int run = k - last - 1;
+        for (; run > 15; run -= 16) {
+            acFreq[0xF0]++;
+        }
+        acFreq[run << 4 | jpegCategory(zigzag[k])]++;
+        last = k;
+    }
+    if (last < 63) {
+        acFreq[0]++;
+    }
+}
+
+// Codes a block: the DC difference from the previous block of the component, then runs of
+// zeros and the AC coefficients ending them, and an end of block if zeros are left
+static void encodeJpegBlock(JpegOutput *out, const short *block, int *pred, const JpegHuffman *dc,
+                            const JpegHuffman *ac) {
+    int zigzag[64];
+    int diff = block[0] - *pred;
+    *pred = block[0];
+    int size = jpegCategory(diff);
+    putJpegCode(out, dc->codes[size], dc->lengths[size]);
+    putJpegCode(out, (uint32_t)(diff < 0 ? diff - 1 : diff) & ((1u << size) - 1), size);
+    uint64_t nonZero = zigzagJpegBlock(block, zigzag);
+    int last = 0;
+    for (; nonZero; nonZero &= nonZero - 1) {
+        int k = lowestBit(nonZero);
+        int run = k - last - 1;
+        for (; run > 15; run -= 16) {
+            putJpegCode(out, ac->codes[0xF0], ac->lengths[0xF0]);
+        }
+        int c = zigzag[k];
+        size = jpegCategory(c);
+        int symbol = run << 4 | size;
+        putJpegCode(out, ac->codes[symbol], ac->lengths[symbol]);
+        putJpegCode(out, (uint32_t)(c < 0 ? c - 1 : c) & ((1u << size) - 1), size);
+        last = k;
+    }
+    if (last < 63) {
+        putJpegCode(out, ac->codes[0], ac->lengths[0]);
+    }
+}
+
+// Codes every block of the single scan: interleaved by MCU with several components, block by
+// block with one. Luma uses the first pair of tables, chroma the second. With freq set, only
+// counts the symbols.
+static void encodeJpegScan(const JpegCoefficients *jpeg, JpegOutput *out, const JpegHuffman *tables,
+                           uint32_t (*freq)[JPEG_SYMBOLS]) {
+    int pred[4] = {0, 0, 0, 0};
+    int single = jpeg->components == 1;
+    int rows = single ? jpeg->comp[0].blocksY : jpeg->mcuY;
+    int cols = single ? jpeg->comp[0].blocksX : jpeg->mcuX;
+    for (int j = 0; j < rows; j++) {
+        for (int i = 0; i < cols; i++) {
+            for (int n = 0; n < jpeg->components; n++) {
+                int t = n > 0;
+                int h = single ? 1 : jpeg->comp[n].h;
+                int v = single ? 1 : jpeg->comp[n].v;
+                for (int y = 0; y < v; y++) {
+                    for (int x = 0; x < h; x++) {
+                        const short *block = jpeg->comp[n].coeff +
+                                             64 * ((size_t)(j * v + y) * jpeg->comp[n].stride + (i * h + x));
+                        if (freq != NULL) {
+                            countJpegBlock(block, &pred[n], freq[2 * t], freq[2 * t + 1]);
+                        } else {
+                            encodeJpegBlock(out, block, &pred[n], &tables[2 * t], &tables[2 * t + 1]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Writes the coefficients as a baseline JPEG with Huffman tables fitted to them: the copied
+// APPn and COM segments, the quantization tables, the frame, one scan and the end. Returns 0 on
+// a write error or a sampling layout baseline can't interleave.
+int writeJpegCoefficients(const JpegCoefficients *jpeg, ImageWriteCallback write, void *user) {
+    int blocksPerMcu = 0;
+    for (int n = 0; n < jpeg->components; n++) {
+        blocksPerMcu += jpeg->comp[n].h * jpeg->comp[n].v;
+    }
+    if (jpeg->components > 1 && blocksPerMcu > 10) {
+        return 0;
+    }
+    JpegHuffman *tables = STBI_MALLOC(4 * sizeof(JpegHuffman));
+    uint32_t (*freq)[JPEG_SYMBOLS] = STBI_MALLOC(4 * sizeof(*freq));
+    JpegOutput out = {write, user, STBI_MALLOC(JPEG_BUFFER), 0, 0, 0, 0};
+    if (tables == NULL || freq == NULL || out.buffer == NULL) {
+        STBI_FREE(tables);
+        STBI_FREE(freq);
+        STBI_FREE(out.buffer);
+        return 0;
+    }
+    memset(freq, 0, 4 * sizeof(*freq));
+    encodeJpegScan(jpeg, &out, tables, freq);
+    int tableCount = jpeg->components > 1 ? 2 : 1;
+    for (int t = 0; t < 2 * tableCount; t++) {
+        buildJpegHuffman(freq[t], &tables[t]);
+    }
+
+    static const unsigned char soi[2] = {0xFF, 0xD8};
+    putJpegBytes(&out, soi, sizeof(soi));
+    putJpegBytes(&out, jpeg->markers, jpeg->markersSize);
+
+    // Quantization tables, in zigzag order. Values above 255 need 16-bit tables, and with them
+    // the extended sequential frame type.
+    int wide = 0;
+    for (int q = 0; q < 4; q++) {
+        int used = 0;
+        for (int n = 0; n < jpeg->components; n++) {
+            used |= jpeg->comp[n].tq == q;
+        }
+        if (!used) {
+            continue;
+        }
+        int precision = 0;
+        for (int k = 0; k < 64; k++) {
+            precision |= jpeg->quant[q][k] > 255;
+        }
+        wide |= precision;
+        unsigned char segment[5 + 128] = {0xFF, 0xDB, 0, (unsigned char)(3 + 64 * (precision + 1)),
+                                          (unsigned char)(precision << 4 | q)};
+        for (int k = 0; k < 64; k++) {
+            int value = jpeg->quant[q][stbi__jpeg_dezigzag[k]];
+            if (precision) {
+                segment[5 + 2 * k] = (unsigned char)(value >> 8);
+                segment[6 + 2 * k] = (unsigned char)value;
+            } else {
+                segment[5 + k] = (unsigned char)value;
+            }
+        }
+        putJpegBytes(&out, segment, 5 + 64 * (precision + 1));
+    }
+
+    unsigned char frame[10 + 3 * 4] = {0xFF, (unsigned char)(wide ? 0xC1 : 0xC0), 0, (unsigned char)(8 + 3 * jpeg->components), 8,
+                                       (unsigned char)(jpeg->height >> 8), (unsigned char)jpeg->height,
+                                       (unsigned char)(jpeg->width >> 8), (unsigned char)jpeg->width,
+                                       (unsigned char)jpeg->components};
+    for (int n = 0; n < jpeg->components; n++) {
+        frame[10 + 3 * n] = (unsigned char)jpeg->comp[n].id;
+        frame[11 + 3 * n] = (unsigned char)(jpeg->comp[n].h << 4 | jpeg->comp[n].v);
+        frame[12 + 3 * n] = (unsigned char)jpeg->comp[n].tq;
+    }
+    putJpegBytes(&out, frame, 10 + 3 * jpeg->components);
+
+    for (int t = 0; t < 2 * tableCount; t++) {
+        const JpegHuffman *table = &tables[t];
+        int size = 2 + 1 + 16 + table->used;
+        unsigned char header[5] = {0xFF, 0xC4, (unsigned char)(size >> 8), (unsigned char)size,
+                                   (unsigned char)((t & 1) << 4 | t >> 1)};
+        putJpegBytes(&out, header, sizeof(header));
+        putJpegBytes(&out, table->counts + 1, 16);
+        putJpegBytes(&out, table->values, (size_t)table->used);
+    }
+
+    unsigned char scan[6 + 2 * 4 + 3] = {0xFF, 0xDA, 0, (unsigned char)(6 + 2 * jpeg->components),
+                                         (unsigned char)jpeg->components};
+    for (int n = 0; n < jpeg->components; n++) {
+        scan[5 + 2 * n] = (unsigned char)jpeg->comp[n].id;
+        scan[6 + 2 * n] = (unsigned char)(n > 0 ? 0x11 : 0x00);
+    }
+    scan[5 + 2 * jpeg->components] = 0;   // Spectral selection 0-63, no successive approximation
+    scan[6 + 2 * jpeg->components] = 63;
+    scan[7 + 2 * jpeg->components] = 0;
+    putJpegBytes(&out, scan, 8 + 2 * jpeg->components);
+
+    encodeJpegScan(jpeg, &out, tables, NULL);
+    putJpegCode(&out, 0x7F, 7); // Pad the last byte with ones
+    out.count = 0;
+    static const unsigned char eoi[2] = {0xFF, 0xD9};
+    putJpegBytes(&out, eoi, sizeof(eoi));
+    flushJpegOutput(&out);
+
+    STBI_FREE(tables);
+    STBI_FREE(freq);
+    STBI_FREE(out.buffer);
+    return !out.failed;
+}
+
+static void *allocate(const hidenc_allocator *allocator, size_t size) {
+    return allocator ? allocator->alloc(allocator->user, size) : malloc(size);
+}
+
+static void release(const hidenc_allocator *allocator, void *ptr) {
+    if (allocator) {
+        allocator->free(allocator->user, ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+static void *callMalloc(size_t size) {
+    return allocate(callAllocator, size);
+}
+
+static void *callRealloc(void *ptr, size_t oldSize, size_t newSize) {
+    const hidenc_allocator *allocator = callAllocator;
+    return allocator ? allocator->realloc(allocator->user, ptr, oldSize, newSize) : realloc(ptr, newSize);
+}
+
+static void callFree(void *ptr) {
+    release(callAllocator, ptr);
+}
+
+// Checks the options and fills in the defaults. Returns 0 if they are invalid.
+static int readOptions(const hidenc_options *options, hidenc_options *resolved) {
+    hidenc_options defaults = {MIN_CHANNEL_BITS, 0, NULL};
+    *resolved = options ? *options : defaults;
+    if (resolved->depth == 0) {
+        resolved->depth = MIN_CHANNEL_BITS;
+    }
+    return resolved->depth >= MIN_CHANNEL_BITS && resolved->depth <= MAX_CHANNEL_BITS;
+}
+
+// Decodes an image held in memory to RGB, allocating through the call's allocator. The options
+// stb keeps per thread are pinned, since the pixel layout depends on them. With payloadOnly a
+// PNG or baseline JPEG carrying a header is only decoded as far as its payload.
+static int decodeImage(const uint8_t *img, size_t len, int payloadOnly, PixelsData *pixelsData) {
+    pixelsData->data = NULL;
+    if (len > INT_MAX) {
+        return 0;
+    }
+    stbi_set_flip_vertically_on_load_thread(0);
+    stbi_set_unpremultiply_on_load_thread(0);
+    stbi_convert_iphone_png_to_rgb_thread(0);
+    if (payloadOnly && decodePayloadPixels(img, len, pixelsData)) {
+        return 1;
+    }
+    pixelsData->data = decodeRgb(img, len, &pixelsData->width, &pixelsData->height);
+    return pixelsData->data != NULL;
+}
+
+// Converts the rows of a BMP held in memory that hold channels [0, count) to top-down RGB.
+// Returns a new buffer of whole rows and their number, or NULL if out of memory.
+static unsigned char *bmpChannelsToRgb(const uint8_t *bmp, const BmpLayout *layout, uint64_t count,
+                                       const hidenc_allocator *allocator, int *rows) {
+    size_t rowBytes = (size_t)layout->width * 3;
+    uint64_t rowsNeeded = (count + rowBytes - 1) / rowBytes;
+    // Callers check the image holds count channels; never go past its last row regardless
+    *rows = rowsNeeded < (uint64_t)layout->height ? (int)rowsNeeded : layout->height;
+    unsigned char *rgb = allocate(allocator, *rows * rowBytes);
+    if (rgb != NULL) {
+        bmpRowsToRgb(layout, bmp + bmpRowsOffset(layout, 0, *rows), rgb, *rows);
+    }
+    return rgb;
+}
+
+// Writes the header and the payload into decoded pixels that have room for them
+static void embedInPixels(PixelsData pixelsData, const uint8_t *payload, size_t plen, int depth) {
+    StegoHeader header = {depth, plen};
+    writeHeader(pixelsData, header);
+    embedBytes(pixelsData.data + HEADER_CHANNELS, payload, plen, depth);
+}
+
+// Embeds into a copy of a BMP held in memory, converting only the rows the payload takes
+static hidenc_status embedBmp(const uint8_t *img, size_t len, const BmpLayout *layout, const uint8_t *payload,
+                              size_t plen, const hidenc_options *options, hidenc_out *out) {
+    PixelsData shape = {NULL, layout->width, layout->height};
+    if (!payloadFits(shape, plen, options->depth)) {
+        return HIDENC_ERR_TOO_SMALL;
+    }
+    int rows;
+    unsigned char *bmp = allocate(options->allocator, len);
+    unsigned char *rgb = bmp ? bmpChannelsToRgb(img, layout, HEADER_CHANNELS + payloadChannels(plen, options->depth),
+                                                options->allocator, &rows) : NULL;
+    if (rgb == NULL) {
+        release(options->allocator, bmp);
+        return HIDENC_ERR_NO_MEMORY;
+    }
+
+    memcpy(bmp, img, len);
+    PixelsData pixelsData = {rgb, layout->width, rows};
+    embedInPixels(pixelsData, payload, plen, options->depth);
+    rgbToBmpRows(layout, rgb, bmp + bmpRowsOffset(layout, 0, rows), rows);
+    release(options->allocator, rgb);
+    out->data = bmp;
+    out->size = len;
+    return HIDENC_OK;
+}
+
+hidenc_status hidenc_embed(const uint8_t *img, size_t len, const uint8_t *payload, size_t plen, hidenc_out *out) {
+    return hidenc_embed_ex(img, len, payload, plen, NULL, out);
+}
+
+hidenc_status hidenc_embed_ex(const uint8_t *img, size_t len, const uint8_t *payload, size_t plen,
+                              const hidenc_options *options, hidenc_out *out) {
+    hidenc_options resolved;
+    if (out == NULL) {
+        return HIDENC_ERR_ARGUMENT;
+    }
+    out->data = NULL;
+    out->size = 0;
+    out->allocator = options ? options->allocator : NULL;
+    if (img == NULL || (payload == NULL && plen > 0) || !readOptions(options, &resolved)) {
+        return HIDENC_ERR_ARGUMENT;
+    }
+    if (payload == NULL) {
+        payload = (const uint8_t *)"";
+    }
+    initStegoEngine();
+
+    BmpLayout layout;
+    if (parseBmpBytes(img, len, &layout)) {
+        return embedBmp(img, len, &layout, payload, plen, &resolved, out);
+    }
+
+    const hidenc_allocator *outer = callAllocator;
+    callAllocator = resolved.allocator;
+    PixelsData pixelsData;
+    hidenc_status status = HIDENC_OK;
+    if (!decodeImage(img, len, 0, &pixelsData)) {
+        status = HIDENC_ERR_IMAGE;
+    } else {
+        uint64_t size = bmpFileSize(pixelsData.width, pixelsData.height);
+        if (!payloadFits(pixelsData, plen, resolved.depth)) {
+            status = HIDENC_ERR_TOO_SMALL;
+        } else if (size > SIZE_MAX || (out->data = allocate(resolved.allocator, (size_t)size)) == NULL) {
+            status = HIDENC_ERR_NO_MEMORY;
+        } else {
+            embedInPixels(pixelsData, payload, plen, resolved.depth);
+            encodeBmp(pixelsData.width, pixelsData.height, pixelsData.data, resolved.top_down, out->data);
+            out->size = (size_t)size;
+        }
+        stbi_image_free(pixelsData.data);
+    }
+    callAllocator = outer;
+    return status;
+}
+
+// Copies the payload behind a header found in the given channels into a new result
+static hidenc_status extractToOut(const unsigned char *channels, StegoHeader header, const hidenc_allocator *allocator,
+                                  hidenc_out *out) {
+    if (header.length >= SIZE_MAX || (out->data = allocate(allocator, (size_t)header.length + 1)) == NULL) {
+        return HIDENC_ERR_NO_MEMORY;
+    }
+    extractBytes(channels, out->data, header.length, header.depth);
+    out->data[header.length] = '\0';
+    out->size = (size_t)header.length;
+    return HIDENC_OK;
+}
+
+// Reads the payload of a BMP held in memory without decoding it, converting only the rows
+// it takes. Returns HIDENC_ERR_NOT_FOUND if there is no header, so older formats can be tried.
+static hidenc_status extractBmp(const uint8_t *img, const BmpLayout *layout, const hidenc_allocator *allocator,
+                                hidenc_out *out) {
+    int rows;
+    StegoHeader header;
+    if ((uint64_t)layout->width * layout->height * 3 < HEADER_CHANNELS) {
+        return HIDENC_ERR_NOT_FOUND;
+    }
+    unsigned char *rgb = bmpChannelsToRgb(img, layout, HEADER_CHANNELS, allocator, &rows);
+    if (rgb == NULL) {
+        return HIDENC_ERR_NO_MEMORY;
+    }
+    PixelsData headerPixels = {rgb, layout->width, layout->height};
+    int found = readHeader(headerPixels, &header);
+    release(allocator, rgb);
+    if (!found) {
+        return HIDENC_ERR_NOT_FOUND;
+    }
+
+    rgb = bmpChannelsToRgb(img, layout, HEADER_CHANNELS + payloadChannels(header.length, header.depth), allocator, &rows);
+    if (rgb == NULL) {
+        return HIDENC_ERR_NO_MEMORY;
+    }
+    hidenc_status status = extractToOut(rgb + HEADER_CHANNELS, header, allocator, out);
+    release(allocator, rgb);
+    return status;
+}
+
+hidenc_status hidenc_extract(const uint8_t *img, size_t len, hidenc_out *out) {
+    return hidenc_extract_ex(img, len, NULL, out);
+}
+
+hidenc_status hidenc_extract_ex(const uint8_t *img, size_t len, const hidenc_options *options, hidenc_out *out) {
+    hidenc_options resolved;
+    if (out == NULL) {
+        return HIDENC_ERR_ARGUMENT;
+    }
+    out->data = NULL;
+    out->size = 0;
+    out->allocator = options ? options->allocator : NULL;
+    if (img == NULL || !readOptions(options, &resolved)) {
+        return HIDENC_ERR_ARGUMENT;
+    }
+    initStegoEngine();
+
+    BmpLayout layout;
+    if (parseBmpBytes(img, len, &layout)) {
+        hidenc_status status = extractBmp(img, &layout, resolved.allocator, out);
+        if (status != HIDENC_ERR_NOT_FOUND) {
+            return status;
+        }
+        // Older format: decode the whole image below
+    }
+
+    const hidenc_allocator *outer = callAllocator;
+    callAllocator = resolved.allocator;
+    PixelsData pixelsData = {NULL, 0, 0};
+    hidenc_status status = HIDENC_ERR_NOT_FOUND;
+    StegoHeader header;
+    uint64_t length;
+    // A payload hidden in the DCT coefficients of a JPEG needs no pixels
+    JpegCoefficients *jpeg = len > 2 && img[0] == 0xFF && img[1] == 0xD8 ? readJpegCoefficients(img, len) : NULL;
+    out->data = jpeg ? extractJpegPayload(jpeg, &length) : NULL;
+    freeJpegCoefficients(jpeg);
+    if (out->data != NULL) {
+        out->size = (size_t)length;
+        status = HIDENC_OK;
+    } else if (!decodeImage(img, len, 1, &pixelsData)) {
+        status = HIDENC_ERR_IMAGE;
+    } else if (readHeader(pixelsData, &header)) {
+        status = extractToOut(pixelsData.data + HEADER_CHANNELS, header, resolved.allocator, out);
+    } else if (findLegacyPayload(pixelsData, &length)) {
+        status = HIDENC_ERR_NO_MEMORY;
+        if ((out->data = allocate(resolved.allocator, (size_t)length + 1)) != NULL) {
+            extractLegacyBytes(pixelsData, out->data, length);
+            out->data[length] = '\0';
+            out->size = (size_t)length;
+            status = HIDENC_OK;
+        }
+    }
+    stbi_image_free(pixelsData.data);
+    callAllocator = outer;
+    return status;
+}
+
+hidenc_status hidenc_capacity(const uint8_t *img, size_t len, const hidenc_options *options, uint64_t *capacity) {
+    hidenc_options resolved;
+    if (img == NULL || capacity == NULL || !readOptions(options, &resolved)) {
+        return HIDENC_ERR_ARGUMENT;
+    }
+
+    BmpLayout layout;
+    PixelsData shape = {NULL, 0, 0};
+    int ok = 1;
+    if (parseBmpBytes(img, len, &layout)) {
+        shape.width = layout.width;
+        shape.height = layout.height;
+    } else {
+        const hidenc_allocator *outer = callAllocator;
+        callAllocator = resolved.allocator;
+        int n;
+        ok = qoiInfo(img, len, &shape.width, &shape.height, &n) ||
+             (len <= INT_MAX && stbi_info_from_memory(img, (int)len, &shape.width, &shape.height, &n));
+        callAllocator = outer;
+    }
+    if (!ok) {
+        return HIDENC_ERR_IMAGE;
+    }
+    *capacity = payloadCapacity(shape, resolved.depth);
+    return HIDENC_OK;
+}
+
+void hidenc_free(hidenc_out *out) {
+    if (out != NULL) {
+        release(out->allocator, out->data);
+        out->data = NULL;
+        out->size = 0;
+    }
+}
+
+const char *hidenc_strerror(hidenc_status status) {
+    switch (status) {
+        case HIDENC_OK:
+            return "success";
+        case HIDENC_ERR_ARGUMENT:
+            return "invalid argument";
+        case HIDENC_ERR_IMAGE:
+            return "the image can't be decoded";
+        case HIDENC_ERR_TOO_SMALL:
+            return "the image is too small to hold the payload";
+        case HIDENC_ERR_NOT_FOUND:
+            return "no hidden payload found";
+        case HIDENC_ERR_NO_MEMORY:
+            return "out of memory";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,72 @@
+// libhidenc: hides a payload in the pixels of an image and gets it back, on buffers in memory.
+//
+// Build hidenc.c (it carries stb_image) and link it with -lm -lpthread. Every function is
+// reentrant: nothing is printed, state lives in the arguments, and the only process-wide data
+// is the table of SIMD kernels picked for the CPU on first use. Calls may run concurrently on
+// any number of threads.
+#ifndef HIDENC_H
+#define HIDENC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    HIDENC_OK = 0,
+    HIDENC_ERR_ARGUMENT,  // NULL pointer or depth outside 1-4
+    HIDENC_ERR_IMAGE,     // The image bytes can't be decoded
+    HIDENC_ERR_TOO_SMALL, // The payload doesn't fit the image at that depth
+    HIDENC_ERR_NOT_FOUND, // No hidden payload in the image
+    HIDENC_ERR_NO_MEMORY
+} hidenc_status;
+
+// Memory for the results and for decoding. The callbacks get the user pointer back, must be
+// safe to call from every thread the allocator is used on, and free must accept NULL.
+typedef struct {
+    void *(*alloc)(void *user, size_t size);
+    void *(*realloc)(void *user, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} hidenc_allocator;
+
+typedef struct {
+    int depth;                         // Low bits per channel carrying the payload, 1-4 (0 means 1)
+    int top_down;                      // Store the rows of a decoded image's output top to bottom
+    const hidenc_allocator *allocator; // NULL for malloc/realloc/free
+} hidenc_options;
+
+// A result, allocated with the allocator of the call that made it. Release it with hidenc_free.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    const hidenc_allocator *allocator;
+} hidenc_out;
+
+// Hides plen bytes of payload in an image file held in memory (any format stb_image reads)
+// and returns the result as a 24-bit BMP file. A BMP input keeps its layout and only the
+// rows carrying the payload are touched. Uses depth 1 and malloc.
+hidenc_status hidenc_embed(const uint8_t *img, size_t len, const uint8_t *payload, size_t plen, hidenc_out *out);
+hidenc_status hidenc_embed_ex(const uint8_t *img, size_t len, const uint8_t *payload, size_t plen,
+                              const hidenc_options *options, hidenc_out *out);
+
+// Returns the payload hidden in an image file held in memory, followed by a NUL byte that
+// isn't counted in the size, or HIDENC_ERR_NOT_FOUND if it holds none. Images from older
+// versions of the tool are read too; as their format has no signature, they are only taken
+// to hold a message when it decodes to printable text.
+hidenc_status hidenc_extract(const uint8_t *img, size_t len, hidenc_out *out);
+hidenc_status hidenc_extract_ex(const uint8_t *img, size_t len, const hidenc_options *options, hidenc_out *out);
+
+// Largest payload in bytes the image can carry at options->depth, from its header only
+hidenc_status hidenc_capacity(const uint8_t *img, size_t len, const hidenc_options *options, uint64_t *capacity);
+
+void hidenc_free(hidenc_out *out);
+const char *hidenc_strerror(hidenc_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,68 +1,410 @@
-#define STB_IMAGE_IMPLEMENTATION
+#define _GNU_SOURCE // copy_file_range
 #include "stb_image.h"
+#include "stego.h"
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
 
-// BMP headers
-#pragma pack(push, 1)
-typedef struct {
-    uint16_t bfType;      // File type ("BM")
-    uint32_t bfSize;      // File size in bytes
-    uint16_t bfReserved1; // Reserved
-    uint16_t bfReserved2; // Reserved
-    uint32_t bfOffBits;   // Offset to pixel data
-} BMPFileHeader;
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>     // _findfirst, _setmode
+#include <direct.h> // _mkdir
+#include <fcntl.h>  // _O_BINARY
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h> // FICLONE
+#endif
 
+// Payload held in memory (data) or read sequentially from a stream
 typedef struct {
-    uint32_t biSize;          // Header size
-    int32_t biWidth;          // Image width
-    int32_t biHeight;         // Image height
-    uint16_t biPlanes;        // Number of color planes
-    uint16_t biBitCount;      // Bits per pixel (24 for RGB)
-    uint32_t biCompression;   // Compression type (0 for none)
-    uint32_t biSizeImage;     // Image size in bytes
-    int32_t biXPelsPerMeter;  // Horizontal resolution
-    int32_t biYPelsPerMeter;  // Vertical resolution
-    uint32_t biClrUsed;       // Number of colors used
-    uint32_t biClrImportant;  // Important colors
-} BMPInfoHeader;
-#pragma pack(pop)
+    const unsigned char *data;
+    FILE *stream;
+    uint64_t length;
+} PayloadSource;
 
+// Reads a carrier top to bottom in strips of rows. Uncompressed 24-bit BMPs and binary PPMs are
+// read straight from the file, and PNGs and QOIs are decoded as the strips are read; other
+// formats are decoded as a whole into pixels.
 typedef struct {
-    unsigned char *data;
+    FILE *file;
+    BmpLayout bmp;
+    PngStream *png;
+    QoiStream *qoi;
+    int ppm;                 // Rows follow one another in the file, from the current position
     int width;
     int height;
-} PixelsData;
+    int nextRow;
+    unsigned char *fileRows; // One strip of rows as stored in the file
+    unsigned char *pixels;
+    unsigned char *strip;    // Strip the PNG rows being decoded go to
+} StripReader;
+
+// Writes a 24-bit BMP, a PNG, a QOI or a PPM one strip of rows at a time
+typedef struct {
+    FILE *file;
+    BmpLayout bmp;
+    unsigned char *fileRows;
+    PngWriter *png;          // Set when writing a PNG, whose rows must come in order
+    QoiWriter *qoi;          // Likewise for a QOI
+    int ppm;                 // And for a PPM
+} StripWriter;
+
+// Embeds the header and a payload into consecutive strips of an image
+typedef struct {
+    unsigned char headerBytes[HEADER_BYTES];
+    PayloadSource *payload;
+    int depth;
+    uint64_t spanChannels;   // Channels taken by the payload
+    unsigned char *window;   // Payload bytes [windowFirst, windowEnd) needed by the current strip
+    size_t windowSize;
+    uint64_t windowFirst;
+    uint64_t windowEnd;
+} StripEmbedder;
+
+// Default memory budget for the strips of the streaming embed
+#define DEFAULT_STRIP_BUDGET (64u << 20)
+
+// Bytes of rows collected before each write of createImage
+#define WRITE_CHUNK (4u << 20)
+
+// Longest path built by the batch mode
+#define BATCH_PATH 4096
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION BatchLock;
+#define initBatchLock(lock) InitializeCriticalSection(lock)
+#define destroyBatchLock(lock) DeleteCriticalSection(lock)
+#define lockBatch(lock) EnterCriticalSection(lock)
+#define unlockBatch(lock) LeaveCriticalSection(lock)
+typedef CONDITION_VARIABLE BatchSignal;
+#define initBatchSignal(signal) InitializeConditionVariable(signal)
+#define destroyBatchSignal(signal) ((void)(signal))
+#define waitBatchSignal(signal, lock) SleepConditionVariableCS(signal, lock, INFINITE)
+#define wakeBatchWorkers(signal) WakeAllConditionVariable(signal)
+#else
+typedef pthread_mutex_t BatchLock;
+#define initBatchLock(lock) pthread_mutex_init(lock, NULL)
+#define destroyBatchLock(lock) pthread_mutex_destroy(lock)
+#define lockBatch(lock) pthread_mutex_lock(lock)
+#define unlockBatch(lock) pthread_mutex_unlock(lock)
+typedef pthread_cond_t BatchSignal;
+#define initBatchSignal(signal) pthread_cond_init(signal, NULL)
+#define destroyBatchSignal(signal) pthread_cond_destroy(signal)
+#define waitBatchSignal(signal, lock) pthread_cond_wait(signal, lock)
+#define wakeBatchWorkers(signal) pthread_cond_broadcast(signal)
+#endif
+
+// Images with more channels than this are split into row tasks by the batch mode
+#define BATCH_SPLIT_CHANNELS (2 * (uint64_t)WRITE_CHUNK)
+
+// Memory taken by an image that isn't decoded: BMPs patched or read in place
+#define BATCH_BMP_FOOTPRINT (2 * (uint64_t)WRITE_CHUNK)
+
+// Payload bytes per extract task. Whole stream chunks keep each task on a channel group.
+#define BATCH_TASK_BYTES (64 * (uint64_t)STREAM_CHUNK)
+
+// Bytes of rows of a PPM frame held at a time when filtering a stream of frames
+#define PIPE_CHUNK (1u << 20)
+
+// An image of a batch run split into tasks; the last task to end records the result
+typedef struct {
+    const char *input;
+    char output[BATCH_PATH];
+    PixelsData pixelsData;   // Decoded pixels, or none when extracting straight from a BMP
+    BmpLayout layout;        // Output BMP when hiding, source BMP when extracting
+    StegoHeader header;      // Header found when extracting
+    uint64_t size;           // Input bytes, for the throughput
+    uint64_t footprint;      // Memory reserved for the image until its last task ends
+    int pending;             // Tasks not finished yet
+    int failed;
+} BatchImage;
+
+enum {
+    TASK_IMAGE,         // Process one input, or split it
+    TASK_EMBED_ROWS,    // Embed and write rows [first, first + count) of a split image
+    TASK_EXTRACT_BYTES  // Extract payload bytes [first, first + count) of a split image
+};
+
+typedef struct {
+    int kind;
+    int index;          // Input of a TASK_IMAGE
+    BatchImage *image;
+    uint64_t first;
+    uint64_t count;
+} BatchTask;
+
+// Tasks of one worker. The owner pushes and pops at the bottom, other workers steal from the top.
+typedef struct {
+    BatchTask *tasks;
+    int top;
+    int bottom;
+    int capacity;
+    BatchLock lock;
+} TaskDeque;
+
+// State of a batch run shared by the worker threads
+typedef struct {
+    char **inputs;
+    int count;
+    const char *outDir;
+    int extract;           // Extract payloads instead of hiding the message
+    PayloadSource message; // Message hidden in every image, held in memory
+    int depth;
+    int topDown;
+    int pngLevel;          // Compression of PNG outputs (PNG_LEVEL_*), -1 to write BMPs
+    int qoi;               // Write QOI outputs
+    int jpeg;              // Hide in the DCT coefficients of JPEG inputs, which stay JPEGs
+    TaskDeque *deques;     // One per worker
+    int workers;
+    int remaining;         // Tasks queued or running
+    uint64_t pushes;       // Bumped by every push so idle workers notice new tasks
+    int failed;
+    uint64_t bytes;        // Input bytes of the images processed
+    uint64_t memBudget;    // Memory the images in progress may take, 0 for no limit
+    uint64_t reserved;     // Memory taken by the images in progress
+    BatchTask *parked;     // Image tasks waiting for memory
+    int parkedCount;
+    int parkedCapacity;
+    BatchLock lock;
+    BatchSignal wake;
+} BatchQueue;
+
+// Daemon mode protocol. A request is SERVE_REQUEST_BYTES of header: the operation, the depth,
+// flags, a reserved byte, then the image and payload lengths as big-endian 64-bit numbers,
+// followed by the image file bytes and the payload. A reply is a status byte, three reserved
+// bytes and the big-endian 64-bit length of the body that follows: the BMP for an embed, the
+// payload for an extract, nothing on error. With SERVE_FLAG_FDS the image instead comes as a
+// file descriptor passed with the header (image length 0 means its whole size), followed by
+// the descriptor the result is written to; the reply then carries only the result length.
+#define SERVE_REQUEST_BYTES 20
+#define SERVE_REPLY_BYTES 12
+#define SERVE_FLAG_TOP_DOWN 1
+#define SERVE_FLAG_FDS 2 // The image and output are file descriptors sent with the header
+#define SERVE_MAX_FDS 2
+#define SERVE_MAX_BYTES 0x7FFFFFFF // stb takes in-memory images up to INT_MAX bytes
+#define SERVE_BACKLOG 64
+#define SERVE_BUFFER_BYTES (4u << 20)
+
+enum {
+    SERVE_EMBED = 'E',
+    SERVE_EXTRACT = 'X'
+};
+
+enum {
+    SERVE_OK,
+    SERVE_BAD_REQUEST,
+    SERVE_BAD_IMAGE,   // The image bytes can't be decoded
+    SERVE_TOO_SMALL,   // The payload doesn't fit the image at that depth
+    SERVE_NOT_FOUND,   // No hidden message in the image
+    SERVE_NO_MEMORY
+};
+
+// A buffer a server thread keeps across requests, grown as needed
+typedef struct {
+    unsigned char *data;
+    size_t capacity;
+} ServeBuffer;
+
+// Where a request's result goes: a reply buffer, or a client file that is resized and mapped.
+// A client file that isn't sealed against shrinking is built in the buffer and written after.
+typedef struct {
+    ServeBuffer *buffer;
+    int fd;
+    unsigned char *map;
+    size_t mapSize;
+    int copy; // The result for fd is in buffer
+} ServeOutput;
+
+// Accepted connections waiting for a server thread
+typedef struct {
+    int fds[SERVE_BACKLOG];
+    int head;
+    int count;
+    BatchLock lock;
+    BatchSignal ready;
+} ServeQueue;
+
+typedef struct {
+    ServeQueue *queue;
+    ServeBuffer request; // Image and payload of the current request
+    ServeBuffer reply;   // Body of the current reply
+    ServeBuffer image;   // Copy of an image descriptor that could shrink while it is read
+} ServeWorker;
+
+// What a batch thread is started with
+typedef struct {
+    BatchQueue *queue;
+    int id;
+} BatchThreadArgs;
+
+// A carrier of the capacity planner, known from its header only
+typedef struct {
+    const char *path;
+    PixelsData shape;   // Dimensions, no pixels
+    int channels;       // Channels stored in the file
+    int taken;          // Already assigned a payload
+} PlanCarrier;
+
+// A payload file of the capacity planner
+typedef struct {
+    const char *path;
+    uint64_t size;
+} PlanPayload;
 
-char *decToBin(int dec);
-int binToDec(char *bin);
 PixelsData imageLoader();
-void createImage(const char *filename, int width, int height, unsigned char *pixelData);
-unsigned char *insertText(PixelsData pixelsData, char *text);
-char **encodeText(char *text);
+PixelsData loadExtractPixels(const char *filename);
+JpegCoefficients *loadJpegCoefficients(const char *filename);
+int embedPayloadJpeg(JpegCoefficients *jpeg, const char *output, PayloadSource *payload);
+unsigned char *extractPayloadJpeg(const char *filename, uint64_t *length);
+int createImage(const char *filename, int width, int height, unsigned char *pixelData, int topDown);
+int createPng(const char *filename, int width, int height, const unsigned char *pixelData, int level, int threads);
+int createQoi(const char *filename, int width, int height, const unsigned char *pixelData);
+int writePpmHeader(FILE *file, int width, int height);
+int createPpm(const char *filename, int width, int height, const unsigned char *pixelData);
+unsigned char *loadImageFile(const char *filename, int *width, int *height, int *channels);
+int imageFileInfo(const char *filename, int *width, int *height, int *channels);
+int embedPayload(PixelsData pixelsData, const unsigned char *payload, uint64_t length, int depth);
+int embedPayloadStream(PixelsData pixelsData, FILE *stream, uint64_t length, int depth);
+unsigned char *extractPayload(PixelsData pixelsData, uint64_t *length);
+int extractPayloadStream(PixelsData pixelsData, FILE *stream, uint64_t *length);
+unsigned char *extractLegacyPayload(PixelsData pixelsData, uint64_t *length);
 char *dragText(PixelsData pixelsData);
-int dragMessageLength(PixelsData pixelsData);
+int readPayload(PayloadSource *source, uint64_t offset, unsigned char *buffer, size_t count);
+int parseBmpHeaders(FILE *file, BmpLayout *layout);
+int probeBmp(const char *filename, BmpLayout *layout);
+#ifndef _WIN32
+int readFdAt(int fd, uint64_t offset, void *buffer, size_t size);
+int writeFdAt(int fd, uint64_t offset, const void *buffer, size_t size);
+#endif
+int readAt(FILE *file, uint64_t offset, void *buffer, size_t size);
+int writeAt(FILE *file, uint64_t offset, const void *buffer, size_t size);
+int copyFile(const char *src, const char *dst);
+int openStripReader(StripReader *reader, const char *filename);
+int readStrip(StripReader *reader, unsigned char *rgb, int rows);
+void closeStripReader(StripReader *reader);
+int openStripWriter(StripWriter *writer, const char *filename, int width, int height, int topDown, int pngLevel,
+                    int pngThreads);
+int writeStrip(StripWriter *writer, const unsigned char *rgb, int firstRow, int rows);
+int closeStripWriter(StripWriter *writer);
+void initStripEmbedder(StripEmbedder *embedder, PayloadSource *payload, int depth, uint64_t stripChannels);
+int embedStrip(StripEmbedder *embedder, unsigned char *strip, uint64_t stripStart, uint64_t stripCount);
+int rowsForBudget(int width, int height, size_t stripBudget);
+uint64_t stripFootprint(int width, int height, size_t stripBudget);
+int embedPayloadStrips(const char *carrier, const char *output, PayloadSource *payload, int depth, size_t stripBudget,
+                       int topDown, int pngLevel, int pngThreads);
+int embedPayloadBmpInPlace(const char *carrier, const char *output, PayloadSource *payload, int depth);
+int readBmpChannels(FILE *file, const BmpLayout *layout, uint64_t first, uint64_t count, unsigned char *rgb);
+int readBmpHeader(FILE *file, const BmpLayout *layout, StegoHeader *header);
+int extractPayloadBmp(const char *filename, unsigned char **payload, FILE *stream, uint64_t *length);
+int embedPayloadSource(PixelsData pixelsData, PayloadSource *payload, int depth);
+int cpuCount(void);
+double wallSeconds(void);
+uint64_t fileSize(const char *filename);
+int isImageName(const char *name);
+int listImages(const char *dir, char ***paths);
+void batchOutputPath(const char *outDir, const char *input, const char *suffix, char *output, size_t size);
+void pushTask(BatchQueue *queue, int worker, BatchTask task);
+int popTask(TaskDeque *deque, BatchTask *task);
+int stealTask(TaskDeque *deque, BatchTask *task);
+void recordBatchResult(BatchQueue *queue, const char *input, int ok, uint64_t size);
+void pushImageTasks(BatchQueue *queue, int worker, BatchImage *image, int kind, uint64_t total, uint64_t step);
+void finishImageTask(BatchQueue *queue, int worker, BatchImage *image, int ok);
+uint64_t parseSize(const char *text);
+int batchPngThreads(const BatchQueue *queue);
+uint64_t estimateFootprint(const BatchQueue *queue, const char *input);
+int admitImage(BatchQueue *queue, const BatchTask *task, uint64_t footprint);
+void releaseFootprint(BatchQueue *queue, int worker, uint64_t footprint);
+int hideBatchImage(BatchQueue *queue, int worker, const char *input, uint64_t footprint);
+int embedBatchRows(BatchQueue *queue, BatchImage *image, int firstRow, int rows);
+int extractWholeImage(const char *input, const char *output, PixelsData pixelsData);
+int extractBatchImage(BatchQueue *queue, int worker, const char *input, uint64_t footprint);
+int extractBatchBytes(BatchImage *image, uint64_t first, size_t count);
+void runBatchTask(BatchQueue *queue, int worker, BatchTask *task);
+void batchWorker(BatchQueue *queue, int worker);
+int runBatch(int argc, char *argv[]);
+int hidePipeFrames(FILE *in, FILE *out, PayloadSource *message, int depth, int *frames, uint64_t *bytes);
+int extractPipeFrames(FILE *in, FILE *out, int *frames, uint64_t *bytes);
+int runPipe(const char *input, const char *output, PayloadSource *message, int depth, int extract);
+int assignCarrier(PlanCarrier *carriers, int count, uint64_t size, int *depth);
+int runPlan(int argc, char *argv[]);
+void putBigEndian64(unsigned char *bytes, uint64_t value);
+uint64_t getBigEndian64(const unsigned char *bytes);
+int reserveBuffer(ServeBuffer *buffer, uint64_t size);
+int sealedAgainstShrink(int fd);
+unsigned char *reserveServeOutput(ServeOutput *output, uint64_t size);
+void embedPayloadBmpBytes(unsigned char *bmp, const BmpLayout *layout, PayloadSource *payload, int depth);
+unsigned char *bmpBytesToRgb(const unsigned char *bmp, const BmpLayout *layout, uint64_t count);
+int handleServeRequest(const unsigned char *request, unsigned char *image, uint64_t imageLength,
+                       const unsigned char *payload, int inPlace, ServeOutput *output, uint64_t *resultLength);
+#ifndef _WIN32
+int readFull(int fd, void *buffer, size_t size);
+int writeFull(int fd, const void *buffer, size_t size);
+int receiveRequest(int fd, unsigned char *request, int *fds, int *fdCount);
+int handleFdRequest(ServeWorker *worker, const unsigned char *request, const int *fds, int fdCount,
+                    uint64_t *resultLength);
+void serveConnection(ServeWorker *worker, int fd);
+#endif
+int runServer(int argc, char *argv[]);
+int isPngName(const char *filename);
+int isQoiName(const char *filename);
+int isPpmName(const char *filename);
 
 void clearInputBuffer(){
-    while (getchar() != '\n');
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);
 }
 
+// New images are written as BMP, PNG, QOI or PPM, chosen by the extension. JPEG isn't offered:
+// its lossy compression would destroy the hidden bits.
 int isValidFilename(const char *filename) {
     if (strlen(filename) < 5) {
         return 0;
     }
 
-    if (strstr(filename, ".png") == filename + strlen(filename) - 4 ||
-        strstr(filename, ".jpg") == filename + strlen(filename) - 4 ||
-        strstr(filename, ".bmp") == filename + strlen(filename) - 4) {
+    if (isPngName(filename) || isQoiName(filename) || isPpmName(filename) ||
+        strcmp(filename + strlen(filename) - 4, ".bmp") == 0) {
         return 1;
     } else {
-        printf("Error: Filename must end with .png, .jpg, or .bmp.\n");
+        printf("Error: Filename must end with .bmp, .png, .qoi or .ppm (JPEG would lose the hidden message).\n");
         return 0;
     }
 }
 
+int isPngName(const char *filename) {
+    size_t len = strlen(filename);
+    return len >= 4 && strcmp(filename + len - 4, ".png") == 0;
+}
+
+int isQoiName(const char *filename) {
+    size_t len = strlen(filename);
+    return len >= 4 && strcmp(filename + len - 4, ".qoi") == 0;
+}
+
+int isPpmName(const char *filename) {
+    size_t len = strlen(filename);
+    return len >= 4 && strcmp(filename + len - 4, ".ppm") == 0;
+}
+
+int isJpegName(const char *filename) {
+    size_t len = strlen(filename);
+    return (len >= 4 && strcmp(filename + len - 4, ".jpg") == 0) ||
+           (len >= 5 && strcmp(filename + len - 5, ".jpeg") == 0);
+}
+
 void safeFgets(char *buffer, size_t size) {
     if (fgets(buffer, size, stdin) == NULL) {
         printf("Error reading input.\n");
@@ -81,16 +423,86 @@ void safeFgets(char *buffer, size_t size) {
     }
 }
 
+// Asks how many low bits of each channel carry the message. Returns 0 on invalid input.
+int askChannelBits() {
+    char input[10];
+    printf("Enter the number of bits per channel (1-4): ");
+    safeFgets(input, sizeof(input));
+    int depth = atoi(input);
+    if (depth < MIN_CHANNEL_BITS || depth > MAX_CHANNEL_BITS) {
+        printf("Invalid number of bits per channel!\n");
+        return 0;
+    }
+    return depth;
+}
+
+// Asks for the row order of a new BMP. Returns 1 for top-down.
+int askTopDown() {
+    char input[10];
+    printf("Row order of the new image (1: bottom-up, 2: top-down, faster for large images) [1]: ");
+    safeFgets(input, sizeof(input));
+    return atoi(input) == 2;
+}
+
+// Asks for the compression level of a new PNG (PNG_LEVEL_*)
+int askPngLevel() {
+    char input[10];
+    printf("Compression of the new image (0: none, 1: fast, 2: best) [1]: ");
+    safeFgets(input, sizeof(input));
+    int level = input[0] ? atoi(input) : PNG_LEVEL_FAST;
+    return level >= PNG_LEVEL_STORED && level <= PNG_LEVEL_BEST ? level : PNG_LEVEL_FAST;
+}
+
+// Reads a whole line of any length from stdin. Returns NULL on end of input.
+char *readLine() {
+    size_t size = 256, len = 0;
+    char *line = malloc(size);
+    int c;
+    while ((c = getchar()) != EOF && c != '\n') {
+        if (len + 1 == size) {
+            size *= 2;
+            line = realloc(line, size);
+        }
+        line[len++] = (char)c;
+    }
+    if (c == EOF && len == 0) {
+        free(line);
+        return NULL;
+    }
+    line[len] = '\0';
+    return line;
+}
+
 int main (int argc, char *argv[]) {
     char filename[100];
-    char text[170];
     char newFilename[100];
+    char messageFilename[100];
+    char budget[20];
     PixelsData pixelsData;
+    int depth;
+    char *text;
+    FILE *messageFile;
+    uint64_t length;
+    BmpLayout layout;
+    initStegoEngine();
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        return runServer(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--plan") == 0) {
+        return runPlan(argc, argv);
+    }
+    if (argc > 1) {
+        return runBatch(argc, argv);
+    }
     printf("Welcome to Hide-n-C! A simple tool for hiding messages in BMP images.\nYou can either hide a message in an image or extract a hidden message from an image.\n");
     while (1) {
-        int ans;
-        printf("\nChoose an action:\n1: Hide text message in an image\n2: Retrieve text message from an image\n0: Quit\n");
-        if (scanf("%d", &ans) != 1) {
+        int ans = -1;
+        printf("\nChoose an action:\n1: Hide text message in an image\n2: Retrieve text message from an image\n3: Hide a file in an image\n4: Retrieve a hidden file from an image\n5: Hide a file in a large image using little memory\n6: Hide a file in a JPEG, keeping it a JPEG\n0: Quit\n");
+        int scanned = scanf("%d", &ans);
+        if (scanned == EOF) {
+            break;
+        }
+        if (scanned != 1) {
             printf("Invalid input! Please enter a valid command\n");
             clearInputBuffer();
         }
@@ -101,45 +513,231 @@ int main (int argc, char *argv[]) {
         }
         switch(ans) {
             case 1:
+            case 3:
                 printf("Enter the path of the image to hide a message in (length 1-100): ");
                 safeFgets(filename, sizeof(filename));
-                pixelsData = imageLoader(filename);
-                if (pixelsData.data == NULL) {
-                    printf("Something went wrong! Try Again!\n");
-                    break;
+                // Uncompressed 24-bit BMPs are patched in place without decoding them
+                int nativeBmp = probeBmp(filename, &layout);
+                if (nativeBmp) {
+                    pixelsData = (PixelsData){NULL, layout.width, layout.height};
+                    printf("Image loaded: %s\n", filename);
+                    printf("Dimensions: %dx%d\n", layout.width, layout.height);
+                } else {
+                    pixelsData = imageLoader(filename);
+                    if (pixelsData.data == NULL) {
+                        printf("Something went wrong! Try Again!\n");
+                        break;
+                    }
                 }
 
-                printf("Enter the message to hide (length 1-170): ");
-                safeFgets(text, sizeof(text));
-                if (strlen(text) <= 0 || strlen(text) >= 170) {
-                    printf("Invalid message format!\n");
+                depth = askChannelBits();
+                if (depth == 0) {
+                    stbi_image_free(pixelsData.data);
                     break;
                 }
-                printf("%d", strlen(text));
-                pixelsData.data = insertText(pixelsData, text);
+                printf("Capacity: %llu bytes\n", (unsigned long long)payloadCapacity(pixelsData, depth));
+
+                PayloadSource message = {NULL, NULL, 0};
+                text = NULL;
+                messageFile = NULL;
+                if (ans == 1) {
+                    printf("Enter the message to hide: ");
+                    text = readLine();
+                    if (text == NULL || strlen(text) == 0) {
+                        printf("Invalid message format!\n");
+                        free(text);
+                        stbi_image_free(pixelsData.data);
+                        break;
+                    }
+                    message.data = (unsigned char *)text;
+                    message.length = strlen(text);
+                } else {
+                    printf("Enter the path of the file to hide (length 1-100): ");
+                    safeFgets(messageFilename, sizeof(messageFilename));
+                    messageFile = fopen(messageFilename, "rb");
+                    if (!messageFile) {
+                        perror("Error opening file");
+                        stbi_image_free(pixelsData.data);
+                        break;
+                    }
+                    fseek(messageFile, 0, SEEK_END);
+                    message.stream = messageFile;
+                    message.length = (uint64_t)ftell(messageFile);
+                    fseek(messageFile, 0, SEEK_SET);
+                }
 
                 printf("Enter the path of the image to save the new image (length 1-100): ");
                 safeFgets(newFilename, sizeof(newFilename));
                 if (!isValidFilename(newFilename)) {
                     printf("Invalid filename! Please try again.\n");
-                    break;
+                } else if (nativeBmp && isPngName(newFilename)) {
+                    embedPayloadStrips(filename, newFilename, &message, depth, DEFAULT_STRIP_BUDGET, 0, askPngLevel(), cpuCount());
+                } else if (nativeBmp && (isQoiName(newFilename) || isPpmName(newFilename))) {
+                    embedPayloadStrips(filename, newFilename, &message, depth, DEFAULT_STRIP_BUDGET, 0, 0, 1);
+                } else if (nativeBmp) {
+                    embedPayloadBmpInPlace(filename, newFilename, &message, depth);
+                } else if (embedPayloadSource(pixelsData, &message, depth)) {
+                    if (isPngName(newFilename)) {
+                        createPng(newFilename, pixelsData.width, pixelsData.height, pixelsData.data, askPngLevel(), cpuCount());
+                    } else if (isQoiName(newFilename)) {
+                        createQoi(newFilename, pixelsData.width, pixelsData.height, pixelsData.data);
+                    } else if (isPpmName(newFilename)) {
+                        createPpm(newFilename, pixelsData.width, pixelsData.height, pixelsData.data);
+                    } else {
+                        createImage(newFilename, pixelsData.width, pixelsData.height, pixelsData.data, askTopDown());
+                    }
                 }
 
-                createImage(newFilename, pixelsData.width, pixelsData.height, pixelsData.data);
+                free(text);
+                if (messageFile) {
+                    fclose(messageFile);
+                }
+                stbi_image_free(pixelsData.data);
                 break;
 
             case 2:
                 printf("Enter the path of the image to extract the hidden message from: ");
                 safeFgets(filename, sizeof(filename));
-                pixelsData = imageLoader(filename);
+                // Only the pixels holding the message are read from uncompressed 24-bit BMPs
+                if (probeBmp(filename, &layout)) {
+                    unsigned char *payload;
+                    if (extractPayloadBmp(filename, &payload, NULL, &length)) {
+                        printf("\nThe hidden message is: %s\n", (char *)payload);
+                        free(payload);
+                    }
+                    break;
+                }
+                // A message hidden in the DCT coefficients of a JPEG is read without decoding it
+                unsigned char *hidden = extractPayloadJpeg(filename, &length);
+                if (hidden != NULL) {
+                    printf("\nThe hidden message is: %s\n", (char *)hidden);
+                    stbi_image_free(hidden);
+                    break;
+                }
+                pixelsData = loadExtractPixels(filename);
                 if (pixelsData.data == NULL) {
-                    printf("Something went wrong! Try Again!\n");
+                    printf("Failed to load image: %s\nSomething went wrong! Try Again!\n", stbi_failure_reason());
                     break;
                 }
 
-                char *text = dragText(pixelsData);
-                printf("\nThe hidden message is: %s\n", text);
+                text = dragText(pixelsData);
+                if (text != NULL) {
+                    printf("\nThe hidden message is: %s\n", text);
+                }
                 free(text);
+                stbi_image_free(pixelsData.data);
+                break;
+
+            case 4:
+                printf("Enter the path of the image to extract the hidden file from: ");
+                safeFgets(filename, sizeof(filename));
+                int nativeSource = probeBmp(filename, &layout);
+                unsigned char *hiddenFile = nativeSource ? NULL : extractPayloadJpeg(filename, &length);
+                pixelsData = (PixelsData){NULL, 0, 0};
+                if (!nativeSource && hiddenFile == NULL) {
+                    pixelsData = loadExtractPixels(filename);
+                    if (pixelsData.data == NULL) {
+                        printf("Failed to load image: %s\nSomething went wrong! Try Again!\n", stbi_failure_reason());
+                        break;
+                    }
+                }
+
+                printf("Enter the path to save the hidden file to (length 1-100): ");
+                safeFgets(messageFilename, sizeof(messageFilename));
+                messageFile = fopen(messageFilename, "wb");
+                if (!messageFile) {
+                    perror("Error opening file");
+                    stbi_image_free(hiddenFile);
+                    stbi_image_free(pixelsData.data);
+                    break;
+                }
+                int extracted;
+                if (hiddenFile != NULL) {
+                    extracted = fwrite(hiddenFile, 1, (size_t)length, messageFile) == length;
+                    stbi_image_free(hiddenFile);
+                } else {
+                    extracted = nativeSource ? extractPayloadBmp(filename, NULL, messageFile, &length)
+                                             : extractPayloadStream(pixelsData, messageFile, &length);
+                }
+                if (extracted) {
+                    printf("Extracted %llu bytes to %s\n", (unsigned long long)length, messageFilename);
+                }
+                fclose(messageFile);
+                stbi_image_free(pixelsData.data);
+                break;
+
+            case 5:
+                printf("Enter the path of the image to hide a file in (length 1-100): ");
+                safeFgets(filename, sizeof(filename));
+                depth = askChannelBits();
+                if (depth == 0) {
+                    break;
+                }
+
+                printf("Enter the memory budget in MB (empty for %u): ", DEFAULT_STRIP_BUDGET >> 20);
+                safeFgets(budget, sizeof(budget));
+                size_t stripBudget = atoi(budget) > 0 ? (size_t)atoi(budget) << 20 : DEFAULT_STRIP_BUDGET;
+
+                printf("Enter the path of the file to hide (length 1-100): ");
+                safeFgets(messageFilename, sizeof(messageFilename));
+                messageFile = fopen(messageFilename, "rb");
+                if (!messageFile) {
+                    perror("Error opening file");
+                    break;
+                }
+                fseek(messageFile, 0, SEEK_END);
+                PayloadSource source = {NULL, messageFile, (uint64_t)ftell(messageFile)};
+                fseek(messageFile, 0, SEEK_SET);
+
+                printf("Enter the path of the BMP, PNG, QOI or PPM image to save (length 1-100): ");
+                safeFgets(newFilename, sizeof(newFilename));
+                if (!isValidFilename(newFilename)) {
+                    printf("Invalid filename! Please try again.\n");
+                    fclose(messageFile);
+                    break;
+                }
+                if (isPngName(newFilename)) {
+                    embedPayloadStrips(filename, newFilename, &source, depth, stripBudget, 0, askPngLevel(), cpuCount());
+                } else if (isQoiName(newFilename) || isPpmName(newFilename)) {
+                    embedPayloadStrips(filename, newFilename, &source, depth, stripBudget, 0, 0, 1);
+                } else {
+                    embedPayloadStrips(filename, newFilename, &source, depth, stripBudget, askTopDown(), 0, 1);
+                }
+                fclose(messageFile);
+                break;
+
+            case 6:
+                printf("Enter the path of the JPEG to hide a file in (length 1-100): ");
+                safeFgets(filename, sizeof(filename));
+                // The payload replaces the low bits of DCT coefficients, so the image is never decoded
+                JpegCoefficients *jpeg = loadJpegCoefficients(filename);
+                if (jpeg == NULL) {
+                    printf("Not a JPEG stb can read: %s\n", filename);
+                    break;
+                }
+                printf("Capacity: %llu bytes\n", (unsigned long long)jpegPayloadCapacity(jpeg));
+
+                printf("Enter the path of the file to hide (length 1-100): ");
+                safeFgets(messageFilename, sizeof(messageFilename));
+                messageFile = fopen(messageFilename, "rb");
+                if (!messageFile) {
+                    perror("Error opening file");
+                    freeJpegCoefficients(jpeg);
+                    break;
+                }
+                fseek(messageFile, 0, SEEK_END);
+                PayloadSource hiddenSource = {NULL, messageFile, (uint64_t)ftell(messageFile)};
+                fseek(messageFile, 0, SEEK_SET);
+
+                printf("Enter the path of the JPEG to save (length 1-100): ");
+                safeFgets(newFilename, sizeof(newFilename));
+                if (!isJpegName(newFilename)) {
+                    printf("Error: Filename must end with .jpg or .jpeg.\n");
+                } else {
+                    embedPayloadJpeg(jpeg, newFilename, &hiddenSource);
+                }
+                fclose(messageFile);
+                freeJpegCoefficients(jpeg);
                 break;
 
             default:
@@ -149,252 +747,2582 @@ int main (int argc, char *argv[]) {
     }
 }
 
-char *dragText(PixelsData pixelsData) {
-    int messageLength = dragMessageLength(pixelsData);
-    char message[messageLength/3][10];
-    memset(message, '\0', sizeof(message));
-    int index = 0;
-    char *strMessage = malloc((messageLength / 3) + 1);
-    for (int i = 0; i<pixelsData.height; i++) {
-        for (int j = 3; j<pixelsData.width; j++) {
-            int pixelsIndex = (i * pixelsData.width + j) * 3 - 6;
-            int r = (int)pixelsData.data[pixelsIndex]; // Red channel
-            int g = (int)pixelsData.data[pixelsIndex + 1]; // Green channel
-            int b = (int)pixelsData.data[pixelsIndex + 2]; // Blue channel
-            char *rBin = decToBin(r);
-            char *gBin = decToBin(g);
-            char *bBin = decToBin(b);
-            strncpy(message[index], &rBin[6], 3);
-            strncat(message[index], &gBin[6], 3);
-            strncat(message[index], &bBin[6], 3);
-            message[index][9] = '\0';
-            index++;
-            free(rBin);
-            free(gBin);
-            free(bBin);
-
-            if (index==messageLength/3)
-                break;
-        }
-        if (index==messageLength/3)
-            break;
+// Hides length bytes of payload in the image. Returns 0 if it doesn't fit.
+int embedPayload(PixelsData pixelsData, const unsigned char *payload, uint64_t length, int depth) {
+    if (!payloadFits(pixelsData, length, depth)) {
+        printf("Image is too small to hold the message! Capacity at %d bits per channel: %llu bytes\n",
+               depth, (unsigned long long)payloadCapacity(pixelsData, depth));
+        return 0;
     }
 
-    for (int i=0; i<messageLength/3; i++) {
-        int num = binToDec(message[i]);
-        char ch = (char)num;
-        strMessage[i] = ch;
-    }
-    strMessage[messageLength / 3] = '\0';
-    return strMessage;
-}
-
-int dragMessageLength(PixelsData pixelsData) {
-    char headerCodes[10] = "";
-    int r = (int)pixelsData.data[0]; // Red channel
-    int g = (int)pixelsData.data[1]; // Green channel
-    int b = (int)pixelsData.data[2]; // Blue channel
-    char *rBin = decToBin(r);
-    char *gBin = decToBin(g);
-    char *bBin = decToBin(b);
-    strncpy(headerCodes, &rBin[6], 3);
-    strncat(headerCodes, &gBin[6], 3);
-    strncat(headerCodes, &bBin[6], 3);
-    strncat(headerCodes, "\0", 1);
-
-    free(rBin);
-    free(gBin);
-    free(bBin);
-
-    return binToDec(headerCodes);
-}
-
-unsigned char *insertText(PixelsData pixelsData, char *text) {
-    int textLength = strlen(text);
-    char **splittedCodes = encodeText(text);
-    int index = 0;
-    for (int i=0; i<pixelsData.height; i++){
-        for (int j=0; j<pixelsData.width;j++){
-            int r = (int)pixelsData.data[(i * pixelsData.width + j) * 3 + 0]; // Red channel
-            int g = (int)pixelsData.data[(i * pixelsData.width + j) * 3 + 1]; // Green channel
-            int b = (int)pixelsData.data[(i * pixelsData.width + j) * 3 + 2]; // Blue channel
-            char *rBin = decToBin(r);
-            char *gBin = decToBin(g);
-            char *bBin = decToBin(b);
-            rBin[6]=splittedCodes[index][0];
-            rBin[7]=splittedCodes[index][1];
-            rBin[8]=splittedCodes[index][2];
-            index++;
-            gBin[6]=splittedCodes[index][0];
-            gBin[7]=splittedCodes[index][1];
-            gBin[8]=splittedCodes[index][2];
-            index++;
-            bBin[6]=splittedCodes[index][0];
-            bBin[7]=splittedCodes[index][1];
-            bBin[8]=splittedCodes[index][2];
-            index++;
-
-            int newR = binToDec(rBin);
-            int newG = binToDec(gBin);
-            int newB = binToDec(bBin);
-
-            pixelsData.data[(i * pixelsData.width + j) * 3 + 0] = newR;
-            pixelsData.data[(i * pixelsData.width + j) * 3 + 1] = newG;
-            pixelsData.data[(i * pixelsData.width + j) * 3 + 2] = newB;
-
-            free(rBin);
-            free(gBin);
-            free(bBin);
-
-            if (index > (textLength * 3)){
-                for (int x = 0; x < textLength * 3 + 3; x++) {
-                    free(splittedCodes[x]);
-                }
-                free(splittedCodes);
-                return pixelsData.data;
-            }
-        }
+    StegoHeader header = {depth, length};
+    writeHeader(pixelsData, header);
+    embedBytes(pixelsData.data + HEADER_CHANNELS, payload, length, depth);
+    return 1;
+}
+
+// Hides length bytes read from the stream, one chunk at a time. Returns 0 on failure.
+int embedPayloadStream(PixelsData pixelsData, FILE *stream, uint64_t length, int depth) {
+    if (!payloadFits(pixelsData, length, depth)) {
+        printf("Image is too small to hold the message! Capacity at %d bits per channel: %llu bytes\n",
+               depth, (unsigned long long)payloadCapacity(pixelsData, depth));
+        return 0;
     }
 
-    for (int i = 0; i < textLength * 3 + 3; i++) {
-        free(splittedCodes[i]);
+    unsigned char *chunk = malloc(STREAM_CHUNK);
+    unsigned char *channels = pixelsData.data + HEADER_CHANNELS;
+    uint64_t remaining = length;
+    while (remaining > 0) {
+        size_t size = remaining < STREAM_CHUNK ? (size_t)remaining : STREAM_CHUNK;
+        if (fread(chunk, 1, size, stream) != size) {
+            printf("Error reading the message!\n");
+            free(chunk);
+            return 0;
+        }
+        // Whole chunks end on a channel boundary, only the last one can be partial
+        uint64_t count = payloadChannels(size, depth);
+        embedBytes(channels, chunk, size, depth);
+        channels += count;
+        remaining -= size;
     }
-    free(splittedCodes);
+    free(chunk);
+
+    StegoHeader header = {depth, length};
+    writeHeader(pixelsData, header);
+    return 1;
+}
 
-    return pixelsData.data;
+int embedPayloadSource(PixelsData pixelsData, PayloadSource *payload, int depth) {
+    if (payload->data != NULL) {
+        return embedPayload(pixelsData, payload->data, payload->length, depth);
+    }
+    return embedPayloadStream(pixelsData, payload->stream, payload->length, depth);
 }
 
-char **encodeText(char *text) {
-    int textLength = strlen(text);
-    char **splittedCodes = malloc((textLength * 3 + 3) * sizeof(char *));
+// Returns the hidden payload (NUL-terminated for convenience) and its length, or NULL
+unsigned char *extractPayload(PixelsData pixelsData, uint64_t *length) {
+    StegoHeader header;
+    if (!readHeader(pixelsData, &header)) {
+        return extractLegacyPayload(pixelsData, length);
+    }
+
+    unsigned char *payload = malloc(header.length + 1);
+    if (payload == NULL) {
+        printf("Not enough memory for the hidden message!\n");
+        return NULL;
+    }
+    extractBytes(pixelsData.data + HEADER_CHANNELS, payload, header.length, header.depth);
+    payload[header.length] = '\0';
+    *length = header.length;
+    return payload;
+}
 
-    //Encoding Header of the text
-    char *codesLength = decToBin(textLength*3); //Length of text's codes encoded to binary
-    for (int i=0; i < 3; i++) {
-        splittedCodes[i] = malloc(4);
-        strncpy(splittedCodes[i], &codesLength[i * 3], 3);  // Copy 3 characters starting from i * 3
-        splittedCodes[i][3] = '\0';
+// Writes the hidden payload to the stream, one chunk at a time. Returns 0 on failure.
+int extractPayloadStream(PixelsData pixelsData, FILE *stream, uint64_t *length) {
+    StegoHeader header;
+    if (!readHeader(pixelsData, &header)) {
+        unsigned char *payload = extractLegacyPayload(pixelsData, length);
+        int ok = payload != NULL && fwrite(payload, 1, *length, stream) == *length;
+        free(payload);
+        return ok;
     }
-    free(codesLength);
 
-    //Encoding data of the text
-    for (int i=0; i < textLength; i++){
-        int code = (int)text[i];
-        char *binChar = decToBin(code);
-        for (int j = 0; j < 3; j++) {
-            splittedCodes[3 + i * 3 + j] = malloc(4);
-            strncpy(splittedCodes[3 + i*3 + j], binChar + j * 3, 3);
-            splittedCodes[3 + i*3 + j][3] = '\0';
+    unsigned char *chunk = malloc(STREAM_CHUNK);
+    const unsigned char *channels = pixelsData.data + HEADER_CHANNELS;
+    uint64_t remaining = header.length;
+    while (remaining > 0) {
+        size_t size = remaining < STREAM_CHUNK ? (size_t)remaining : STREAM_CHUNK;
+        uint64_t count = payloadChannels(size, header.depth);
+        extractBytes(channels, chunk, size, header.depth);
+        if (fwrite(chunk, 1, size, stream) != size) {
+            printf("Error writing the message!\n");
+            free(chunk);
+            return 0;
         }
-        free(binChar);
+        channels += count;
+        remaining -= size;
+    }
+    free(chunk);
+    *length = header.length;
+    return 1;
+}
+
+// Returns the payload of an image from an older version (NUL-terminated), or NULL
+unsigned char *extractLegacyPayload(PixelsData pixelsData, uint64_t *length) {
+    if (!findLegacyPayload(pixelsData, length)) {
+        printf("No hidden message found!\n");
+        return NULL;
+    }
+    unsigned char *payload = malloc(*length + 1);
+    if (payload == NULL) {
+        printf("Not enough memory for the hidden message!\n");
+        return NULL;
+    }
+    extractLegacyBytes(pixelsData, payload, *length);
+    payload[*length] = '\0';
+    return payload;
+}
+
+char *dragText(PixelsData pixelsData) {
+    uint64_t length;
+    return (char *)extractPayload(pixelsData, &length);
+}
+
+// Copies count payload bytes starting at offset, from memory or from the stream
+int readPayload(PayloadSource *source, uint64_t offset, unsigned char *buffer, size_t count) {
+    if (source->data != NULL) {
+        memcpy(buffer, source->data + offset, count);
+        return 1;
     }
-    return splittedCodes;
+    return fread(buffer, 1, count, source->stream) == count;
 }
 
-void createImage(const char *filename, int width, int height, unsigned char *pixelData) {
+// Returns 1 if the file starts with the headers of an uncompressed 24-bit BMP
+int parseBmpHeaders(FILE *file, BmpLayout *layout) {
     BMPFileHeader fileHeader;
     BMPInfoHeader infoHeader;
+    return fread(&fileHeader, sizeof(fileHeader), 1, file) == 1 &&
+           fread(&infoHeader, sizeof(infoHeader), 1, file) == 1 &&
+           bmpLayoutFromHeaders(&fileHeader, &infoHeader, layout);
+}
 
-    int rowSize = (3 * width + 3) & ~3;
-    int pixelArraySize = rowSize * height;
-    int fileSize = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + pixelArraySize;
+int probeBmp(const char *filename, BmpLayout *layout) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return 0;
+    }
+    int ok = parseBmpHeaders(file, layout);
+    fclose(file);
+    return ok;
+}
 
-    // Populate file header
-    fileHeader.bfType = 0x4D42; // 'BM'
-    fileHeader.bfSize = fileSize;
-    fileHeader.bfReserved1 = 0;
-    fileHeader.bfReserved2 = 0;
-    fileHeader.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+#ifndef _WIN32
+int readFdAt(int fd, uint64_t offset, void *buffer, size_t size) {
+    unsigned char *p = buffer;
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, (off_t)offset);
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        offset += n;
+        size -= n;
+    }
+    return 1;
+}
 
-    // Populate info header
-    infoHeader.biSize = sizeof(BMPInfoHeader);
-    infoHeader.biWidth = width;
-    infoHeader.biHeight = height;
-    infoHeader.biPlanes = 1;
-    infoHeader.biBitCount = 24; // RGB
-    infoHeader.biCompression = 0;
-    infoHeader.biSizeImage = pixelArraySize;
-    infoHeader.biXPelsPerMeter = 2835; // ~72 DPI
-    infoHeader.biYPelsPerMeter = 2835; // ~72 DPI
-    infoHeader.biClrUsed = 0;
-    infoHeader.biClrImportant = 0;
+int writeFdAt(int fd, uint64_t offset, const void *buffer, size_t size) {
+    const unsigned char *p = buffer;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, (off_t)offset);
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        offset += n;
+        size -= n;
+    }
+    return 1;
+}
+#endif
 
-    // Write to file
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
+// Positioned reads and writes. pread/pwrite where available, so no file position is involved.
+int readAt(FILE *file, uint64_t offset, void *buffer, size_t size) {
+#ifdef _WIN32
+    return _fseeki64(file, (long long)offset, SEEK_SET) == 0 && fread(buffer, 1, size, file) == size;
+#else
+    return readFdAt(fileno(file), offset, buffer, size);
+#endif
+}
+
+int writeAt(FILE *file, uint64_t offset, const void *buffer, size_t size) {
+#ifdef _WIN32
+    return _fseeki64(file, (long long)offset, SEEK_SET) == 0 && fwrite(buffer, 1, size, file) == size;
+#else
+    return writeFdAt(fileno(file), offset, buffer, size);
+#endif
+}
+
+// Copies src to dst. On Linux the copy shares the data blocks (FICLONE reflink) where the
+// filesystem supports it, then tries an in-kernel copy, then falls back to read/write.
+int copyFile(const char *src, const char *dst) {
+    int ok = 0;
+#ifdef __linux__
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
         perror("Error opening file");
-        return;
+        return 0;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("Error opening file");
+        close(in);
+        return 0;
+    }
+    struct stat st;
+    if (ioctl(out, FICLONE, in) == 0) {
+        ok = 1;
+    } else if (fstat(in, &st) == 0) {
+        off_t left = st.st_size;
+        ssize_t n = 0;
+        while (left > 0 && (n = copy_file_range(in, NULL, out, NULL, (size_t)left, 0)) > 0) {
+            left -= n;
+        }
+        if (left > 0 && n < 0 && lseek(in, 0, SEEK_SET) == 0 && lseek(out, 0, SEEK_SET) == 0) {
+            // Not supported between these files: plain copy
+            unsigned char buffer[1 << 16];
+            left = st.st_size;
+            while (left > 0 && (n = read(in, buffer, sizeof(buffer))) > 0 && write(out, buffer, n) == n) {
+                left -= n;
+            }
+        }
+        ok = left == 0;
+    }
+    close(in);
+    if (close(out) != 0) {
+        ok = 0;
+    }
+#else
+    FILE *in = fopen(src, "rb");
+    FILE *out = in ? fopen(dst, "wb") : NULL;
+    if (in && out) {
+        unsigned char buffer[1 << 16];
+        size_t n;
+        ok = 1;
+        while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+            ok = fwrite(buffer, 1, n, out) == n;
+        }
+    } else {
+        perror("Error opening file");
+    }
+    if (in) {
+        fclose(in);
     }
+    if (out && fclose(out) != 0) {
+        ok = 0;
+    }
+#endif
+    return ok;
+}
 
-    fwrite(&fileHeader, sizeof(BMPFileHeader), 1, file);
-    fwrite(&infoHeader, sizeof(BMPInfoHeader), 1, file);
+int openStripReader(StripReader *reader, const char *filename) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(filename, "rb");
+    if (!reader->file) {
+        perror("Error opening file");
+        return 0;
+    }
 
-    // Write pixel data (with padding)
-    uint8_t padding[3] = {0, 0, 0};
-    for (int i = height - 1; i >= 0; i--) {
-        for (int j = 0; j < width; j++) {
-            unsigned char r = pixelData[(i * width + j) * 3 + 2]; // Red channel
-            unsigned char g = pixelData[(i * width + j) * 3 + 1]; // Green channel
-            unsigned char b = pixelData[(i * width + j) * 3 + 0]; // Blue channel
+    // Uncompressed 24-bit BMP: rows are read straight from the file
+    if (parseBmpHeaders(reader->file, &reader->bmp)) {
+        reader->width = reader->bmp.width;
+        reader->height = reader->bmp.height;
+        return 1;
+    }
 
-            fwrite(&r, 1, 1, file);
-            fwrite(&g, 1, 1, file);
-            fwrite(&b, 1, 1, file);
-        }
+    // A PNG is decoded row by row, keeping only a few rows and the deflate window in memory
+    rewind(reader->file);
+    reader->png = openPngStream(reader->file, &reader->width, &reader->height);
+    if (reader->png != NULL) {
+        return 1;
+    }
+    int n;
+    rewind(reader->file);
+    reader->qoi = openQoiStream(reader->file, &reader->width, &reader->height, &n);
+    if (reader->qoi != NULL) {
+        return 1;
+    }
+    rewind(reader->file);
+    if (readPpmHeader(reader->file, &reader->width, &reader->height) == 1) {
+        reader->ppm = 1;
+        return 1;
+    }
 
-        // Write padding
-        fwrite(padding, 1, rowSize - (width * 3), file);
+    // Any other format is decoded as a whole
+    fclose(reader->file);
+    reader->file = NULL;
+    reader->pixels = stbi_load(filename, &reader->width, &reader->height, &n, 3);
+    if (reader->pixels == NULL) {
+        printf("Failed to load image\n");
+        return 0;
     }
+    return 1;
+}
 
-    fclose(file);
-    printf("Image file created: %s\n", filename);
+// Copies a row decoded by the PNG stream to its place in the strip
+static int copyStripRow(void *user, const unsigned char *rgb, int row) {
+    StripReader *reader = user;
+    size_t rowBytes = (size_t)reader->width * 3;
+    memcpy(reader->strip + (size_t)(row - reader->nextRow) * rowBytes, rgb, rowBytes);
+    return 1;
 }
 
-PixelsData imageLoader(const char *filename) {
-    PixelsData data = {NULL, 0, 0};;
-    int x, y, n;
-    data.data = stbi_load(filename, &x, &y, &n, 0);
-    data.width = x;
-    data.height = y;
+// Reads the next rows of the image, top to bottom, as RGB
+int readStrip(StripReader *reader, unsigned char *rgb, int rows) {
+    size_t rowBytes = (size_t)reader->width * 3;
+    if (reader->png != NULL) {
+        reader->strip = rgb;
+        if (!decodePngStream(reader->png, rows, copyStripRow, reader)) {
+            printf("Error decoding image rows!\n");
+            return 0;
+        }
+        reader->nextRow += rows;
+        return 1;
+    }
+    if (reader->qoi != NULL) {
+        if (!readQoiRows(reader->qoi, rgb, rows)) {
+            printf("Error decoding image rows!\n");
+            return 0;
+        }
+        reader->nextRow += rows;
+        return 1;
+    }
+    if (reader->ppm) {
+        if (fread(rgb, rowBytes, rows, reader->file) != (size_t)rows) {
+            printf("Error reading image rows!\n");
+            return 0;
+        }
+        reader->nextRow += rows;
+        return 1;
+    }
+    if (reader->pixels != NULL) {
+        memcpy(rgb, reader->pixels + (size_t)reader->nextRow * rowBytes, rows * rowBytes);
+        reader->nextRow += rows;
+        return 1;
+    }
 
-    if (data.data == NULL || n != 3) {
-        printf("Failed to load image\n");
-        data.data = NULL;
-        return data;
+    // The strip is one contiguous block of rows in the file
+    if (reader->fileRows == NULL) {
+        reader->fileRows = malloc(rows * reader->bmp.rowSize);
+    }
+    if (!readAt(reader->file, bmpRowsOffset(&reader->bmp, reader->nextRow, rows), reader->fileRows, rows * reader->bmp.rowSize)) {
+        printf("Error reading image rows!\n");
+        return 0;
     }
+    bmpRowsToRgb(&reader->bmp, reader->fileRows, rgb, rows);
+    reader->nextRow += rows;
+    return 1;
+}
 
-    printf("Image loaded: %s\n", filename);
-    printf("Dimensions: %dx%d\n", x, y);
-    printf("Channels: %d\n", n);
+void closeStripReader(StripReader *reader) {
+    closePngStream(reader->png);
+    closeQoiStream(reader->qoi);
+    if (reader->file) {
+        fclose(reader->file);
+    }
+    free(reader->fileRows);
+    stbi_image_free(reader->pixels);
+}
 
-    return data;
+static int writeFileBytes(void *file, const unsigned char *bytes, size_t size) {
+    return fwrite(bytes, 1, size, file) == size;
 }
 
-char *decToBin(int dec) {
-    char *answer = malloc(10 * sizeof(char));
-    int binaryBase = 256;
-    int index=0;
-    for (int i=0; i < 9; i++){
-        if (dec >= binaryBase) {
-            dec -= binaryBase;
-            answer[index]='1';
+// Creates the output of a strip by strip embed: a PNG at pngLevel, deflated by pngThreads
+// threads, if the name ends in .png, a QOI if it ends in .qoi, a PPM if it ends in .ppm, else a
+// BMP with the given row order
+int openStripWriter(StripWriter *writer, const char *filename, int width, int height, int topDown, int pngLevel,
+                    int pngThreads) {
+    memset(writer, 0, sizeof(*writer));
+    writer->bmp.width = width;
+    writer->bmp.height = height;
+    writer->bmp.bottomUp = !topDown;
+    writer->bmp.dataOffset = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+    writer->bmp.rowSize = ((size_t)width * 3 + 3) & ~(size_t)3;
+    writer->file = fopen(filename, "wb");
+    if (!writer->file) {
+        perror("Error opening file");
+        return 0;
+    }
+    if (isPngName(filename)) {
+        writer->png = openPngWriter(width, height, pngLevel, pngThreads, writeFileBytes, writer->file);
+        if (writer->png == NULL) {
+            printf("Error writing image!\n");
+            fclose(writer->file);
+            return 0;
+        }
+        return 1;
+    }
+    if (isQoiName(filename)) {
+        writer->qoi = openQoiWriter(width, height, writeFileBytes, writer->file);
+        if (writer->qoi == NULL) {
+            printf("Error writing image!\n");
+            fclose(writer->file);
+            return 0;
         }
-        else {
-            answer[index]='0';
+        return 1;
+    }
+    if (isPpmName(filename)) {
+        writer->ppm = 1;
+        if (!writePpmHeader(writer->file, width, height)) {
+            printf("Error writing image!\n");
+            fclose(writer->file);
+            return 0;
         }
-        binaryBase = binaryBase / 2;
-        index++;
+        return 1;
     }
-    answer[9]='\0';
-    return answer;
+
+    BMPFileHeader fileHeader = {0x4D42, 0, 0, 0, writer->bmp.dataOffset};
+    BMPInfoHeader infoHeader = {sizeof(BMPInfoHeader), width, topDown ? -height : height, 1, 24, 0, 0, 2835, 2835, 0, 0};
+    uint64_t pixelArraySize = (uint64_t)writer->bmp.rowSize * height;
+    fileHeader.bfSize = (uint32_t)(fileHeader.bfOffBits + pixelArraySize);
+    infoHeader.biSizeImage = (uint32_t)pixelArraySize;
+    fwrite(&fileHeader, sizeof(BMPFileHeader), 1, writer->file);
+    fwrite(&infoHeader, sizeof(BMPInfoHeader), 1, writer->file);
+    fflush(writer->file);
+    return 1;
 }
 
-int binToDec(char *bin) {
-    int answer = 0;
-    for (int i=0; i<9; i++) {
-        int num = bin[i] - '0';
-        int power = (int)pow(2, 9-i-1);
-        answer += num * power;
+// Writes rows starting at firstRow (top-down RGB) to their place in the BMP. A PNG, QOI or PPM
+// takes the rows in order, so firstRow must follow the rows written before.
+int writeStrip(StripWriter *writer, const unsigned char *rgb, int firstRow, int rows) {
+    if (writer->ppm) {
+        if (fwrite(rgb, (size_t)writer->bmp.width * 3, rows, writer->file) != (size_t)rows) {
+            printf("Error writing image rows!\n");
+            return 0;
+        }
+        return 1;
     }
-    return answer;
-}
\ No newline at end of file
+    if (writer->png != NULL || writer->qoi != NULL) {
+        if (writer->png != NULL ? !writePngRows(writer->png, rgb, rows) : !writeQoiRows(writer->qoi, rgb, rows)) {
+            printf("Error writing image rows!\n");
+            return 0;
+        }
+        return 1;
+    }
+    if (writer->fileRows == NULL) {
+        writer->fileRows = calloc(rows, writer->bmp.rowSize);
+    }
+    rgbToBmpRows(&writer->bmp, rgb, writer->fileRows, rows);
+    if (!writeAt(writer->file, bmpRowsOffset(&writer->bmp, firstRow, rows), writer->fileRows, rows * writer->bmp.rowSize)) {
+        printf("Error writing image rows!\n");
+        return 0;
+    }
+    return 1;
+}
+
+int closeStripWriter(StripWriter *writer) {
+    int ok = (writer->png == NULL || closePngWriter(writer->png)) && (writer->qoi == NULL || closeQoiWriter(writer->qoi));
+    free(writer->fileRows);
+    return fclose(writer->file) == 0 && ok;
+}
+
+void initStripEmbedder(StripEmbedder *embedder, PayloadSource *payload, int depth, uint64_t stripChannels) {
+    StegoHeader header = {depth, payload->length};
+    encodeHeader(header, embedder->headerBytes);
+    embedder->payload = payload;
+    embedder->depth = depth;
+    embedder->spanChannels = payloadChannels(payload->length, depth);
+    embedder->windowSize = stripChannels * depth / 8 + 2;
+    embedder->window = calloc(embedder->windowSize, 1);
+    embedder->windowFirst = 0;
+    embedder->windowEnd = 0;
+}
+
+// Embeds the header and payload bits that fall inside the strip. Strips must come in order;
+// with an in-memory payload a strip may also skip ahead, e.g. to embed one strip on its own.
+int embedStrip(StripEmbedder *embedder, unsigned char *strip, uint64_t stripStart, uint64_t stripCount) {
+    embedSpanInStrip(strip, stripStart, stripCount, 0, HEADER_CHANNELS, embedder->headerBytes, 0, HEADER_CHANNEL_BITS);
+    if (stripStart + stripCount <= HEADER_CHANNELS) {
+        return 1;
+    }
+
+    int depth = embedder->depth;
+    uint64_t lo = stripStart > HEADER_CHANNELS ? stripStart - HEADER_CHANNELS : 0;
+    uint64_t hi = stripStart + stripCount - HEADER_CHANNELS;
+    if (lo >= embedder->spanChannels) {
+        return 1;
+    }
+    hi = hi < embedder->spanChannels ? hi : embedder->spanChannels;
+
+    // Payload bytes needed by the strip. The byte shared with the previous strip is kept,
+    // the rest is read; everything past the end of the payload stays zero.
+    uint64_t needFirst = lo * depth / 8;
+    uint64_t needEnd = (hi * depth + 7) / 8;
+    if (needFirst > embedder->windowEnd) {
+        embedder->windowFirst = embedder->windowEnd = needFirst;
+    }
+    size_t kept = (size_t)(embedder->windowEnd - needFirst);
+    memmove(embedder->window, embedder->window + (needFirst - embedder->windowFirst), kept);
+    memset(embedder->window + kept, 0, embedder->windowSize - kept);
+    uint64_t readEnd = needEnd < embedder->payload->length ? needEnd : embedder->payload->length;
+    if (readEnd > embedder->windowEnd &&
+        !readPayload(embedder->payload, embedder->windowEnd, embedder->window + kept, (size_t)(readEnd - embedder->windowEnd))) {
+        printf("Error reading the message!\n");
+        return 0;
+    }
+    embedder->windowFirst = needFirst;
+    if (readEnd > embedder->windowEnd) {
+        embedder->windowEnd = readEnd;
+    }
+
+    embedSpanInStrip(strip, stripStart, stripCount, HEADER_CHANNELS, embedder->spanChannels,
+                     embedder->window, embedder->windowFirst, depth);
+    return 1;
+}
+
+// Rows per strip so that a strip and its file-order copies fit the budget
+int rowsForBudget(int width, int height, size_t stripBudget) {
+    size_t rowCost = (size_t)width * 3 * 3 + 8;
+    size_t rows = stripBudget / rowCost;
+    if (rows < 1) {
+        rows = 1;
+    }
+    return rows < (size_t)height ? (int)rows : height;
+}
+
+// Memory of the strips of a strip by strip embed, at most about stripBudget
+uint64_t stripFootprint(int width, int height, size_t stripBudget) {
+    return (uint64_t)rowsForBudget(width, height, stripBudget) * ((uint64_t)width * 3 * 3 + 8);
+}
+
+// Hides the payload while copying the carrier to a BMP or PNG (see openStripWriter) strip by
+// strip, so at most about stripBudget bytes of pixels are in memory at once. A top-down BMP or
+// a PNG is written front to back. Returns 0 on failure.
+int embedPayloadStrips(const char *carrier, const char *output, PayloadSource *payload, int depth, size_t stripBudget,
+                       int topDown, int pngLevel, int pngThreads) {
+    StripReader reader;
+    StripWriter writer;
+    if (!openStripReader(&reader, carrier)) {
+        return 0;
+    }
+
+    PixelsData shape = {NULL, reader.width, reader.height};
+    if (!payloadFits(shape, payload->length, depth)) {
+        printf("Image is too small to hold the message! Capacity at %d bits per channel: %llu bytes\n",
+               depth, (unsigned long long)payloadCapacity(shape, depth));
+        closeStripReader(&reader);
+        return 0;
+    }
+    if (!openStripWriter(&writer, output, reader.width, reader.height, topDown, pngLevel, pngThreads)) {
+        closeStripReader(&reader);
+        return 0;
+    }
+
+    int stripRows = rowsForBudget(reader.width, reader.height, stripBudget);
+    uint64_t stripChannels = (uint64_t)stripRows * reader.width * 3;
+    StripEmbedder embedder;
+    initStripEmbedder(&embedder, payload, depth, stripChannels);
+
+    unsigned char *strip = malloc(stripChannels);
+    int ok = 1;
+    for (int row = 0; ok && row < reader.height; row += stripRows) {
+        int rows = reader.height - row < stripRows ? reader.height - row : stripRows;
+        uint64_t stripStart = (uint64_t)row * reader.width * 3;
+        ok = readStrip(&reader, strip, rows) &&
+             embedStrip(&embedder, strip, stripStart, (uint64_t)rows * reader.width * 3) &&
+             writeStrip(&writer, strip, row, rows);
+    }
+
+    free(strip);
+    free(embedder.window);
+    closeStripReader(&reader);
+    if (!closeStripWriter(&writer)) {
+        ok = 0;
+    }
+    if (ok) {
+        printf("Image file created: %s\n", output);
+    }
+    return ok;
+}
+
+// Reads channels [first, first + count) of a BMP as top-down RGB, touching only the pixels
+// that hold them. rgb needs room for count + 4 bytes.
+int readBmpChannels(FILE *file, const BmpLayout *layout, uint64_t first, uint64_t count, unsigned char *rgb) {
+    uint64_t firstPixel = first / 3;
+    uint64_t endPixel = (first + count + 2) / 3;
+    unsigned char *out = rgb;
+    unsigned char buffer[3 * 1024];
+
+    // Pixels are contiguous within a row; each row is fetched in pieces that fit the buffer
+    for (uint64_t pixel = firstPixel; pixel < endPixel;) {
+        int row = (int)(pixel / layout->width);
+        uint64_t rowEnd = (uint64_t)(row + 1) * layout->width;
+        uint64_t end = endPixel < rowEnd ? endPixel : rowEnd;
+        if (end - pixel > sizeof(buffer) / 3) {
+            end = pixel + sizeof(buffer) / 3;
+        }
+        size_t pixels = (size_t)(end - pixel);
+        uint64_t offset = bmpRowsOffset(layout, row, 1) + (pixel - (uint64_t)row * layout->width) * 3;
+        if (!readAt(file, offset, buffer, pixels * 3)) {
+            printf("Error reading image pixels!\n");
+            return 0;
+        }
+        swapRedBlue(buffer, out, pixels);
+        out += pixels * 3;
+        pixel = end;
+    }
+
+    // Drop the channels before first in its pixel
+    size_t skip = (size_t)(first - firstPixel * 3);
+    memmove(rgb, rgb + skip, (size_t)count);
+    return 1;
+}
+
+// Reads the header from the first pixels of a BMP. Returns 1 if it holds one, 0 if it doesn't
+// (older format) and -1 if the pixels can't be read.
+int readBmpHeader(FILE *file, const BmpLayout *layout, StegoHeader *header) {
+    PixelsData shape = {NULL, layout->width, layout->height};
+    unsigned char channels[HEADER_CHANNELS + 4];
+    unsigned char bytes[HEADER_BYTES];
+    if ((uint64_t)layout->width * layout->height * 3 < HEADER_CHANNELS ||
+        !readBmpChannels(file, layout, 0, HEADER_CHANNELS, channels)) {
+        return -1;
+    }
+    extractChannels(channels, HEADER_CHANNELS, bytes, HEADER_CHANNEL_BITS);
+    return decodeHeader(bytes, shape, header);
+}
+
+// Extracts the payload of an uncompressed 24-bit BMP reading only the header and payload
+// pixels. The payload goes to stream, or to a new buffer in *payload (NUL-terminated) when
+// stream is NULL. Returns 0 on failure.
+int extractPayloadBmp(const char *filename, unsigned char **payload, FILE *stream, uint64_t *length) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("Error opening file");
+        return 0;
+    }
+    BmpLayout layout;
+    if (!parseBmpHeaders(file, &layout)) {
+        printf("Not an uncompressed 24-bit BMP: %s\n", filename);
+        fclose(file);
+        return 0;
+    }
+
+    StegoHeader header;
+    int found = readBmpHeader(file, &layout, &header);
+    if (found < 0) {
+        fclose(file);
+        return 0;
+    }
+    if (!found) {
+        // Older format: go through the whole image
+        fclose(file);
+        PixelsData pixelsData = imageLoader(filename);
+        if (pixelsData.data == NULL) {
+            return 0;
+        }
+        unsigned char *legacy = extractLegacyPayload(pixelsData, length);
+        stbi_image_free(pixelsData.data);
+        if (legacy == NULL) {
+            return 0;
+        }
+        if (stream == NULL) {
+            *payload = legacy;
+            return 1;
+        }
+        int ok = fwrite(legacy, 1, *length, stream) == *length;
+        free(legacy);
+        return ok;
+    }
+
+    unsigned char *out = NULL;
+    if (stream == NULL) {
+        out = malloc(header.length + 1);
+        if (out == NULL) {
+            printf("Not enough memory for the hidden message!\n");
+            fclose(file);
+            return 0;
+        }
+        out[header.length] = '\0';
+    }
+
+    // Whole chunks end on a channel boundary, only the last one can be partial
+    uint64_t chunkChannels = payloadChannels(STREAM_CHUNK, header.depth);
+    unsigned char *chunkPixels = malloc(chunkChannels + 4);
+    unsigned char *chunk = malloc(STREAM_CHUNK);
+    uint64_t channel = HEADER_CHANNELS;
+    int ok = 1;
+    for (uint64_t done = 0; ok && done < header.length; done += STREAM_CHUNK) {
+        size_t size = header.length - done < STREAM_CHUNK ? (size_t)(header.length - done) : STREAM_CHUNK;
+        uint64_t count = payloadChannels(size, header.depth);
+        ok = readBmpChannels(file, &layout, channel, count, chunkPixels);
+        if (ok) {
+            extractBytes(chunkPixels, out ? out + done : chunk, size, header.depth);
+            if (stream != NULL && fwrite(chunk, 1, size, stream) != size) {
+                printf("Error writing the message!\n");
+                ok = 0;
+            }
+        }
+        channel += count;
+    }
+
+    free(chunk);
+    free(chunkPixels);
+    fclose(file);
+    if (!ok) {
+        free(out);
+        return 0;
+    }
+    if (stream == NULL) {
+        *payload = out;
+    }
+    *length = header.length;
+    return 1;
+}
+
+// Hides the payload in a copy of an uncompressed 24-bit BMP without decoding it: the file is
+// copied (or reflinked) once and only the rows that carry the message are rewritten, so the
+// cost follows the payload size rather than the image size. Returns 0 on failure.
+int embedPayloadBmpInPlace(const char *carrier, const char *output, PayloadSource *payload, int depth) {
+    BmpLayout layout;
+    if (!probeBmp(carrier, &layout)) {
+        printf("Not an uncompressed 24-bit BMP: %s\n", carrier);
+        return 0;
+    }
+
+    PixelsData shape = {NULL, layout.width, layout.height};
+    if (!payloadFits(shape, payload->length, depth)) {
+        printf("Image is too small to hold the message! Capacity at %d bits per channel: %llu bytes\n",
+               depth, (unsigned long long)payloadCapacity(shape, depth));
+        return 0;
+    }
+    if (strcmp(carrier, output) != 0 && !copyFile(carrier, output)) {
+        printf("Error copying the image!\n");
+        return 0;
+    }
+    FILE *file = fopen(output, "r+b");
+    if (!file) {
+        perror("Error opening file");
+        return 0;
+    }
+
+    size_t rowBytes = (size_t)layout.width * 3;
+    uint64_t usedChannels = HEADER_CHANNELS + payloadChannels(payload->length, depth);
+    int usedRows = (int)((usedChannels + rowBytes - 1) / rowBytes);
+    int stripRows = rowsForBudget(layout.width, usedRows, DEFAULT_STRIP_BUDGET);
+    uint64_t stripChannels = (uint64_t)stripRows * rowBytes;
+    StripEmbedder embedder;
+    initStripEmbedder(&embedder, payload, depth, stripChannels);
+
+    unsigned char *strip = malloc(stripChannels);
+    unsigned char *fileRows = malloc(stripRows * layout.rowSize);
+    int ok = 1;
+    for (int row = 0; ok && row < usedRows; row += stripRows) {
+        int rows = usedRows - row < stripRows ? usedRows - row : stripRows;
+        uint64_t offset = bmpRowsOffset(&layout, row, rows);
+        size_t size = rows * layout.rowSize;
+        if (!readAt(file, offset, fileRows, size)) {
+            printf("Error reading image rows!\n");
+            ok = 0;
+            break;
+        }
+        bmpRowsToRgb(&layout, fileRows, strip, rows);
+        ok = embedStrip(&embedder, strip, (uint64_t)row * rowBytes, rows * rowBytes);
+        rgbToBmpRows(&layout, strip, fileRows, rows);
+        if (ok && !writeAt(file, offset, fileRows, size)) {
+            printf("Error writing image rows!\n");
+            ok = 0;
+        }
+    }
+
+    free(strip);
+    free(fileRows);
+    free(embedder.window);
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        printf("Image file created: %s\n", output);
+    }
+    return ok;
+}
+
+// Writes pixelData as a 24-bit BMP. A top-down file (negative height) keeps the rows in
+// memory order, so the whole image goes out front to back without a flip.
+int createImage(const char *filename, int width, int height, unsigned char *pixelData, int topDown) {
+    BMPFileHeader fileHeader;
+    BMPInfoHeader infoHeader;
+
+    size_t rowSize = ((size_t)width * 3 + 3) & ~(size_t)3;
+    uint32_t pixelArraySize = (uint32_t)(rowSize * height);
+    uint32_t fileSize = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + pixelArraySize;
+
+    // Populate file header
+    fileHeader.bfType = 0x4D42; // 'BM'
+    fileHeader.bfSize = fileSize;
+    fileHeader.bfReserved1 = 0;
+    fileHeader.bfReserved2 = 0;
+    fileHeader.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+
+    // Populate info header
+    infoHeader.biSize = sizeof(BMPInfoHeader);
+    infoHeader.biWidth = width;
+    infoHeader.biHeight = topDown ? -height : height;
+    infoHeader.biPlanes = 1;
+    infoHeader.biBitCount = 24; // RGB
+    infoHeader.biCompression = 0;
+    infoHeader.biSizeImage = pixelArraySize;
+    infoHeader.biXPelsPerMeter = 2835; // ~72 DPI
+    infoHeader.biYPelsPerMeter = 2835; // ~72 DPI
+    infoHeader.biClrUsed = 0;
+    infoHeader.biClrImportant = 0;
+
+    // Write to file
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening file");
+        return 0;
+    }
+
+    fwrite(&fileHeader, sizeof(BMPFileHeader), 1, file);
+    fwrite(&infoHeader, sizeof(BMPInfoHeader), 1, file);
+
+    // Write pixel data in file order, swizzled to BGR and padded, several rows per fwrite
+    BmpLayout layout = {width, height, !topDown, fileHeader.bfOffBits, rowSize};
+    int chunkRows = WRITE_CHUNK / rowSize > 0 ? (int)(WRITE_CHUNK / rowSize) : 1;
+    if (chunkRows > height) {
+        chunkRows = height;
+    }
+    unsigned char *chunk = calloc(chunkRows, rowSize);
+    int ok = 1;
+    for (int done = 0; done < height; done += chunkRows) {
+        int rows = height - done < chunkRows ? height - done : chunkRows;
+        int firstRow = topDown ? done : height - done - rows;
+        rgbToBmpRows(&layout, pixelData + (size_t)firstRow * width * 3, chunk, rows);
+        if (fwrite(chunk, rowSize, rows, file) != (size_t)rows) {
+            perror("Error writing file");
+            ok = 0;
+            break;
+        }
+    }
+    free(chunk);
+
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        printf("Image file created: %s\n", filename);
+    }
+    return ok;
+}
+
+// Writes pixelData as a PNG at the given compression level (PNG_LEVEL_*), deflated by up to
+// threads threads
+int createPng(const char *filename, int width, int height, const unsigned char *pixelData, int level, int threads) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening file");
+        return 0;
+    }
+    PngWriter *writer = openPngWriter(width, height, level, threads, writeFileBytes, file);
+    int ok = writer != NULL && writePngRows(writer, pixelData, height);
+    if (writer != NULL && !closePngWriter(writer)) {
+        ok = 0;
+    }
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        printf("Image file created: %s\n", filename);
+    } else {
+        printf("Error writing image!\n");
+    }
+    return ok;
+}
+
+// Writes pixelData as a QOI
+int createQoi(const char *filename, int width, int height, const unsigned char *pixelData) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening file");
+        return 0;
+    }
+    QoiWriter *writer = openQoiWriter(width, height, writeFileBytes, file);
+    int ok = writer != NULL && writeQoiRows(writer, pixelData, height);
+    if (writer != NULL && !closeQoiWriter(writer)) {
+        ok = 0;
+    }
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        printf("Image file created: %s\n", filename);
+    } else {
+        printf("Error writing image!\n");
+    }
+    return ok;
+}
+
+// Writes the header of a binary PPM frame of 8-bit samples, the rows following it
+int writePpmHeader(FILE *file, int width, int height) {
+    return fprintf(file, "P6\n%d %d\n255\n", width, height) > 0;
+}
+
+// Writes pixelData as a binary PPM
+int createPpm(const char *filename, int width, int height, const unsigned char *pixelData) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening file");
+        return 0;
+    }
+    int ok = writePpmHeader(file, width, height) &&
+             fwrite(pixelData, (size_t)width * 3, height, file) == (size_t)height;
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        printf("Image file created: %s\n", filename);
+    } else {
+        printf("Error writing image!\n");
+    }
+    return ok;
+}
+
+// Decodes an image file to RGB: a QOI with the built-in decoder, anything else with stb_image.
+// channels gets the number of channels in the file. Free the pixels with stbi_image_free.
+unsigned char *loadImageFile(const char *filename, int *width, int *height, int *channels) {
+    FILE *file = fopen(filename, "rb");
+    QoiStream *qoi = file ? openQoiStream(file, width, height, channels) : NULL;
+    if (qoi != NULL) {
+        unsigned char *rgb = readQoiImage(qoi);
+        closeQoiStream(qoi);
+        fclose(file);
+        return rgb;
+    }
+    if (file) {
+        fclose(file);
+    }
+    return stbi_load(filename, width, height, channels, 3);
+}
+
+// Reads the dimensions and channels of an image file from its header, without decoding it
+int imageFileInfo(const char *filename, int *width, int *height, int *channels) {
+    FILE *file = fopen(filename, "rb");
+    QoiStream *qoi = file ? openQoiStream(file, width, height, channels) : NULL;
+    closeQoiStream(qoi);
+    if (file) {
+        fclose(file);
+    }
+    return qoi != NULL || stbi_info(filename, width, height, channels);
+}
+
+PixelsData imageLoader(const char *filename) {
+    PixelsData data = {NULL, 0, 0};
+    int x, y, n;
+    // The pixels come back with the 3 channels loadImageFile asks for; n is what the file holds,
+    // so gray and RGBA carriers load like any other
+    data.data = loadImageFile(filename, &x, &y, &n);
+    if (data.data == NULL) {
+        printf("Failed to load image\n");
+        return data;
+    }
+    data.width = x;
+    data.height = y;
+
+    printf("Image loaded: %s\n", filename);
+    printf("Dimensions: %dx%d\n", x, y);
+    printf("Channels: %d\n", n);
+
+    return data;
+}
+
+// Loads an image to extract from as RGB. A PNG, baseline JPEG or QOI carrying a header is decoded
+// only as far as its payload (see decodePayloadPixels), anything else in full. Returns no pixels
+// on failure.
+PixelsData loadExtractPixels(const char *filename) {
+    PixelsData pixelsData = {NULL, 0, 0};
+    uint64_t size = fileSize(filename);
+    FILE *file = size <= INT_MAX ? fopen(filename, "rb") : NULL;
+    unsigned char *bytes = file ? malloc(size > 0 ? (size_t)size : 1) : NULL;
+    int n;
+    if (bytes != NULL && fread(bytes, 1, (size_t)size, file) == size) {
+        if (!decodePayloadPixels(bytes, (size_t)size, &pixelsData)) {
+            pixelsData.data = decodeRgb(bytes, (size_t)size, &pixelsData.width, &pixelsData.height);
+        }
+    } else {
+        pixelsData.data = loadImageFile(filename, &pixelsData.width, &pixelsData.height, &n);
+    }
+    free(bytes);
+    if (file) {
+        fclose(file);
+    }
+    return pixelsData;
+}
+
+// Reads the quantized DCT coefficients of a JPEG file, without decoding it to pixels. Returns
+// NULL if it isn't a JPEG.
+JpegCoefficients *loadJpegCoefficients(const char *filename) {
+    uint64_t size = fileSize(filename);
+    FILE *file = size > 2 && size <= INT_MAX ? fopen(filename, "rb") : NULL;
+    unsigned char marker[2];
+    // Only read the whole file once it starts like a JPEG
+    int isJpeg = file != NULL && fread(marker, 1, 2, file) == 2 && marker[0] == 0xFF && marker[1] == 0xD8;
+    unsigned char *bytes = isJpeg ? malloc((size_t)size) : NULL;
+    JpegCoefficients *jpeg = NULL;
+    if (bytes != NULL && fread(bytes + 2, 1, (size_t)size - 2, file) == size - 2) {
+        bytes[0] = 0xFF;
+        bytes[1] = 0xD8;
+        jpeg = readJpegCoefficients(bytes, (size_t)size);
+    }
+    free(bytes);
+    if (file) {
+        fclose(file);
+    }
+    return jpeg;
+}
+
+// Hides the payload in the DCT coefficients of a JPEG and writes them to output as a JPEG
+// again. Returns 0 on failure.
+int embedPayloadJpeg(JpegCoefficients *jpeg, const char *output, PayloadSource *payload) {
+    uint64_t capacity = jpegPayloadCapacity(jpeg);
+    unsigned char *bytes = NULL;
+    if (payload->length <= capacity) {
+        bytes = malloc(payload->length > 0 ? (size_t)payload->length : 1);
+    }
+    if (bytes != NULL && !readPayload(payload, 0, bytes, (size_t)payload->length)) {
+        printf("Error reading the message!\n");
+        free(bytes);
+        return 0;
+    }
+    // Even an empty payload needs carriers for the header, which the embedding checks
+    if (bytes == NULL || !embedJpegPayload(jpeg, bytes, payload->length)) {
+        printf("Image is too small to hold the message! Capacity in the JPEG coefficients: %llu bytes\n",
+               (unsigned long long)capacity);
+        free(bytes);
+        return 0;
+    }
+    free(bytes);
+
+    FILE *file = fopen(output, "wb");
+    if (!file) {
+        perror("Error opening file");
+        return 0;
+    }
+    int ok = writeJpegCoefficients(jpeg, writeFileBytes, file);
+    if (fclose(file) != 0 || !ok) {
+        printf("Error writing %s\n", output);
+        remove(output);
+        return 0;
+    }
+    return 1;
+}
+
+// Returns the payload hidden in the DCT coefficients of a JPEG file, NUL-terminated, or NULL
+// without a message if there is none, so the pixels can be tried next. Free it with
+// stbi_image_free.
+unsigned char *extractPayloadJpeg(const char *filename, uint64_t *length) {
+    JpegCoefficients *jpeg = loadJpegCoefficients(filename);
+    unsigned char *payload = jpeg ? extractJpegPayload(jpeg, length) : NULL;
+    freeJpegCoefficients(jpeg);
+    return payload;
+}
+
+// Number of processors, used as the default number of batch threads
+int cpuCount(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Monotonic wall clock in seconds
+double wallSeconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+// Size of a file in bytes, 0 if it can't be read
+uint64_t fileSize(const char *filename) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(filename, &st) != 0) {
+        return 0;
+    }
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return 0;
+    }
+#endif
+    return (uint64_t)st.st_size;
+}
+
+// Whether name ends in an image extension the tool can read
+int isImageName(const char *name) {
+    static const char *extensions[] = {".bmp", ".png", ".jpg", ".jpeg", ".qoi", ".ppm", ".pnm"};
+    const char *dot = strrchr(name, '.');
+    if (dot == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        const char *a = dot, *b = extensions[i];
+        while (*a && tolower((unsigned char)*a) == *b) {
+            a++;
+            b++;
+        }
+        if (*a == '\0' && *b == '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Collects the paths of the images in dir, sorted. Returns the count, or -1 if dir can't be read.
+int listImages(const char *dir, char ***paths) {
+    int count = 0, capacity = 64;
+    char path[BATCH_PATH];
+    *paths = malloc(capacity * sizeof(char *));
+#ifdef _WIN32
+    struct _finddata_t entry;
+    snprintf(path, sizeof(path), "%s/*", dir);
+    intptr_t handle = _findfirst(path, &entry);
+    if (handle == -1) {
+        free(*paths);
+        return -1;
+    }
+    do {
+        const char *name = entry.name;
+#else
+    DIR *handle = opendir(dir);
+    if (handle == NULL) {
+        free(*paths);
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL) {
+        const char *name = entry->d_name;
+#endif
+        if (isImageName(name)) {
+            if (count == capacity) {
+                capacity *= 2;
+                *paths = realloc(*paths, capacity * sizeof(char *));
+            }
+            snprintf(path, sizeof(path), "%s/%s", dir, name);
+            (*paths)[count++] = strdup(path);
+        }
+#ifdef _WIN32
+    } while (_findnext(handle, &entry) == 0);
+    _findclose(handle);
+#else
+    }
+    closedir(handle);
+#endif
+    qsort(*paths, count, sizeof(char *), comparePaths);
+    return count;
+}
+
+// Builds outDir/<input name><suffix>. The input keeps its extension, so cat.bmp and cat.png in
+// one directory don't both write cat.bmp.
+void batchOutputPath(const char *outDir, const char *input, const char *suffix, char *output, size_t size) {
+    const char *name = input;
+    for (const char *p = input; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            name = p + 1;
+        }
+    }
+    snprintf(output, size, "%s/%s%s", outDir, name, suffix);
+}
+
+// Adds a task to the bottom of a worker's deque and wakes idle workers
+void pushTask(BatchQueue *queue, int worker, BatchTask task) {
+    TaskDeque *deque = &queue->deques[worker];
+    lockBatch(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        if (deque->top > 0) {
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(BatchTask));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->tasks = realloc(deque->tasks, deque->capacity * sizeof(BatchTask));
+        }
+    }
+    deque->tasks[deque->bottom++] = task;
+    unlockBatch(&deque->lock);
+
+    lockBatch(&queue->lock);
+    queue->remaining++;
+    queue->pushes++;
+    wakeBatchWorkers(&queue->wake);
+    unlockBatch(&queue->lock);
+}
+
+// Takes the newest task of the worker's own deque
+int popTask(TaskDeque *deque, BatchTask *task) {
+    lockBatch(&deque->lock);
+    int found = deque->bottom > deque->top;
+    if (found) {
+        *task = deque->tasks[--deque->bottom];
+    }
+    unlockBatch(&deque->lock);
+    return found;
+}
+
+// Takes the oldest task of another worker's deque
+int stealTask(TaskDeque *deque, BatchTask *task) {
+    lockBatch(&deque->lock);
+    int found = deque->bottom > deque->top;
+    if (found) {
+        *task = deque->tasks[deque->top++];
+    }
+    unlockBatch(&deque->lock);
+    return found;
+}
+
+// Counts the result of one input image
+void recordBatchResult(BatchQueue *queue, const char *input, int ok, uint64_t size) {
+    if (!ok) {
+        printf("Failed: %s\n", input);
+    }
+    lockBatch(&queue->lock);
+    if (ok) {
+        queue->bytes += size;
+    } else {
+        queue->failed++;
+    }
+    unlockBatch(&queue->lock);
+}
+
+// Splits an image into count tasks of the given kind, each covering step rows or payload bytes
+void pushImageTasks(BatchQueue *queue, int worker, BatchImage *image, int kind, uint64_t total, uint64_t step) {
+    image->pending = (int)((total + step - 1) / step);
+    for (uint64_t first = 0; first < total; first += step) {
+        BatchTask task = {kind, 0, image, first, total - first < step ? total - first : step};
+        pushTask(queue, worker, task);
+    }
+}
+
+// Called as each task of a split image ends; the last one records the result
+void finishImageTask(BatchQueue *queue, int worker, BatchImage *image, int ok) {
+    lockBatch(&queue->lock);
+    image->failed |= !ok;
+    int last = --image->pending == 0;
+    unlockBatch(&queue->lock);
+    if (!last) {
+        return;
+    }
+
+    if (image->failed) {
+        remove(image->output);
+    } else if (!queue->extract) {
+        printf("Image file created: %s\n", image->output);
+    }
+    recordBatchResult(queue, image->input, !image->failed, image->size);
+    stbi_image_free(image->pixelsData.data);
+    releaseFootprint(queue, worker, image->footprint);
+    free(image);
+}
+
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if it isn't one.
+uint64_t parseSize(const char *text) {
+    char *end;
+    uint64_t size = strtoull(text, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+        case 'G': size <<= 10; // fall through
+        case 'M': size <<= 10; // fall through
+        case 'K': size <<= 10; end++; break;
+    }
+    return end != text && *end == '\0' ? size : 0;
+}
+
+// Threads deflating each PNG output: those left over when there are fewer images than workers
+int batchPngThreads(const BatchQueue *queue) {
+    return queue->count < queue->workers ? queue->workers / queue->count : 1;
+}
+
+// Estimates the peak memory of processing one image from its header. stb holds the
+// compressed file, the decoded image at its own channel count and the RGB copy at once.
+// A BMP hidden in as a PNG or QOI is copied strip by strip instead, plus the encoder's buffers
+// (a chunk per deflate thread). Returns 0 if the header can't be read; the decode then fails
+// on its own.
+uint64_t estimateFootprint(const BatchQueue *queue, const char *input) {
+    BmpLayout layout;
+    if (probeBmp(input, &layout)) {
+        if (queue->extract || (queue->pngLevel < 0 && !queue->qoi)) {
+            return BATCH_BMP_FOOTPRINT;
+        }
+        int threads = queue->pngLevel >= 0 ? batchPngThreads(queue) : 1;
+        return stripFootprint(layout.width, layout.height, DEFAULT_STRIP_BUDGET) + threads * (uint64_t)WRITE_CHUNK;
+    }
+    int x, y, n;
+    if (!imageFileInfo(input, &x, &y, &n)) {
+        return 0;
+    }
+    return fileSize(input) + (uint64_t)x * y * (n + 3) + WRITE_CHUNK;
+}
+
+// Reserves the footprint of an image task against the memory budget. If it doesn't fit the
+// task is parked until memory is released, and 0 is returned. An image larger than the whole
+// budget is admitted once nothing else holds memory.
+int admitImage(BatchQueue *queue, const BatchTask *task, uint64_t footprint) {
+    if (queue->memBudget == 0) {
+        return 1;
+    }
+    lockBatch(&queue->lock);
+    int admitted = queue->reserved == 0 || queue->reserved + footprint <= queue->memBudget;
+    if (admitted) {
+        queue->reserved += footprint;
+    } else {
+        if (queue->parkedCount == queue->parkedCapacity) {
+            queue->parkedCapacity = queue->parkedCapacity ? queue->parkedCapacity * 2 : 64;
+            queue->parked = realloc(queue->parked, queue->parkedCapacity * sizeof(BatchTask));
+        }
+        queue->parked[queue->parkedCount++] = *task;
+    }
+    unlockBatch(&queue->lock);
+    return admitted;
+}
+
+// Returns an image's reservation and requeues the parked tasks on the worker's deque. A task
+// only parks while some image holds memory, so releasing it always brings parked ones back.
+void releaseFootprint(BatchQueue *queue, int worker, uint64_t footprint) {
+    if (queue->memBudget == 0) {
+        return;
+    }
+    lockBatch(&queue->lock);
+    queue->reserved -= footprint;
+    int count = queue->parkedCount;
+    BatchTask *parked = queue->parked;
+    queue->parked = NULL;
+    queue->parkedCount = queue->parkedCapacity = 0;
+    unlockBatch(&queue->lock);
+
+    for (int i = 0; i < count; i++) {
+        pushTask(queue, worker, parked[i]);
+    }
+    free(parked);
+}
+
+// Hides the batch message in one image, written to the output directory as a BMP, PNG or
+// QOI, or with --jpeg as a JPEG if it is one. Large decoded images are split into row tasks
+// when written as BMPs. Returns 1 or 0 when done, -1 when split.
+int hideBatchImage(BatchQueue *queue, int worker, const char *input, uint64_t footprint) {
+    char output[BATCH_PATH];
+    JpegCoefficients *jpeg = queue->jpeg ? loadJpegCoefficients(input) : NULL;
+    if (jpeg != NULL) {
+        PayloadSource message = queue->message;
+        batchOutputPath(queue->outDir, input, "", output, sizeof(output));
+        int ok = embedPayloadJpeg(jpeg, output, &message);
+        freeJpegCoefficients(jpeg);
+        return ok;
+    }
+    int png = queue->pngLevel >= 0;
+    // PNGs and QOIs are encoded front to back, so their rows can't be written by separate tasks
+    int sequential = png || queue->qoi;
+    int pngThreads = batchPngThreads(queue);
+    batchOutputPath(queue->outDir, input, png ? ".png" : queue->qoi ? ".qoi" : ".bmp", output, sizeof(output));
+    PayloadSource message = queue->message;
+    BmpLayout layout;
+    if (probeBmp(input, &layout)) {
+        return sequential ? embedPayloadStrips(input, output, &message, queue->depth, DEFAULT_STRIP_BUDGET, 0,
+                                               queue->pngLevel, pngThreads)
+                          : embedPayloadBmpInPlace(input, output, &message, queue->depth);
+    }
+
+    PixelsData pixelsData;
+    int n;
+    pixelsData.data = loadImageFile(input, &pixelsData.width, &pixelsData.height, &n);
+    if (pixelsData.data == NULL) {
+        printf("Failed to load image %s: %s\n", input, stbi_failure_reason());
+        return 0;
+    }
+    if (sequential || (uint64_t)pixelsData.width * pixelsData.height * 3 <= BATCH_SPLIT_CHANNELS) {
+        int ok = embedPayloadSource(pixelsData, &message, queue->depth);
+        if (ok && png) {
+            ok = createPng(output, pixelsData.width, pixelsData.height, pixelsData.data, queue->pngLevel, pngThreads);
+        } else if (ok && queue->qoi) {
+            ok = createQoi(output, pixelsData.width, pixelsData.height, pixelsData.data);
+        } else if (ok) {
+            ok = createImage(output, pixelsData.width, pixelsData.height, pixelsData.data, queue->topDown);
+        }
+        stbi_image_free(pixelsData.data);
+        return ok;
+    }
+
+    if (!payloadFits(pixelsData, message.length, queue->depth)) {
+        printf("Image is too small to hold the message! Capacity at %d bits per channel: %llu bytes\n",
+               queue->depth, (unsigned long long)payloadCapacity(pixelsData, queue->depth));
+        stbi_image_free(pixelsData.data);
+        return 0;
+    }
+    StripWriter writer;
+    if (!openStripWriter(&writer, output, pixelsData.width, pixelsData.height, queue->topDown, 0, 1) ||
+        !closeStripWriter(&writer)) {
+        stbi_image_free(pixelsData.data);
+        return 0;
+    }
+
+    BatchImage *image = calloc(1, sizeof(BatchImage));
+    image->input = input;
+    strcpy(image->output, output);
+    image->pixelsData = pixelsData;
+    image->layout = writer.bmp;
+    image->size = fileSize(input);
+    image->footprint = footprint;
+    size_t rowBytes = (size_t)pixelsData.width * 3;
+    uint64_t rows = WRITE_CHUNK / rowBytes > 0 ? WRITE_CHUNK / rowBytes : 1;
+    pushImageTasks(queue, worker, image, TASK_EMBED_ROWS, pixelsData.height, rows);
+    return -1;
+}
+
+// Embeds the message bits of a range of rows and writes the rows to the output BMP
+int embedBatchRows(BatchQueue *queue, BatchImage *image, int firstRow, int rows) {
+    uint64_t rowChannels = (uint64_t)image->pixelsData.width * 3;
+    uint64_t stripStart = firstRow * rowChannels;
+    uint64_t stripCount = rows * rowChannels;
+    unsigned char *strip = image->pixelsData.data + stripStart;
+
+    StripEmbedder embedder;
+    initStripEmbedder(&embedder, &queue->message, queue->depth, stripCount);
+    int ok = embedStrip(&embedder, strip, stripStart, stripCount);
+    free(embedder.window);
+
+    // Every task writes through its own handle, so no file position is shared
+    StripWriter writer = {fopen(image->output, "r+b"), image->layout, NULL, NULL, NULL, 0};
+    if (!writer.file) {
+        perror("Error opening file");
+        return 0;
+    }
+    ok = ok && writeStrip(&writer, strip, firstRow, rows);
+    return closeStripWriter(&writer) && ok;
+}
+
+// Extracts the whole payload of one image, from pixelsData or, if it holds no pixels, from
+// the BMP file itself
+int extractWholeImage(const char *input, const char *output, PixelsData pixelsData) {
+    FILE *stream = fopen(output, "wb");
+    if (!stream) {
+        perror("Error opening file");
+        return 0;
+    }
+    uint64_t length;
+    int ok = pixelsData.data == NULL ? extractPayloadBmp(input, NULL, stream, &length)
+                                     : extractPayloadStream(pixelsData, stream, &length);
+    if (fclose(stream) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        remove(output);
+    }
+    return ok;
+}
+
+// Extracts the payload of one image to <name>.bin in the output directory. Large payloads are
+// split into byte range tasks. Returns 1 or 0 when done, -1 when split.
+int extractBatchImage(BatchQueue *queue, int worker, const char *input, uint64_t footprint) {
+    char output[BATCH_PATH];
+    batchOutputPath(queue->outDir, input, ".bin", output, sizeof(output));
+    uint64_t length;
+    unsigned char *hidden = extractPayloadJpeg(input, &length);
+    if (hidden != NULL) {
+        FILE *stream = fopen(output, "wb");
+        int ok = stream != NULL && fwrite(hidden, 1, (size_t)length, stream) == length;
+        if (stream == NULL) {
+            perror("Error opening file");
+        } else if (fclose(stream) != 0) {
+            ok = 0;
+        }
+        stbi_image_free(hidden);
+        return ok;
+    }
+    BmpLayout layout;
+    PixelsData pixelsData = {NULL, 0, 0};
+    StegoHeader header;
+    int found;
+    if (probeBmp(input, &layout)) {
+        FILE *file = fopen(input, "rb");
+        found = file != NULL && readBmpHeader(file, &layout, &header) == 1;
+        if (file) {
+            fclose(file);
+        }
+    } else {
+        pixelsData = loadExtractPixels(input);
+        if (pixelsData.data == NULL) {
+            printf("Failed to load image %s: %s\n", input, stbi_failure_reason());
+            return 0;
+        }
+        found = readHeader(pixelsData, &header);
+    }
+
+    if (!found || header.length <= 2 * BATCH_TASK_BYTES) {
+        int ok = extractWholeImage(input, output, pixelsData);
+        stbi_image_free(pixelsData.data);
+        return ok;
+    }
+
+    FILE *stream = fopen(output, "wb");
+    if (!stream || fclose(stream) != 0) {
+        perror("Error opening file");
+        stbi_image_free(pixelsData.data);
+        return 0;
+    }
+    BatchImage *image = calloc(1, sizeof(BatchImage));
+    image->input = input;
+    strcpy(image->output, output);
+    image->pixelsData = pixelsData;
+    image->layout = layout;
+    image->header = header;
+    image->size = fileSize(input);
+    image->footprint = footprint;
+    pushImageTasks(queue, worker, image, TASK_EXTRACT_BYTES, header.length, BATCH_TASK_BYTES);
+    return -1;
+}
+
+// Extracts payload bytes [first, first + count) of an image to the same place in its output.
+// first is a multiple of BATCH_TASK_BYTES, so the range starts on a channel group.
+int extractBatchBytes(BatchImage *image, uint64_t first, size_t count) {
+    int depth = image->header.depth;
+    uint64_t channel = HEADER_CHANNELS + payloadChannels(first, depth);
+    uint64_t channels = payloadChannels(count, depth);
+    unsigned char *bytes = malloc(count);
+    int ok = 1;
+    if (image->pixelsData.data != NULL) {
+        extractBytes(image->pixelsData.data + channel, bytes, count, depth);
+    } else {
+        FILE *file = fopen(image->input, "rb");
+        unsigned char *rgb = malloc(channels + 4);
+        ok = file != NULL && readBmpChannels(file, &image->layout, channel, channels, rgb);
+        if (ok) {
+            extractBytes(rgb, bytes, count, depth);
+        }
+        if (file) {
+            fclose(file);
+        }
+        free(rgb);
+    }
+
+    FILE *stream = ok ? fopen(image->output, "r+b") : NULL;
+    if (ok && !stream) {
+        perror("Error opening file");
+    }
+    ok = stream != NULL && writeAt(stream, first, bytes, count);
+    if (stream && fclose(stream) != 0) {
+        ok = 0;
+    }
+    free(bytes);
+    return ok;
+}
+
+void runBatchTask(BatchQueue *queue, int worker, BatchTask *task) {
+    if (task->kind == TASK_IMAGE) {
+        const char *input = queue->inputs[task->index];
+        uint64_t footprint = estimateFootprint(queue, input);
+        if (!admitImage(queue, task, footprint)) {
+            return;
+        }
+        int ok = queue->extract ? extractBatchImage(queue, worker, input, footprint)
+                                : hideBatchImage(queue, worker, input, footprint);
+        if (ok >= 0) {
+            releaseFootprint(queue, worker, footprint);
+            recordBatchResult(queue, input, ok, fileSize(input));
+        }
+    } else if (task->kind == TASK_EMBED_ROWS) {
+        finishImageTask(queue, worker, task->image, embedBatchRows(queue, task->image, (int)task->first, (int)task->count));
+    } else {
+        finishImageTask(queue, worker, task->image, extractBatchBytes(task->image, task->first, (size_t)task->count));
+    }
+}
+
+// Runs tasks from the worker's own deque, then steals from the others, until every task is done
+void batchWorker(BatchQueue *queue, int worker) {
+    // stb keeps these options per thread; pin the ones the pixel layout depends on
+    stbi_set_flip_vertically_on_load_thread(0);
+    stbi_set_unpremultiply_on_load_thread(0);
+    stbi_convert_iphone_png_to_rgb_thread(0);
+
+    while (1) {
+        lockBatch(&queue->lock);
+        uint64_t pushes = queue->pushes;
+        unlockBatch(&queue->lock);
+
+        BatchTask task;
+        int found = popTask(&queue->deques[worker], &task);
+        for (int i = 1; !found && i < queue->workers; i++) {
+            found = stealTask(&queue->deques[(worker + i) % queue->workers], &task);
+        }
+        if (found) {
+            runBatchTask(queue, worker, &task);
+            lockBatch(&queue->lock);
+            if (--queue->remaining == 0) {
+                wakeBatchWorkers(&queue->wake);
+            }
+            unlockBatch(&queue->lock);
+            continue;
+        }
+
+        // Nothing to take: sleep until a task is pushed or the last one ends
+        lockBatch(&queue->lock);
+        while (queue->remaining > 0 && queue->pushes == pushes) {
+            waitBatchSignal(&queue->wake, &queue->lock);
+        }
+        int done = queue->remaining == 0;
+        unlockBatch(&queue->lock);
+        if (done) {
+            break;
+        }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI batchThread(LPVOID arg) {
+    batchWorker(((BatchThreadArgs *)arg)->queue, ((BatchThreadArgs *)arg)->id);
+    return 0;
+}
+#else
+static void *batchThread(void *arg) {
+    batchWorker(((BatchThreadArgs *)arg)->queue, ((BatchThreadArgs *)arg)->id);
+    return NULL;
+}
+#endif
+
+static void printUsage(const char *program) {
+    printf("Usage: %s hide --in DIR --out DIR (--msg-file FILE | --msg TEXT) [--depth 1-4] [--top-down] [-j N]\n"
+           "       %*s [--mem-budget SIZE] [--png stored|fast|best | --qoi] [--jpeg]\n"
+           "       %s extract --in DIR --out DIR [-j N] [--mem-budget SIZE]\n"
+           "With --jpeg, JPEG images keep their format: the message goes in their DCT coefficients.\n"
+           "With --in - or --out -, a stream of PPM frames is read from stdin (or a file) and the frames or\n"
+           "their messages are written to stdout (or a file).\n", program, (int)strlen(program) + 5, "", program);
+}
+
+// Runs the command line batch mode. Returns the process exit status.
+int runBatch(int argc, char *argv[]) {
+    BatchQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.depth = MIN_CHANNEL_BITS;
+    queue.pngLevel = -1;
+    const char *inDir = NULL, *messageFilename = NULL, *text = NULL;
+    int threads = cpuCount();
+
+    if (strcmp(argv[1], "extract") == 0) {
+        queue.extract = 1;
+    } else if (strcmp(argv[1], "hide") != 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    for (int i = 2; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--top-down") == 0) {
+            queue.topDown = 1;
+            continue;
+        }
+        if (strcmp(arg, "--qoi") == 0) {
+            queue.qoi = 1;
+            continue;
+        }
+        if (strcmp(arg, "--jpeg") == 0) {
+            queue.jpeg = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (strcmp(arg, "--in") == 0) {
+            inDir = value;
+        } else if (strcmp(arg, "--out") == 0) {
+            queue.outDir = value;
+        } else if (strcmp(arg, "--msg-file") == 0) {
+            messageFilename = value;
+        } else if (strcmp(arg, "--msg") == 0) {
+            text = value;
+        } else if (strcmp(arg, "--depth") == 0) {
+            queue.depth = atoi(value);
+        } else if (strcmp(arg, "-j") == 0) {
+            threads = atoi(value);
+        } else if (strcmp(arg, "--png") == 0) {
+            static const char *levels[] = {"stored", "fast", "best"};
+            for (int level = PNG_LEVEL_STORED; level <= PNG_LEVEL_BEST; level++) {
+                if (strcmp(value, levels[level]) == 0) {
+                    queue.pngLevel = level;
+                }
+            }
+            if (queue.pngLevel < 0) {
+                printf("Invalid PNG compression: %s\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--mem-budget") == 0) {
+            queue.memBudget = parseSize(value);
+            if (queue.memBudget == 0) {
+                printf("Invalid memory budget: %s\n", value);
+                return 1;
+            }
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (inDir == NULL || queue.outDir == NULL || threads < 1 || (queue.qoi && queue.pngLevel >= 0) ||
+        (!queue.extract && (messageFilename == NULL) == (text == NULL))) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    // A stream of PPM frames is filtered in order, in the PPM format
+    int stream = strcmp(inDir, "-") == 0 || strcmp(queue.outDir, "-") == 0;
+    if (stream && (queue.qoi || queue.pngLevel >= 0 || queue.topDown || queue.jpeg)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (queue.depth < MIN_CHANNEL_BITS || queue.depth > MAX_CHANNEL_BITS) {
+        printf("Invalid number of bits per channel!\n");
+        return 1;
+    }
+
+    // The message is read once and shared by every image
+    unsigned char *messageData = NULL;
+    if (messageFilename != NULL) {
+        FILE *messageFile = fopen(messageFilename, "rb");
+        if (!messageFile) {
+            perror("Error opening file");
+            return 1;
+        }
+        uint64_t length = fileSize(messageFilename);
+        messageData = malloc(length + 1);
+        if (messageData == NULL || fread(messageData, 1, length, messageFile) != length) {
+            printf("Error reading the message!\n");
+            fclose(messageFile);
+            free(messageData);
+            return 1;
+        }
+        fclose(messageFile);
+        queue.message = (PayloadSource){messageData, NULL, length};
+    } else if (text != NULL) {
+        queue.message = (PayloadSource){(const unsigned char *)text, NULL, strlen(text)};
+    }
+    if (stream) {
+        int ok = runPipe(inDir, queue.outDir, &queue.message, queue.depth, queue.extract);
+        free(messageData);
+        return ok ? 0 : 1;
+    }
+
+    queue.count = listImages(inDir, &queue.inputs);
+    if (queue.count <= 0) {
+        printf(queue.count < 0 ? "Can't read directory: %s\n" : "No images found in %s\n", inDir);
+        free(messageData);
+        return 1;
+    }
+#ifdef _WIN32
+    _mkdir(queue.outDir);
+#else
+    mkdir(queue.outDir, 0755);
+#endif
+
+    // Inputs are dealt round-robin; workers steal from each other once their own run out
+    initBatchLock(&queue.lock);
+    initBatchSignal(&queue.wake);
+    queue.workers = threads;
+    queue.deques = calloc(threads, sizeof(TaskDeque));
+    for (int i = 0; i < threads; i++) {
+        initBatchLock(&queue.deques[i].lock);
+    }
+    for (int i = 0; i < queue.count; i++) {
+        BatchTask task = {TASK_IMAGE, i, NULL, 0, 0};
+        pushTask(&queue, i % threads, task);
+    }
+
+    BatchThreadArgs *args = malloc(threads * sizeof(BatchThreadArgs));
+    double start = wallSeconds();
+#ifdef _WIN32
+    HANDLE *pool = malloc(threads * sizeof(HANDLE));
+    for (int i = 0; i < threads; i++) {
+        args[i] = (BatchThreadArgs){&queue, i};
+        pool[i] = CreateThread(NULL, 0, batchThread, &args[i], 0, NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        WaitForSingleObject(pool[i], INFINITE);
+        CloseHandle(pool[i]);
+    }
+#else
+    pthread_t *pool = malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        args[i] = (BatchThreadArgs){&queue, i};
+        pthread_create(&pool[i], NULL, batchThread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+#endif
+    double seconds = wallSeconds() - start;
+    for (int i = 0; i < threads; i++) {
+        destroyBatchLock(&queue.deques[i].lock);
+        free(queue.deques[i].tasks);
+    }
+    free(queue.deques);
+    free(queue.parked);
+    destroyBatchSignal(&queue.wake);
+    destroyBatchLock(&queue.lock);
+
+    int done = queue.count - queue.failed;
+    printf("%s %d of %d images with %d threads in %.2f s: %.1f images/s, %.1f MB/s\n",
+           queue.extract ? "Extracted from" : "Hid the message in", done, queue.count, threads, seconds,
+           done / seconds, queue.bytes / seconds / 1e6);
+
+    for (int i = 0; i < queue.count; i++) {
+        free(queue.inputs[i]);
+    }
+    free(queue.inputs);
+    free(pool);
+    free(args);
+    free(messageData);
+    return queue.failed ? 1 : 0;
+}
+
+// Hides the message in every frame of a stream of PPMs, copying the frames from in to out a
+// block of rows at a time. Stops at the first frame that fails. Returns 0 on failure.
+int hidePipeFrames(FILE *in, FILE *out, PayloadSource *message, int depth, int *frames, uint64_t *bytes) {
+    unsigned char *block = NULL;
+    size_t blockSize = 0;
+    int width, height, status = 1;
+    int ok = 1;
+    while (ok && (status = readPpmHeader(in, &width, &height)) == 1) {
+        PixelsData shape = {NULL, width, height};
+        if (!payloadFits(shape, message->length, depth)) {
+            printf("Frame %d is too small to hold the message! Capacity at %d bits per channel: %llu bytes\n",
+                   *frames + 1, depth, (unsigned long long)payloadCapacity(shape, depth));
+            ok = 0;
+            break;
+        }
+        size_t rowBytes = (size_t)width * 3;
+        int blockRows = PIPE_CHUNK / rowBytes > 0 ? (int)(PIPE_CHUNK / rowBytes) : 1;
+        blockRows = blockRows < height ? blockRows : height;
+        if (blockRows * rowBytes > blockSize) {
+            free(block);
+            blockSize = blockRows * rowBytes;
+            block = malloc(blockSize);
+            if (block == NULL) {
+                printf("Not enough memory for the frame rows!\n");
+                return 0;
+            }
+        }
+
+        StripEmbedder embedder;
+        initStripEmbedder(&embedder, message, depth, (uint64_t)blockRows * rowBytes);
+        ok = writePpmHeader(out, width, height);
+        for (int row = 0; ok && row < height; row += blockRows) {
+            int rows = height - row < blockRows ? height - row : blockRows;
+            if (fread(block, rowBytes, rows, in) != (size_t)rows) {
+                printf("Frame %d ends early!\n", *frames + 1);
+                ok = 0;
+                break;
+            }
+            ok = embedStrip(&embedder, block, (uint64_t)row * rowBytes, (uint64_t)rows * rowBytes) &&
+                 fwrite(block, rowBytes, rows, out) == (size_t)rows;
+        }
+        free(embedder.window);
+
+        // Each frame goes down the pipe as soon as it is done
+        if (ok && fflush(out) != 0) {
+            ok = 0;
+        }
+        if (ok) {
+            ++*frames;
+            *bytes += (uint64_t)rowBytes * height;
+        } else if (ferror(out)) {
+            printf("Error writing frame %d!\n", *frames + 1);
+        }
+    }
+    free(block);
+    if (ok && status == 0) {
+        printf("Frame %d isn't a binary PPM with 8-bit samples!\n", *frames + 1);
+        ok = 0;
+    }
+    return ok;
+}
+
+// Writes the message of every frame of a stream of PPMs to out, one after another. Only the
+// header and payload channels are kept; the rest of each frame is read past. Stops at the
+// first frame that fails. Returns 0 on failure.
+int extractPipeFrames(FILE *in, FILE *out, int *frames, uint64_t *bytes) {
+    // Whole chunks end on a channel boundary at any depth, only the last one can be partial
+    unsigned char *chunkPixels = malloc(payloadChannels(STREAM_CHUNK, MIN_CHANNEL_BITS));
+    unsigned char *chunk = malloc(STREAM_CHUNK);
+    int width, height, status = 1;
+    int ok = chunkPixels != NULL && chunk != NULL;
+    while (ok && (status = readPpmHeader(in, &width, &height)) == 1) {
+        PixelsData shape = {NULL, width, height};
+        uint64_t left = (uint64_t)width * height * 3;
+        unsigned char headerBytes[HEADER_BYTES];
+        StegoHeader header;
+        if (left < HEADER_CHANNELS) {
+            printf("No hidden message in frame %d!\n", *frames + 1);
+            ok = 0;
+            break;
+        }
+        if (fread(chunkPixels, 1, HEADER_CHANNELS, in) != HEADER_CHANNELS) {
+            printf("Frame %d ends early!\n", *frames + 1);
+            ok = 0;
+            break;
+        }
+        left -= HEADER_CHANNELS;
+        extractChannels(chunkPixels, HEADER_CHANNELS, headerBytes, HEADER_CHANNEL_BITS);
+        if (!decodeHeader(headerBytes, shape, &header)) {
+            printf("No hidden message in frame %d!\n", *frames + 1);
+            ok = 0;
+            break;
+        }
+
+        for (uint64_t done = 0; ok && done < header.length; done += STREAM_CHUNK) {
+            size_t size = header.length - done < STREAM_CHUNK ? (size_t)(header.length - done) : STREAM_CHUNK;
+            size_t count = (size_t)payloadChannels(size, header.depth);
+            if (fread(chunkPixels, 1, count, in) != count) {
+                printf("Frame %d ends early!\n", *frames + 1);
+                ok = 0;
+                break;
+            }
+            left -= count;
+            extractBytes(chunkPixels, chunk, size, header.depth);
+            if (fwrite(chunk, 1, size, out) != size) {
+                printf("Error writing the message!\n");
+                ok = 0;
+            }
+        }
+
+        // The pixels past the payload only need to be consumed
+        size_t skipSize = (size_t)payloadChannels(STREAM_CHUNK, MIN_CHANNEL_BITS);
+        while (ok && left > 0) {
+            size_t count = left < skipSize ? (size_t)left : skipSize;
+            if (fread(chunkPixels, 1, count, in) != count) {
+                printf("Frame %d ends early!\n", *frames + 1);
+                ok = 0;
+            }
+            left -= count;
+        }
+        if (ok && fflush(out) != 0) {
+            printf("Error writing the message!\n");
+            ok = 0;
+        }
+        if (ok) {
+            ++*frames;
+            *bytes += (uint64_t)width * height * 3;
+        }
+    }
+    free(chunk);
+    free(chunkPixels);
+    if (ok && status == 0) {
+        printf("Frame %d isn't a binary PPM with 8-bit samples!\n", *frames + 1);
+        ok = 0;
+    }
+    return ok;
+}
+
+// Runs the batch mode on a stream of PPM frames, typically between other programs of a pipeline:
+// input and output are files, or stdin and stdout for "-". Frames are processed one after another
+// a block of rows at a time, so memory stays bounded whatever the length of the stream. While
+// stdout carries the output, messages go to stderr. Returns 1 on success.
+int runPipe(const char *input, const char *output, PayloadSource *message, int depth, int extract) {
+    FILE *in, *out;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    in = strcmp(input, "-") == 0 ? stdin : fopen(input, "rb");
+    if (in == NULL) {
+        perror("Error opening file");
+        return 0;
+    }
+    if (strcmp(output, "-") == 0) {
+        // The output keeps its own handle on stdout, and stdout itself is pointed at stderr
+        fflush(stdout);
+#ifdef _WIN32
+        out = _fdopen(_dup(_fileno(stdout)), "wb");
+        _dup2(_fileno(stderr), _fileno(stdout));
+#else
+        out = fdopen(dup(STDOUT_FILENO), "wb");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+#endif
+    } else {
+        out = fopen(output, "wb");
+    }
+    if (out == NULL) {
+        perror("Error opening file");
+        if (in != stdin) {
+            fclose(in);
+        }
+        return 0;
+    }
+
+    int frames = 0;
+    uint64_t bytes = 0;
+    double start = wallSeconds();
+    int ok = extract ? extractPipeFrames(in, out, &frames, &bytes) : hidePipeFrames(in, out, message, depth, &frames, &bytes);
+    double seconds = wallSeconds() - start;
+    if (fclose(out) != 0) {
+        ok = 0;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    printf("%s %d frames in %.2f s: %.1f frames/s, %.1f MB/s\n", extract ? "Extracted from" : "Hid the message in",
+           frames, seconds, frames / seconds, bytes / seconds / 1e6);
+    return ok;
+}
+
+static int compareLargestPayload(const void *a, const void *b) {
+    uint64_t x = ((const PlanPayload *)a)->size, y = ((const PlanPayload *)b)->size;
+    return (x < y) - (x > y);
+}
+
+// Picks a free carrier for a payload of size bytes: the lowest depth any carrier can hold it
+// at, then the smallest carrier that fits, so the large ones stay free for large payloads.
+// Returns the carrier's index, or -1 if none fits.
+int assignCarrier(PlanCarrier *carriers, int count, uint64_t size, int *depth) {
+    for (*depth = MIN_CHANNEL_BITS; *depth <= MAX_CHANNEL_BITS; (*depth)++) {
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            uint64_t capacity = payloadCapacity(carriers[i].shape, *depth);
+            if (!carriers[i].taken && payloadFits(carriers[i].shape, size, *depth) &&
+                (best < 0 || capacity < payloadCapacity(carriers[best].shape, *depth))) {
+                best = i;
+            }
+        }
+        if (best >= 0) {
+            return best;
+        }
+    }
+    return -1;
+}
+
+// Runs the capacity planner: --plan --in DIR [PAYLOAD...]. Images are sized from their headers
+// without decoding any pixels. Returns the process exit status.
+int runPlan(int argc, char *argv[]) {
+    if (argc < 4 || strcmp(argv[2], "--in") != 0) {
+        printf("Usage: %s --plan --in DIR [PAYLOAD...]\n", argv[0]);
+        return 1;
+    }
+    const char *inDir = argv[3];
+    char **inputs;
+    int count = listImages(inDir, &inputs);
+    if (count <= 0) {
+        printf(count < 0 ? "Can't read directory: %s\n" : "No images found in %s\n", inDir);
+        return 1;
+    }
+
+    double start = wallSeconds();
+    PlanCarrier *carriers = calloc(count, sizeof(PlanCarrier));
+    int readable = 0;
+    for (int i = 0; i < count; i++) {
+        PlanCarrier *carrier = &carriers[readable];
+        carrier->path = inputs[i];
+        if (imageFileInfo(inputs[i], &carrier->shape.width, &carrier->shape.height, &carrier->channels)) {
+            readable++;
+        } else {
+            printf("Can't read %s: %s\n", inputs[i], stbi_failure_reason());
+        }
+    }
+    double seconds = wallSeconds() - start;
+
+    printf("%-40s %11s %2s %14s %14s %14s %14s\n", "Image", "Size", "Ch", "1 bit", "2 bits", "3 bits", "4 bits");
+    for (int i = 0; i < readable; i++) {
+        printf("%-40s %5dx%-5d %2d", carriers[i].path, carriers[i].shape.width, carriers[i].shape.height,
+               carriers[i].channels);
+        for (int depth = MIN_CHANNEL_BITS; depth <= MAX_CHANNEL_BITS; depth++) {
+            printf(" %14llu", (unsigned long long)payloadCapacity(carriers[i].shape, depth));
+        }
+        printf("\n");
+    }
+    printf("Read %d of %d image headers in %.2f ms\n", readable, count, seconds * 1e3);
+
+    // Largest payloads are placed first, each in its own carrier
+    int payloadCount = argc - 4;
+    int unplaced = 0;
+    PlanPayload *payloads = malloc((payloadCount > 0 ? payloadCount : 1) * sizeof(PlanPayload));
+    for (int i = 0; i < payloadCount; i++) {
+        payloads[i].path = argv[4 + i];
+        payloads[i].size = fileSize(argv[4 + i]);
+    }
+    qsort(payloads, payloadCount, sizeof(PlanPayload), compareLargestPayload);
+    if (payloadCount > 0) {
+        printf("\nAssignments:\n");
+    }
+    for (int i = 0; i < payloadCount; i++) {
+        int depth;
+        int carrier = assignCarrier(carriers, readable, payloads[i].size, &depth);
+        if (carrier < 0) {
+            printf("%s (%llu bytes): no free carrier is large enough\n", payloads[i].path,
+                   (unsigned long long)payloads[i].size);
+            unplaced++;
+            continue;
+        }
+        carriers[carrier].taken = 1;
+        printf("%s (%llu bytes) -> %s at %d bit%s per channel\n", payloads[i].path,
+               (unsigned long long)payloads[i].size, carriers[carrier].path, depth, depth > 1 ? "s" : "");
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(inputs[i]);
+    }
+    free(inputs);
+    free(carriers);
+    free(payloads);
+    return unplaced ? 1 : 0;
+}
+
+void putBigEndian64(unsigned char *bytes, uint64_t value) {
+    for (int i = 7; i >= 0; i--, value >>= 8) {
+        bytes[i] = (unsigned char)value;
+    }
+}
+
+uint64_t getBigEndian64(const unsigned char *bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+// Grows a buffer kept across requests to hold at least size bytes. Returns 0 if out of memory.
+int reserveBuffer(ServeBuffer *buffer, uint64_t size) {
+    if (size <= buffer->capacity) {
+        return 1;
+    }
+    unsigned char *data = realloc(buffer->data, (size_t)size);
+    if (data == NULL) {
+        return 0;
+    }
+    buffer->data = data;
+    buffer->capacity = (size_t)size;
+    return 1;
+}
+
+// Whether a client's file is sealed against shrinking, like a memfd with F_SEAL_SHRINK. Only
+// then can it be mapped: a shared map of a file the client truncates faults on access.
+int sealedAgainstShrink(int fd) {
+#ifdef F_GET_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+    return seals >= 0 && (seals & F_SEAL_SHRINK);
+#else
+    (void)fd;
+    return 0;
+#endif
+}
+
+// Gives room for size bytes of result: the reply buffer for inline requests and unsealed
+// output files, or a sealed output file resized and mapped. Returns NULL on failure.
+unsigned char *reserveServeOutput(ServeOutput *output, uint64_t size) {
+    if (output->fd < 0 || !sealedAgainstShrink(output->fd)) {
+        output->copy = output->fd >= 0;
+        return reserveBuffer(output->buffer, size) ? output->buffer->data : NULL;
+    }
+#ifndef _WIN32
+    if (ftruncate(output->fd, (off_t)size) != 0) {
+        return NULL;
+    }
+    // A zero-length map isn't allowed; one page keeps the pointer valid for an empty result
+    output->mapSize = size > 0 ? (size_t)size : 1;
+    output->map = mmap(NULL, output->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, output->fd, 0);
+    if (output->map == MAP_FAILED) {
+        output->map = NULL;
+    }
+    return output->map;
+#else
+    return NULL;
+#endif
+}
+
+// Embeds a payload into the pixels of a BMP held in memory, converting only the rows it uses
+void embedPayloadBmpBytes(unsigned char *bmp, const BmpLayout *layout, PayloadSource *payload, int depth) {
+    size_t rowBytes = (size_t)layout->width * 3;
+    uint64_t usedChannels = HEADER_CHANNELS + payloadChannels(payload->length, depth);
+    uint64_t rowsNeeded = (usedChannels + rowBytes - 1) / rowBytes;
+    int usedRows = rowsNeeded < (uint64_t)layout->height ? (int)rowsNeeded : layout->height;
+    StripEmbedder embedder;
+    initStripEmbedder(&embedder, payload, depth, rowBytes);
+    unsigned char *rgb = malloc(rowBytes);
+    for (int row = 0; row < usedRows; row++) {
+        unsigned char *fileRow = bmp + bmpRowsOffset(layout, row, 1);
+        bmpRowsToRgb(layout, fileRow, rgb, 1);
+        embedStrip(&embedder, rgb, (uint64_t)row * rowBytes, rowBytes);
+        rgbToBmpRows(layout, rgb, fileRow, 1);
+    }
+    free(rgb);
+    free(embedder.window);
+}
+
+// Converts the rows of a BMP held in memory that hold channels [0, count) to top-down RGB.
+// Returns a new buffer of whole rows.
+unsigned char *bmpBytesToRgb(const unsigned char *bmp, const BmpLayout *layout, uint64_t count) {
+    size_t rowBytes = (size_t)layout->width * 3;
+    uint64_t rowsNeeded = (count + rowBytes - 1) / rowBytes;
+    int rows = rowsNeeded < (uint64_t)layout->height ? (int)rowsNeeded : layout->height;
+    unsigned char *rgb = malloc(rows * rowBytes);
+    if (rgb != NULL) {
+        bmpRowsToRgb(layout, bmp + bmpRowsOffset(layout, 0, rows), rgb, rows);
+    }
+    return rgb;
+}
+
+// Runs one request on an image held in memory and leaves the result in output. A BMP is
+// patched or read without decoding; with inPlace the image itself is the output.
+// Returns a SERVE_* status.
+int handleServeRequest(const unsigned char *request, unsigned char *image, uint64_t imageLength,
+                       const unsigned char *payload, int inPlace, ServeOutput *output, uint64_t *resultLength) {
+    int depth = request[1];
+    int topDown = request[2] & SERVE_FLAG_TOP_DOWN;
+    uint64_t payloadLength = getBigEndian64(request + 12);
+    *resultLength = 0;
+
+    BmpLayout layout;
+    if (parseBmpBytes(image, imageLength, &layout)) {
+        PixelsData shape = {NULL, layout.width, layout.height};
+        // The rows holding the header would run past an image with fewer channels than it takes
+        if ((uint64_t)layout.width * layout.height * 3 < HEADER_CHANNELS) {
+            return request[0] == SERVE_EMBED ? SERVE_TOO_SMALL : SERVE_NOT_FOUND;
+        }
+        if (request[0] == SERVE_EMBED) {
+            if (depth < MIN_CHANNEL_BITS || depth > MAX_CHANNEL_BITS) {
+                return SERVE_BAD_REQUEST;
+            }
+            if (!payloadFits(shape, payloadLength, depth)) {
+                return SERVE_TOO_SMALL;
+            }
+            unsigned char *target = image;
+            if (!inPlace) {
+                target = reserveServeOutput(output, imageLength);
+                if (target == NULL) {
+                    return SERVE_NO_MEMORY;
+                }
+                memcpy(target, image, (size_t)imageLength);
+            }
+            PayloadSource source = {payload, NULL, payloadLength};
+            embedPayloadBmpBytes(target, &layout, &source, depth);
+            *resultLength = imageLength;
+            return SERVE_OK;
+        }
+
+        StegoHeader header;
+        unsigned char *rgb = bmpBytesToRgb(image, &layout, HEADER_CHANNELS);
+        PixelsData headerPixels = {rgb, layout.width, layout.height};
+        int found = rgb != NULL && readHeader(headerPixels, &header);
+        free(rgb);
+        if (found) {
+            rgb = bmpBytesToRgb(image, &layout, HEADER_CHANNELS + payloadChannels(header.length, header.depth));
+            unsigned char *target = rgb ? reserveServeOutput(output, header.length) : NULL;
+            if (target != NULL) {
+                extractBytes(rgb + HEADER_CHANNELS, target, header.length, header.depth);
+                *resultLength = header.length;
+            }
+            free(rgb);
+            return target != NULL ? SERVE_OK : SERVE_NO_MEMORY;
+        }
+        // Older format: decode the whole image below
+    }
+    if (inPlace) {
+        return SERVE_BAD_REQUEST;
+    }
+
+    // An extract only needs the rows of a PNG, JPEG or QOI that carry the payload
+    PixelsData pixelsData;
+    if (request[0] != SERVE_EXTRACT || !decodePayloadPixels(image, (size_t)imageLength, &pixelsData)) {
+        pixelsData.data = decodeRgb(image, (size_t)imageLength, &pixelsData.width, &pixelsData.height);
+    }
+    if (pixelsData.data == NULL) {
+        return SERVE_BAD_IMAGE;
+    }
+
+    int status = SERVE_OK;
+    unsigned char *target;
+    if (request[0] == SERVE_EMBED) {
+        uint64_t size = bmpFileSize(pixelsData.width, pixelsData.height);
+        if (depth < MIN_CHANNEL_BITS || depth > MAX_CHANNEL_BITS) {
+            status = SERVE_BAD_REQUEST;
+        } else if (!payloadFits(pixelsData, payloadLength, depth)) {
+            status = SERVE_TOO_SMALL;
+        } else if ((target = reserveServeOutput(output, size)) == NULL) {
+            status = SERVE_NO_MEMORY;
+        } else {
+            embedPayload(pixelsData, payload, payloadLength, depth);
+            encodeBmp(pixelsData.width, pixelsData.height, pixelsData.data, topDown, target);
+            *resultLength = size;
+        }
+    } else {
+        StegoHeader header;
+        if (readHeader(pixelsData, &header)) {
+            if ((target = reserveServeOutput(output, header.length)) == NULL) {
+                status = SERVE_NO_MEMORY;
+            } else {
+                extractBytes(pixelsData.data + HEADER_CHANNELS, target, header.length, header.depth);
+                *resultLength = header.length;
+            }
+        } else {
+            uint64_t length;
+            unsigned char *legacy = extractLegacyPayload(pixelsData, &length);
+            if (legacy == NULL) {
+                status = SERVE_NOT_FOUND;
+            } else if ((target = reserveServeOutput(output, length)) == NULL) {
+                status = SERVE_NO_MEMORY;
+            } else {
+                memcpy(target, legacy, (size_t)length);
+                *resultLength = length;
+            }
+            free(legacy);
+        }
+    }
+    stbi_image_free(pixelsData.data);
+    return status;
+}
+
+#ifndef _WIN32
+// Reads exactly size bytes. Returns 0 on end of stream or error.
+int readFull(int fd, void *buffer, size_t size) {
+    for (size_t done = 0; done < size;) {
+        ssize_t count = read(fd, (unsigned char *)buffer + done, size - done);
+        if (count <= 0) {
+            return 0;
+        }
+        done += (size_t)count;
+    }
+    return 1;
+}
+
+// Writes exactly size bytes without raising SIGPIPE. Returns 0 on error.
+int writeFull(int fd, const void *buffer, size_t size) {
+    for (size_t done = 0; done < size;) {
+        ssize_t count = send(fd, (const unsigned char *)buffer + done, size - done, MSG_NOSIGNAL);
+        if (count <= 0) {
+            return 0;
+        }
+        done += (size_t)count;
+    }
+    return 1;
+}
+
+// Reads a request header and the file descriptors sent along with it. Returns 0 on end of
+// stream or error.
+int receiveRequest(int fd, unsigned char *request, int *fds, int *fdCount) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * SERVE_MAX_FDS)];
+    } control;
+    struct iovec part = {request, SERVE_REQUEST_BYTES};
+    struct msghdr message = {0};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t count = recvmsg(fd, &message, 0);
+#endif
+    if (count <= 0) {
+        return 0;
+    }
+
+    *fdCount = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int received = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < received && *fdCount < SERVE_MAX_FDS; i++) {
+                memcpy(&fds[(*fdCount)++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            }
+        }
+    }
+    return readFull(fd, request + count, SERVE_REQUEST_BYTES - (size_t)count);
+}
+
+// Runs a request whose image comes in a file descriptor, typically a memfd or shared memory
+// object, and whose result goes to the second descriptor, so no image bytes cross the socket.
+// With a single descriptor a BMP is patched in place.
+int handleFdRequest(ServeWorker *worker, const unsigned char *request, const int *fds, int fdCount,
+                    uint64_t *resultLength) {
+    uint64_t imageLength = getBigEndian64(request + 4);
+    int inPlace = fdCount == 1;
+    if (fdCount < 1 || (inPlace && request[0] != SERVE_EMBED)) {
+        return SERVE_BAD_REQUEST;
+    }
+    struct stat st;
+    if (fstat(fds[0], &st) != 0) {
+        return SERVE_BAD_IMAGE;
+    }
+    if (imageLength == 0) {
+        imageLength = (uint64_t)st.st_size;
+    }
+    // Bytes past the end of the file can't be read, and a map of them faults
+    if (imageLength == 0 || imageLength > SERVE_MAX_BYTES || imageLength > (uint64_t)st.st_size) {
+        return SERVE_BAD_REQUEST;
+    }
+    // The client keeps the file and could truncate it while it is read, so only a sealed one is
+    // mapped; any other is copied, and written back after an in-place embed
+    int mapped = sealedAgainstShrink(fds[0]);
+    unsigned char *image;
+    if (mapped) {
+        image = mmap(NULL, (size_t)imageLength, inPlace ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fds[0], 0);
+        if (image == MAP_FAILED) {
+            return SERVE_BAD_IMAGE;
+        }
+    } else if (!reserveBuffer(&worker->image, imageLength)) {
+        return SERVE_NO_MEMORY;
+    } else if (!readFdAt(fds[0], 0, worker->image.data, (size_t)imageLength)) {
+        return SERVE_BAD_IMAGE;
+    } else {
+        image = worker->image.data;
+    }
+
+    ServeOutput output = {&worker->reply, inPlace ? -1 : fds[1], NULL, 0, 0};
+    int status = handleServeRequest(request, image, imageLength, worker->request.data, inPlace, &output, resultLength);
+    if (mapped) {
+        munmap(image, (size_t)imageLength);
+    } else if (inPlace && status == SERVE_OK && !writeFdAt(fds[0], 0, image, (size_t)imageLength)) {
+        status = SERVE_NO_MEMORY;
+    }
+    if (output.map != NULL) {
+        munmap(output.map, output.mapSize);
+    }
+    if (output.copy && status == SERVE_OK &&
+        (ftruncate(output.fd, (off_t)*resultLength) != 0 ||
+         !writeFdAt(output.fd, 0, output.buffer->data, (size_t)*resultLength))) {
+        status = SERVE_NO_MEMORY;
+    }
+    return status;
+}
+
+// Answers requests on one connection until the client closes it or breaks the protocol
+void serveConnection(ServeWorker *worker, int fd) {
+    unsigned char request[SERVE_REQUEST_BYTES];
+    unsigned char reply[SERVE_REPLY_BYTES] = {0};
+    int fds[SERVE_MAX_FDS];
+    int fdCount;
+    while (receiveRequest(fd, request, fds, &fdCount)) {
+        int useFds = request[2] & SERVE_FLAG_FDS;
+        uint64_t imageLength = useFds ? 0 : getBigEndian64(request + 4);
+        uint64_t payloadLength = getBigEndian64(request + 12);
+        int status = SERVE_OK;
+        if ((request[0] != SERVE_EMBED && request[0] != SERVE_EXTRACT) ||
+            imageLength > SERVE_MAX_BYTES || payloadLength > SERVE_MAX_BYTES) {
+            status = SERVE_BAD_REQUEST;
+        } else if (!reserveBuffer(&worker->request, imageLength + payloadLength)) {
+            status = SERVE_NO_MEMORY;
+        }
+        if (status != SERVE_OK) {
+            for (int i = 0; i < fdCount; i++) {
+                close(fds[i]);
+            }
+            reply[0] = (unsigned char)status;
+            putBigEndian64(reply + 4, 0);
+            writeFull(fd, reply, sizeof(reply));
+            break;
+        }
+        int received = readFull(fd, worker->request.data, (size_t)(imageLength + payloadLength));
+
+        // Only the result length is sent back when it went to the client's descriptor
+        uint64_t resultLength = 0;
+        uint64_t bodyLength = 0;
+        if (received && useFds) {
+            status = handleFdRequest(worker, request, fds, fdCount, &resultLength);
+        } else if (received) {
+            ServeOutput output = {&worker->reply, -1, NULL, 0, 0};
+            status = handleServeRequest(request, worker->request.data, imageLength,
+                                        worker->request.data + imageLength, 0, &output, &resultLength);
+            bodyLength = resultLength;
+        }
+        for (int i = 0; i < fdCount; i++) {
+            close(fds[i]);
+        }
+        if (!received) {
+            break;
+        }
+
+        reply[0] = (unsigned char)status;
+        putBigEndian64(reply + 4, resultLength);
+        if (!writeFull(fd, reply, sizeof(reply)) || !writeFull(fd, worker->reply.data, (size_t)bodyLength)) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+// Takes accepted connections off the server queue, forever
+static void *serveThread(void *arg) {
+    ServeWorker *worker = arg;
+    ServeQueue *queue = worker->queue;
+    stbi_set_flip_vertically_on_load_thread(0);
+    stbi_set_unpremultiply_on_load_thread(0);
+    stbi_convert_iphone_png_to_rgb_thread(0);
+
+    while (1) {
+        lockBatch(&queue->lock);
+        while (queue->count == 0) {
+            waitBatchSignal(&queue->ready, &queue->lock);
+        }
+        int fd = queue->fds[queue->head];
+        queue->head = (queue->head + 1) % SERVE_BACKLOG;
+        queue->count--;
+        wakeBatchWorkers(&queue->ready);
+        unlockBatch(&queue->lock);
+        serveConnection(worker, fd);
+    }
+    return NULL;
+}
+#endif
+
+// Runs the daemon mode: --serve SOCKET [-j N]. Only returns on a setup error.
+int runServer(int argc, char *argv[]) {
+#ifdef _WIN32
+    (void)argc;
+    (void)argv;
+    printf("Server mode needs Unix domain sockets and isn't available on this platform.\n");
+    return 1;
+#else
+    const char *path = argc > 2 ? argv[2] : NULL;
+    int threads = cpuCount();
+    if (argc == 5 && strcmp(argv[3], "-j") == 0) {
+        threads = atoi(argv[4]);
+    } else if (argc != 3) {
+        path = NULL;
+    }
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (path == NULL || threads < 1 || strlen(path) >= sizeof(address.sun_path)) {
+        printf("Usage: %s --serve SOCKET [-j N]\n", argv[0]);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, SERVE_BACKLOG) != 0) {
+        perror("Error opening socket");
+        return 1;
+    }
+
+    // The pool is started up front and keeps its buffers between requests
+    ServeQueue queue = {0};
+    initBatchLock(&queue.lock);
+    initBatchSignal(&queue.ready);
+    ServeWorker *workers = calloc(threads, sizeof(ServeWorker));
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        workers[i].queue = &queue;
+        reserveBuffer(&workers[i].request, SERVE_BUFFER_BYTES);
+        reserveBuffer(&workers[i].reply, SERVE_BUFFER_BYTES);
+        pthread_create(&thread, NULL, serveThread, &workers[i]);
+        pthread_detach(thread);
+    }
+    printf("Serving on %s with %d threads\n", path, threads);
+    fflush(stdout);
+
+    while (1) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        lockBatch(&queue.lock);
+        while (queue.count == SERVE_BACKLOG) {
+            waitBatchSignal(&queue.ready, &queue.lock);
+        }
+        queue.fds[(queue.head + queue.count) % SERVE_BACKLOG] = fd;
+        queue.count++;
+        wakeBatchWorkers(&queue.ready);
+        unlockBatch(&queue.lock);
+    }
+#endif
+}
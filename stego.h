@@ -0,0 +1,159 @@
+// Embedding engine shared by the command line tool (main.c) and the library (hidenc.c).
+// Not part of the library's public interface, which is hidenc.h.
+#ifndef STEGO_H
+#define STEGO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// BMP headers
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t bfType;      // File type ("BM")
+    uint32_t bfSize;      // File size in bytes
+    uint16_t bfReserved1; // Reserved
+    uint16_t bfReserved2; // Reserved
+    uint32_t bfOffBits;   // Offset to pixel data
+} BMPFileHeader;
+
+typedef struct {
+    uint32_t biSize;          // Header size
+    int32_t biWidth;          // Image width
+    int32_t biHeight;         // Image height
+    uint16_t biPlanes;        // Number of color planes
+    uint16_t biBitCount;      // Bits per pixel (24 for RGB)
+    uint32_t biCompression;   // Compression type (0 for none)
+    uint32_t biSizeImage;     // Image size in bytes
+    int32_t biXPelsPerMeter;  // Horizontal resolution
+    int32_t biYPelsPerMeter;  // Vertical resolution
+    uint32_t biClrUsed;       // Number of colors used
+    uint32_t biClrImportant;  // Important colors
+} BMPInfoHeader;
+#pragma pack(pop)
+
+typedef struct {
+    unsigned char *data;
+    int width;
+    int height;
+} PixelsData;
+
+// Supported numbers of low bits per channel byte that carry the message
+#define MIN_CHANNEL_BITS 1
+#define MAX_CHANNEL_BITS 4
+
+// Packed payload bitstream, most significant bit first
+typedef struct {
+    unsigned char *data;
+    size_t size;   // Buffer size in bytes
+    size_t bitPos; // Next bit to read
+} BitStream;
+
+// Message header: magic "HC", version (high nibble) and depth (low nibble), a reserved byte and
+// the 64-bit big-endian payload length in bytes. It always takes 3 bits per channel.
+#define HEADER_MAGIC0 'H'
+#define HEADER_MAGIC1 'C'
+#define HEADER_VERSION 2
+#define HEADER_BYTES 12
+#define HEADER_CHANNEL_BITS 3
+#define HEADER_CHANNELS (HEADER_BYTES * 8 / HEADER_CHANNEL_BITS)
+
+typedef struct {
+    int depth;       // Bits per channel of the payload
+    uint64_t length; // Payload length in bytes
+} StegoHeader;
+
+// Payload bytes processed at a time by the streaming embed/extract. A multiple of every depth,
+// so whole chunks always end on a channel boundary.
+#define STREAM_CHUNK (12 * 4096)
+
+// A PNG decoded from a file a row at a time (see openPngStream)
+typedef struct PngStream PngStream;
+
+// Receives each decoded row as RGB, top to bottom. Returns 0 to stop the decoding.
+typedef int (*PngRowCallback)(void *user, const unsigned char *rgb, int row);
+
+// A PNG encoded a row at a time (see openPngWriter)
+typedef struct PngWriter PngWriter;
+
+// Receives the next bytes of an encoded PNG, QOI or JPEG. Returns 0 on a write error.
+typedef int (*ImageWriteCallback)(void *user, const unsigned char *bytes, size_t size);
+
+// A QOI decoded a row at a time from a file or memory (see openQoiStream), and one encoded
+typedef struct QoiStream QoiStream;
+typedef struct QoiWriter QoiWriter;
+
+// The quantized DCT coefficients of a JPEG, embedded without decoding to pixels (see
+// readJpegCoefficients)
+typedef struct JpegCoefficients JpegCoefficients;
+
+// Compression levels of the PNG encoder: stored blocks, run-length matches with Huffman codes,
+// and full LZ77 matching
+#define PNG_LEVEL_STORED 0
+#define PNG_LEVEL_FAST 1
+#define PNG_LEVEL_BEST 2
+
+// Pixel array layout of an uncompressed 24-bit BMP
+typedef struct {
+    int width;
+    int height;
+    int bottomUp;        // Rows stored bottom to top (positive biHeight)
+    uint32_t dataOffset; // bfOffBits
+    size_t rowSize;      // Bytes per row including padding
+} BmpLayout;
+
+uint32_t bitStreamRead(BitStream *bs, int nbits);
+void initStegoEngine(void);
+void embedChannels(unsigned char *channels, size_t count, const unsigned char *bits, int depth);
+void extractChannels(const unsigned char *channels, size_t count, unsigned char *bits, int depth);
+void swapRedBlue(const unsigned char *src, unsigned char *dst, size_t pixels);
+uint64_t payloadChannels(uint64_t length, int depth);
+uint64_t payloadCapacity(PixelsData pixelsData, int depth);
+int payloadFits(PixelsData pixelsData, uint64_t length, int depth);
+void embedBytes(unsigned char *channels, const unsigned char *payload, uint64_t length, int depth);
+void extractBytes(const unsigned char *channels, unsigned char *payload, uint64_t length, int depth);
+void encodeHeader(StegoHeader header, unsigned char *bytes);
+void writeHeader(PixelsData pixelsData, StegoHeader header);
+int readHeader(PixelsData pixelsData, StegoHeader *header);
+int decodeHeader(const unsigned char *bytes, PixelsData shape, StegoHeader *header);
+int findLegacyPayload(PixelsData pixelsData, uint64_t *length);
+void extractLegacyBytes(PixelsData pixelsData, unsigned char *payload, uint64_t length);
+void embedSpanInStrip(unsigned char *strip, uint64_t stripStart, uint64_t stripCount,
+                      uint64_t spanStart, uint64_t spanCount,
+                      const unsigned char *bits, uint64_t bitsFirstByte, int depth);
+int bmpLayoutFromHeaders(const BMPFileHeader *fileHeader, const BMPInfoHeader *infoHeader, BmpLayout *layout);
+int parseBmpBytes(const unsigned char *bytes, uint64_t size, BmpLayout *layout);
+uint64_t bmpRowsOffset(const BmpLayout *layout, int firstRow, int rows);
+void bmpRowsToRgb(const BmpLayout *layout, const unsigned char *fileRows, unsigned char *rgb, int rows);
+void rgbToBmpRows(const BmpLayout *layout, const unsigned char *rgb, unsigned char *fileRows, int rows);
+uint64_t bmpFileSize(int width, int height);
+void encodeBmp(int width, int height, const unsigned char *pixelData, int topDown, unsigned char *out);
+int decodePngPayload(const unsigned char *png, size_t len, PixelsData *pixelsData);
+int decodeJpegPayload(const unsigned char *jpg, size_t len, PixelsData *pixelsData);
+int decodePayloadPixels(const unsigned char *bytes, size_t len, PixelsData *pixelsData);
+PngStream *openPngStream(FILE *file, int *width, int *height);
+int decodePngStream(PngStream *stream, int rows, PngRowCallback callback, void *user);
+void closePngStream(PngStream *stream);
+PngWriter *openPngWriter(int width, int height, int level, int threads, ImageWriteCallback write, void *user);
+int writePngRows(PngWriter *writer, const unsigned char *rgb, int rows);
+int closePngWriter(PngWriter *writer);
+int qoiInfo(const unsigned char *bytes, size_t len, int *width, int *height, int *channels);
+QoiStream *openQoiStream(FILE *file, int *width, int *height, int *channels);
+QoiStream *openQoiMemory(const unsigned char *bytes, size_t len, int *width, int *height, int *channels);
+int readQoiRows(QoiStream *stream, unsigned char *rgb, int rows);
+unsigned char *readQoiImage(QoiStream *stream);
+void closeQoiStream(QoiStream *stream);
+int decodeQoiPayload(const unsigned char *qoi, size_t len, PixelsData *pixelsData);
+unsigned char *decodeRgb(const unsigned char *bytes, size_t len, int *width, int *height);
+QoiWriter *openQoiWriter(int width, int height, ImageWriteCallback write, void *user);
+int writeQoiRows(QoiWriter *writer, const unsigned char *rgb, int rows);
+int closeQoiWriter(QoiWriter *writer);
+int readPpmHeader(FILE *file, int *width, int *height);
+JpegCoefficients *readJpegCoefficients(const unsigned char *jpg, size_t len);
+uint64_t jpegPayloadCapacity(const JpegCoefficients *jpeg);
+int embedJpegPayload(JpegCoefficients *jpeg, const unsigned char *payload, uint64_t length);
+unsigned char *extractJpegPayload(const JpegCoefficients *jpeg, uint64_t *length);
+int writeJpegCoefficients(const JpegCoefficients *jpeg, ImageWriteCallback write, void *user);
+void freeJpegCoefficients(JpegCoefficients *jpeg);
+
+#endif
@@ -0,0 +1,159 @@
+// Checks of the library on images built in memory. Run from the repository root:
+//   gcc -o hidenc_test tests/hidenc_test.c hidenc.c -lm -lpthread && ./hidenc_test
+#include "../hidenc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIDTH 64
+#define HEIGHT 48
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void putLittleEndian(uint8_t *bytes, uint32_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+// Builds a 24-bit BMP of noise, whose low bits look like no message at all. A negative height
+// makes it top-down.
+static uint8_t *makeSizedBmp(int width, int height, size_t *len, uint32_t seed) {
+    int rows = height < 0 ? -height : height;
+    size_t rowSize = ((size_t)width * 3 + 3) & ~(size_t)3;
+    *len = 54 + rowSize * rows;
+    uint8_t *bmp = calloc(1, *len);
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    putLittleEndian(bmp + 2, (uint32_t)*len, 4);
+    putLittleEndian(bmp + 10, 54, 4);
+    putLittleEndian(bmp + 14, 40, 4);
+    putLittleEndian(bmp + 18, (uint32_t)width, 4);
+    putLittleEndian(bmp + 22, (uint32_t)height, 4);
+    putLittleEndian(bmp + 26, 1, 2);
+    putLittleEndian(bmp + 28, 24, 2);
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < width * 3; x++) {
+            seed = seed * 1103515245 + 12345;
+            bmp[54 + y * rowSize + x] = (uint8_t)(seed >> 16);
+        }
+    }
+    return bmp;
+}
+
+static uint8_t *makeBmp(size_t *len, uint32_t seed) {
+    return makeSizedBmp(WIDTH, HEIGHT, len, seed);
+}
+
+// The channel of the BMP holding RGB channel i of the image (top row first, stored as BGR)
+static uint8_t *bmpChannel(uint8_t *bmp, size_t i) {
+    size_t rowSize = (WIDTH * 3 + 3) & ~(size_t)3;
+    size_t pixel = i / 3, row = pixel / WIDTH;
+    return bmp + 54 + (HEIGHT - 1 - row) * rowSize + (pixel % WIDTH) * 3 + (2 - i % 3);
+}
+
+// Hides text the way versions before the payload header did: a 9-bit count of 3-bit codes,
+// then a 9-bit code per character, 3 bits per channel
+static void hideLegacyText(uint8_t *bmp, const char *text) {
+    size_t length = strlen(text);
+    size_t channel = 0;
+    for (size_t i = 0; i <= length; i++) {
+        unsigned code = i == 0 ? (unsigned)length * 3 : (unsigned char)text[i - 1];
+        for (int shift = 6; shift >= 0; shift -= 3, channel++) {
+            uint8_t *c = bmpChannel(bmp, channel);
+            *c = (uint8_t)((*c & ~7) | (code >> shift & 7));
+        }
+    }
+}
+
+// Builds a QOI of width x height pixels, each a full QOI_OP_RGB
+static uint8_t *makeQoi(int width, int height, size_t *len) {
+    static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    *len = 14 + (size_t)width * height * 4 + sizeof(end);
+    uint8_t *qoi = calloc(1, *len);
+    memcpy(qoi, "qoif", 4);
+    for (int i = 0; i < 4; i++) {
+        qoi[4 + i] = (uint8_t)(width >> (24 - 8 * i));
+        qoi[8 + i] = (uint8_t)(height >> (24 - 8 * i));
+    }
+    qoi[12] = 3;
+    for (int i = 0; i < width * height; i++) {
+        uint8_t *op = qoi + 14 + 4 * i;
+        op[0] = 0xFE;
+        op[1] = (uint8_t)(i * 40);
+        op[2] = (uint8_t)(i * 70);
+        op[3] = (uint8_t)(i * 90);
+    }
+    memcpy(qoi + *len - sizeof(end), end, sizeof(end));
+    return qoi;
+}
+
+int main(void) {
+    hidenc_out out;
+    size_t len;
+
+    // An image nothing was hidden in holds no payload
+    for (uint32_t seed = 1; seed <= 20; seed++) {
+        uint8_t *bmp = makeBmp(&len, seed);
+        check(hidenc_extract(bmp, len, &out) == HIDENC_ERR_NOT_FOUND, "unmodified image is not found");
+        check(out.data == NULL && out.size == 0, "not found leaves no result");
+        hidenc_free(&out);
+        free(bmp);
+    }
+
+    // What is embedded comes back
+    uint8_t *bmp = makeBmp(&len, 7);
+    const char *payload = "the payload";
+    hidenc_out embedded;
+    check(hidenc_embed(bmp, len, (const uint8_t *)payload, strlen(payload), &embedded) == HIDENC_OK, "embed");
+    check(hidenc_extract(embedded.data, embedded.size, &out) == HIDENC_OK, "extract after embed");
+    check(out.size == strlen(payload) && memcmp(out.data, payload, out.size) == 0, "extracted payload");
+    hidenc_free(&out);
+    hidenc_free(&embedded);
+
+    // Text hidden by older versions is still read
+    hideLegacyText(bmp, "Hello, old world!");
+    check(hidenc_extract(bmp, len, &out) == HIDENC_OK, "extract legacy text");
+    check(out.size == 17 && memcmp(out.data, "Hello, old world!", 17) == 0, "legacy text");
+    hidenc_free(&out);
+    free(bmp);
+
+    // An image with fewer channels than the header needs can't carry even an empty payload
+    uint8_t *qoi = makeQoi(2, 2, &len);
+    uint64_t capacity = 1;
+    check(hidenc_capacity(qoi, len, NULL, &capacity) == HIDENC_OK && capacity == 0, "tiny image capacity");
+    check(hidenc_embed(qoi, len, (const uint8_t *)"", 0, &out) == HIDENC_ERR_TOO_SMALL,
+          "empty payload in tiny image");
+    hidenc_free(&out);
+    check(hidenc_extract(qoi, len, &out) == HIDENC_ERR_NOT_FOUND, "extract from tiny image");
+    hidenc_free(&out);
+    free(qoi);
+
+    // The same for a BMP, whichever its row order, and the file is left as it was
+    for (int height = 2; height >= -2; height -= 4) {
+        uint8_t *tiny = makeSizedBmp(2, height, &len, 3);
+        uint8_t *copy = malloc(len);
+        memcpy(copy, tiny, len);
+        check(hidenc_embed(tiny, len, (const uint8_t *)"", 0, &out) == HIDENC_ERR_TOO_SMALL,
+              "empty payload in tiny BMP");
+        hidenc_free(&out);
+        check(hidenc_extract(tiny, len, &out) == HIDENC_ERR_NOT_FOUND, "extract from tiny BMP");
+        hidenc_free(&out);
+        check(memcmp(tiny, copy, len) == 0, "tiny BMP untouched");
+        free(copy);
+        free(tiny);
+    }
+
+    if (failures == 0) {
+        printf("All tests passed\n");
+    }
+    return failures != 0;
+}